@@ -6,63 +6,6 @@
 \****************************************************************************/
 #define VERSION "v1.01 - October 18, 2008"
 
-#define MAX_TRACKS 32
-#define MAX_CHANNELS 16
-#define MAX_PROGRAMS 127
-#define MAX_NOTES 127
-
-#define MAX_STRING_SIZE 255
-#define MAX_NOTE_LETTER_SIZE 5
-#define MAX_NOTE_DEFINITION_SIZE 12
-
-/* These are MIDI note values. N_C is middle-C, aka C4. These should not vary
-   from keyboard to keyboard, so these should never change. */
-#define N_C4  (0x3c)
-#define N_C4S (N_C4+1)
-#define N_D4  (N_C4+2)
-#define N_D4S (N_C4+3)
-#define N_E4  (N_C4+4)
-#define N_E4S (N_C4+5)
-#define N_F4  (N_C4+5)
-#define N_F4S (N_C4+6)
-#define N_G4  (N_C4+7)
-#define N_G4S (N_C4+8)
-#define N_A5  (N_C4+9)
-#define N_A5S (N_C4+10)
-#define N_B5  (N_C4+11)
-#define N_B5S  (N_C4+12)
-
-/* Since I'm too lazy to actually write out the MIDI note values for each
-   octave as above, I use this macro to "offset" the octave given the note
-   as identified by one of the macros above (n parameter), and a signed
-   value indicating the relative octave from that (o parameter). For
-   example:
-
-   OCTAVE(N_DS,-1) is the same as what we'd otherwise get by doing N_DS, but
-   one octave lower. WARNING: No bounds checking! (OMG, heathen!) */
-#define OCTAVE(n,o) ((n)+(12*(o)))
-
-#define LUTE_NOTE_MIN OCTAVE(N_C4,-2)
-#define LUTE_NOTE_MAX OCTAVE(N_C4,1)
-
-#define HARP_NOTE_MIN OCTAVE(N_C4,-2)
-#define HARP_NOTE_MAX OCTAVE(N_C4,1)
-
-#define THEORBO_NOTE_MIN OCTAVE(N_C4,-2)
-#define THEORBO_NOTE_MAX OCTAVE(N_C4,1)
-
-#define HORN_NOTE_MIN OCTAVE(N_C4S,-2)
-#define HORN_NOTE_MAX OCTAVE(N_C4,1)
-
-#define FLUTE_NOTE_MIN OCTAVE(N_C4,-2)
-#define FLUTE_NOTE_MAX OCTAVE(N_C4,1)
-
-#define BAGPIPES_NOTE_MIN OCTAVE(N_C4,-2)
-#define BAGPIPES_NOTE_MAX OCTAVE(N_C4,1)
-
-#define CLARINET_NOTE_MIN OCTAVE(N_D4,-2)
-#define CLARINET_NOTE_MAX OCTAVE(N_C4,1)
-
 
 /****************************************************************************\
                               HEADER INCLUDES
@@ -75,26 +18,12 @@
 #include <math.h>
 #include <mmreg.h>
 #include <msacm.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "MIDI2ABC.h"
-
-
-/****************************************************************************\
-                                DEBUG CODE
-\****************************************************************************/
-#ifdef _DEBUG
-void DebugMsg(const char * const file, int line, const char * const text)
-{
-  /*
-	char fmt[] = "%s %d: %s";
-	char i[255];
-	_snprintf(i,254,fmt,file,line,text);
-  */
-	char fmt[] = "%s";
-	char i[255];
-	_snprintf_s(i,254,fmt,text);
-	OutputDebugString(i);
-}
-#endif
+#include "MIDI2ABCCore.h"
+#include "MIDI2ABCWav.h"
 
 
 /****************************************************************************\
@@ -105,31 +34,40 @@ void DebugMsg(const char * const file, int line, const char * const text)
    for each MIDI device in the system. */
 #define MAX_SUPPORTED_DEVICES 50
 
-/* MIDI device handles. Could be several since we just cart-blanche open all
-   MIDI output devices. */
-HMIDIOUT hMidiOut[MAX_SUPPORTED_DEVICES];
-
-/* Identifies which MIDI output devices we've opened. */
-bool devOpen[MAX_SUPPORTED_DEVICES] = {false};
-
-/* Gets filled with the number of MIDI input devices in the system. */
-unsigned int numDevices = 0;
-
+/* The preview timer goes off this many microseconds before a note is due
+   and the rest is waited out on the performance counter, which is finer
+   than the timer. */
+#define PREVIEW_SPIN_US 1000
+
+/* How far ',' and '.' move while previewing, and what previewReadKey adds
+   to the virtual key codes of keys that have no character. */
+#define PREVIEW_SEEK_MS 5000
+#define PREVIEW_KEY_VIRTUAL 0x100
+
+/* Commands the preview ring holds, which must be a power of two, the
+   longest the scheduler sleeps before it publishes its position again, and
+   how often the console thread redraws the clock. */
+#define PREVIEW_RING_SIZE 64
+#define PREVIEW_POSITION_US 100000
+#define PREVIEW_REDRAW_MS 100
+
+/* Commands for the preview scheduler. */
+#define PREVIEW_CMD_STOP 0
+#define PREVIEW_CMD_SEEK_TO 1    // value: milliseconds
+#define PREVIEW_CMD_SEEK_BY 2    // value: milliseconds
+#define PREVIEW_CMD_LOOP_START 3
+#define PREVIEW_CMD_LOOP_END 4
+#define PREVIEW_CMD_LOOP_CLEAR 5
+#define PREVIEW_CMD_MUTE 6       // value: track
+#define PREVIEW_CMD_SOLO 7       // value: track
+#define PREVIEW_CMD_SPEED 8      // value: percent
+
+/* Preview speed in percent: '-' and '+' step it between the limits. */
+#define PREVIEW_SPEED_STEP 10
+#define PREVIEW_SPEED_MIN 20
+#define PREVIEW_SPEED_MAX 400
 
 #pragma pack(1)
-typedef struct {
-  char           ID[4];
-  unsigned long  length;
-} midiChunkHdrType;
-
-typedef struct {
-    midiChunkHdrType  hdr;
-   /* Here are the 6 bytes */
-   unsigned short     format;
-   unsigned short     numTracks;
-   unsigned short     ppqn;
-} midiChunkMThdType;
-
 /* This is a generic way to deconstruct dwParam1 into a MIDI event. The 
    "event" will determine what param1 and param2 do. At that point, you can
    cast this to one of the more specific types. */
@@ -140,99 +78,134 @@ typedef struct {
   DWORD param2:8;
 } midiEventType;
 
-/* A more specific deconstruction of dwParam1 from the MIDI driver for use in
-   both note on and note off events. */
-typedef struct {
-  DWORD channel:4;
-  DWORD event:4;
-  DWORD note:8;
-  DWORD velocity:8;
-} midiNoteOnEventType;
-#pragma pack()
-
-
+/* Where preview MIDI goes. Every call gets the backend's context. begin
+   and end bracket a preview; send gets the time the message was due, in
+   microseconds from begin. */
 typedef struct
 {
-  void * prev;
-  void * next;
-
-  unsigned char note;
-
-  unsigned long startTick; // milliseconds from file start
-  unsigned long endTick;   // milliseconds from file start
-
-  unsigned char program;
-  unsigned char channel;
-  unsigned char track;
-} noteListItemType;
-
+  const char * name;
+  void      (* begin)(void * context);
+  void      (* send)(void * context, DWORD message, unsigned long long due);
+  void      (* reset)(void * context);
+  void      (* volume)(void * context, DWORD volume);
+  void      (* end)(void * context);
+  void       * context;
+} midiBackendType;
+
+/* A MIDI message of the preview and when it is due. */
+typedef struct
+{
+  unsigned long tick;    // milliseconds from file start
+  DWORD         message;
+  unsigned int  track;
+  bool          noteOn;
+} previewEventType;
 
+/* A command from the console thread to the preview scheduler. */
 typedef struct
 {
-  void * prev;
-  void * next;
-
-  char * name;
-  char * instrument;
-  unsigned int track;
-  bool   active;
-  bool   lead;
-  int    transpose;
-  bool   flip_oor;
-  bool   transpose_autoselect;
-  unsigned int program;
-} trackListItemType;
+  int  command;          // PREVIEW_CMD_*
+  long value;
+} previewCommandType;
 
+/* Single-producer, single-consumer ring of commands. Only the console
+   thread moves tail and only the scheduler moves head. */
 typedef struct
 {
-  unsigned long tick;     // milliseconds from file start
-  char          name[MAX_STRING_SIZE];
-  char          instrument[MAX_STRING_SIZE];
-  unsigned int  track;
-  unsigned int  program;
-} trackStatusType;
+  previewCommandType slots[PREVIEW_RING_SIZE];
+  volatile LONG      head;
+  volatile LONG      tail;
+} previewRingType;
 
+/* What the console thread and the preview scheduler thread share. */
 typedef struct
 {
-  unsigned char on;
-  unsigned long startTick;// milliseconds from file start
-  unsigned char program;
-} noteStatusType;
+  previewEventType * events;
+  unsigned int       numEvents;
+  unsigned int       track;       // previewed track, 0 for the file
+
+  LARGE_INTEGER      frequency;
+  LARGE_INTEGER      startTime;
+
+  previewRingType    commands;
+  HANDLE             wake;        // set after each command is pushed
 
+  volatile LONG      position;    // file position in milliseconds
+  volatile LONG      looping;
+  volatile LONG      finished;
 
+  /* Read once the scheduler has finished. */
+  unsigned long      numBatches;
+  unsigned long long totalLate;   // microseconds
+  unsigned long long maxLate;     // microseconds
+} previewPlayerType;
+
+/* A MIDI message as the recording backend saw it. */
 typedef struct
 {
-  unsigned char      currentProgram;
-  noteStatusType     noteStatus[MAX_NOTES];
-} channelStatusType;
+  DWORD              message;
+  unsigned long long due;  // microseconds from begin
+  unsigned long long sent; // microseconds from begin
+} midiRecordType;
 
+/* Context of the recording backend. */
+typedef struct
+{
+  LARGE_INTEGER    frequency;
+  LARGE_INTEGER    startTime;
+  midiRecordType * records;
+  unsigned long    numRecords;
+  unsigned long    capacity;
+} midiRecorderType;
+
+/* Context of the devices backend. */
 typedef struct
 {
-  unsigned char     lastStatus;
-  unsigned int      ppqn;
-  unsigned int      numTracks;
-  unsigned long     format;
-  unsigned char     currentTrack;
-  unsigned long     currentTempo;
+  /* MIDI device handles. Could be several since we just cart-blanche open
+     all MIDI output devices. */
+  HMIDIOUT     hMidiOut[MAX_SUPPORTED_DEVICES];
+
+  /* Identifies which MIDI output devices we've opened. */
+  bool         devOpen[MAX_SUPPORTED_DEVICES];
 
-  trackStatusType   trackStatus[MAX_TRACKS];
-  channelStatusType channelStatus[MAX_CHANNELS];
-} fileStatusType;
+  /* Gets filled with the number of MIDI output devices in the system. */
+  unsigned int numDevices;
+} midiDevicesType;
+
+/* A more specific deconstruction of dwParam1 from the MIDI driver for use in
+   both note on and note off events. */
+typedef struct {
+  DWORD channel:4;
+  DWORD event:4;
+  DWORD note:8;
+  DWORD velocity:8;
+} midiNoteOnEventType;
+#pragma pack()
 
 /****************************************************************************\
                      VARIABLE AND MACRO DECLARATIONS
 \****************************************************************************/
-noteListItemType  * noteList = NULL;
-noteListItemType  * noteFilteredList = NULL;
-trackListItemType * trackList = NULL;
-trackListItemType * trackFilteredList = NULL;
-#ifdef _DEBUG
-unsigned long lastNoteOnTick = 0;
-#endif
-float gStretch = 1.0f;
+/* The one conversion the tool works on. */
+conversionType gConversion;
+
 trackListItemType * selectedTrack = 0;
-unsigned char instMaxNote = 0;
-unsigned char instMinNote = 0;
+
+/* Previews go to this WAV file instead of the MIDI devices when set. */
+char * gWavFileName = NULL;
+
+/* Write each active track as its own tune instead of merging them. */
+bool gWriteParts = false;
+
+/* When not -1, ABC is streamed to this file descriptor as it is made and
+   the interactive menus are skipped, so the tool can run in a pipeline. */
+int gAbcFd = -1;
+
+/* Play the whole file once through the MIDI backend, without the menus or
+   the keys, then exit. */
+bool gPlayOnly = false;
+
+/* Most instruments that can be given in one comma separated list. */
+#define MAX_FANOUT_INSTRUMENTS 16
 
 /****************************************************************************\
                   LOCAL FUNCTION FORWARD-DECLARATIONS
@@ -252,16 +225,15 @@ unsigned char instMinNote = 0;
 **   the application!
 **
 *****************************************************************************/
-void midiCloseDevices()
+void midiCloseDevices(midiDevicesType * devices)
 {
-  MMRESULT mmr;
-  for( unsigned int i = 0; i < numDevices; i++ )
+  for( unsigned int i = 0; i < devices->numDevices; i++ )
   {
-    if ( devOpen[i] )
+    if ( devices->devOpen[i] )
     {
-      midiOutReset(hMidiOut[i]);
-      mmr = midiOutClose(hMidiOut[i]);
-      devOpen[i] = false;
+      midiOutReset(devices->hMidiOut[i]);
+      midiOutClose(devices->hMidiOut[i]);
+      devices->devOpen[i] = false;
     }
   }
 }
@@ -274,13 +246,13 @@ void midiCloseDevices()
 **   enumerated from 0 to one less than the number of devices in the system.
 **
 *****************************************************************************/
-bool midiOpenDevice( unsigned int devid )
+bool midiOpenDevice( midiDevicesType * devices, unsigned int devid )
 {
   MMRESULT mmr;
-  if ( !devOpen[devid] )
+  if ( !devices->devOpen[devid] )
   {
     mmr = midiOutOpen(
-      &hMidiOut[devid],          
+      &devices->hMidiOut[devid],
       devid,
       NULL,
       NULL, /* client data, which we don't need (yet) */
@@ -288,7 +260,7 @@ bool midiOpenDevice( unsigned int devid )
     );
     if( mmr == MMSYSERR_NOERROR )
     {
-      devOpen[devid] = true;
+      devices->devOpen[devid] = true;
 
       //mmr = midiOutStart(hMidiIn[devid]);
     }
@@ -318,6 +290,39 @@ void print_header_info ( void )
   printf("\n\n");
 }
 
+/*
+** FUNCTION print_usage
+**
+** DESCRIPTION
+** 
+**
+*****************************************************************************/
+void print_usage ( void )
+{
+  printf("\nUsage: MIDI2ABC [options] <instrument> <inFileName>\n\n");
+  printf("  instrument\t= One of the following:\n");
+  printf("  \t\t    lute harp theorbo clarinet horn flute bagpipes\n");
+  printf("  \t\t  or a comma separated list of them, e.g. lute,flute,horn\n");
+  printf("  inFileName\t= The filename of the MIDI file.\n\n");
+  printf("  options:\n");
+  printf("  -g <ms>\t= Timing grid in milliseconds: 30 40 50 60 (default) 80\n");
+  printf("  -d <n>\t= Quantize to 1/n notes using the song tempo: 8 16 32 64\n");
+  printf("  -c <ms>\t= Join notes starting this close together into chords (default 0)\n");
+  printf("  -n <notes>\t= Most notes to write for one chord (default 5)\n");
+  printf("  -p\t\t= Write each track as its own part (X: 1, X: 2, ...)\n");
+  printf("  -r\t\t= Write bar lines and fold repeated bars into |: :| repeats\n");
+  printf("  -a\t\t= Write K: C and an accidental on every note instead of\n");
+  printf("  \t\t  working out the key\n");
+  printf("  -m <backend>\t= Where previews play: devices (default), record to time\n");
+  printf("  \t\t  every message and report lateness, or null\n");
+  printf("  -t\t\t= Play the whole file once through the -m backend and exit,\n");
+  printf("  \t\t  e.g. to time the scheduler with -m record\n");
+  printf("  -w <file>\t= Render previews to a WAV file instead of the MIDI devices;\n");
+  printf("  \t\t  with -o the first instrument is rendered as written\n");
+  printf("  -o <file>\t= Stream ABC to a file, or - for stdout, without the menus\n");
+  printf("  \t\t  A <inFileName> of - reads the MIDI file from stdin.\n\n");
+}
+
 /*
 ** FUNCTION clrscn
 **
@@ -358,7 +363,7 @@ void NewScreen(bool showTracks)
   
   if( showTracks )
   {
-    trackListItemType * trackItem = trackList;
+    trackListItemType * trackItem = gConversion.trackList;
     while( trackItem != NULL )
     {
       char markedChar = ' ';
@@ -400,2581 +405,1608 @@ void NewScreen(bool showTracks)
 }
 
 /*
-** FUNCTION ResetTrackList
+** FUNCTION OpenOutputFile
 **
 ** DESCRIPTION
 **   
 **
 *****************************************************************************/
-void ResetTrackList(trackListItemType * &thisTrackList)
+#if 0
+int OpenOutputFile(unsigned int trackNum)
 {
-  trackListItemType * trackItem = thisTrackList;
+  char  * cpos = NULL;
+
+  if( trackNum > MAX_TRACKS )
+  {
+    return 0;
+  }
 
-  while( trackItem != NULL )
+  if( strlen( outFileName[trackNum-1] ) != 0 )
   {
-    trackListItemType * nextTrackItem = (trackListItemType *)trackItem->next;
-    if( trackItem->name != NULL )
+    /* Generate output filenames. */  
+    strcpy( outFileName[trackNum-1], inFileName );
+    cpos = outFileName[trackNum-1] + strlen( outFileName[trackNum-1] );
+    while( *cpos != '.' && cpos != outFileName[trackNum-1] ) cpos--;
+    if ( cpos != outFileName[trackNum-1] )
     {
-      delete [] trackItem->name;
+      *cpos = '\0';
     }
-    if( trackItem->instrument != NULL )
+
+    strcat( outFileName[trackNum-1], ".abc" );
+
+    /* Attempt to open all output files for writing. */
+    outFilePtr[trackNum-1]    = fopen( outFileName[trackNum-1], "wb" );
+    if ( outFilePtr[trackNum-1] == NULL )
     {
-      delete [] trackItem->instrument;
+      printf( "ERROR: Can not open %s for writing. (Is there enough space?)\n", 
+          outFileName[trackNum-1] );
+      exit(-1);   
     }
-    delete trackItem;
-    trackItem = nextTrackItem;
   }
 
-  thisTrackList = NULL;
-}
+  return 1;
+} 
+#endif
+
 
 /*
-** FUNCTION ResetTrackList
+** FUNCTION parseMIDIFile
 **
 ** DESCRIPTION
-**   
+**   Reads a MIDI file into memory and parses it. A file name of "-" reads
+**   the file from standard input instead.
 **
 *****************************************************************************/
-unsigned int CountNotes(
-  noteListItemType * &thisNoteList,
-  unsigned int track
-  )
+int parseMIDIFile(char * inFileName, unsigned int * format, unsigned int * numTracks)
 {
-  unsigned int count = 0;
-  noteListItemType * noteItem = thisNoteList;
+  unsigned long     inFileSize = 0;
+  unsigned long     capacity = 0;
+  unsigned char   * fileData = NULL;
+  FILE             *inFilePtr = NULL;
+  bool              fromStdin = ( 0 == strcmp( inFileName, "-" ) );
+  int               retval = 0;
 
-  while( noteItem != NULL )
+  if( fromStdin )
   {
-    if( noteItem->track == track )
-    {
-      count++;
-    }
-    noteItem = (noteListItemType *)noteItem->next;
+    inFilePtr = stdin;
+    (void)_setmode( _fileno( stdin ), _O_BINARY );
+  }
+  else
+  {
+    fopen_s( &inFilePtr, inFileName, "rb" );
   }
 
-  return count;
-}
-
-/*
-** FUNCTION DeleteTrack
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-trackListItemType * DeleteTrack(
-  trackListItemType * &thisTrackList,
-  trackListItemType * delme
-  )
-{
-  trackListItemType * trackItem = thisTrackList;
-  trackListItemType * nextTrackItem = NULL;
-  bool reassignLead = false;
+  if ( inFilePtr == NULL ) 
+  {
+    printf( "ERROR: Can not open %s for reading. (Did you get the filename and path correct?)\n", 
+      inFileName );
+    return -1;   
+  }
 
-  while( trackItem != NULL )
+  /* Pipes can't be sized up front, so read until the end in growing
+     blocks. */
+  for( ;; )
   {
-    nextTrackItem = (trackListItemType *)trackItem->next;
-    if( trackItem == delme )
+    if( inFileSize == capacity )
     {
-      if( trackItem->lead )
-      {
-        reassignLead = true;
-      }
+      unsigned char * grown = new unsigned char[capacity + 65536];
 
-      if( thisTrackList == trackItem )
+      if( fileData != NULL )
       {
-        thisTrackList = nextTrackItem;
-      }
-      if( trackItem->prev != NULL )
-      {
-        ((trackListItemType *)trackItem->prev)->next = (void *)nextTrackItem;
-      }
-      if( nextTrackItem != NULL )
-      {
-        nextTrackItem->prev = trackItem->prev;
+        memcpy( grown, fileData, inFileSize );
+        delete [] fileData;
       }
 
+      fileData = grown;
+      capacity += 65536;
+    }
 
-      if( trackItem->name != NULL )
-      {
-        delete [] trackItem->name;
-      }
-      if( trackItem->instrument != NULL )
-      {
-        delete [] trackItem->instrument;
-      }
-      delete trackItem;
+    size_t numRead = fread( &fileData[inFileSize], 1, capacity - inFileSize, inFilePtr );
+
+    if( numRead == 0 )
+    {
       break;
     }
-    trackItem = nextTrackItem;
+
+    inFileSize += (unsigned long)numRead;
   }
 
-  if( reassignLead )
+  if( !fromStdin )
   {
-    if( thisTrackList != NULL )
-    {
-      thisTrackList->lead = true;
-    }
+    fclose( inFilePtr );
   }
-  
-  return nextTrackItem;
-}
 
-/*
-** FUNCTION GetTrack
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-trackListItemType * GetTrack(
-  trackListItemType * &thisTrackList,
-  unsigned int track
-  )
-{
-  trackListItemType * retval = NULL;
-  trackListItemType * trackItem = thisTrackList;
+  /* Show filenames to user. */
+  printf( "[input]\nMIDI file: %s\n\n", inFileName );
 
-  while( trackItem != NULL )
-  {
-    if( trackItem->track == track )
-    {
-      retval = trackItem;
-      break;
-    }
-    trackItem = (trackListItemType *)trackItem->next;
-  }
+  retval = parseMIDIData( &gConversion, fileData, inFileSize, format, numTracks );
+
+  delete [] fileData;
 
   return retval;
 }
 
+
 /*
-** FUNCTION AddTrack
+** FUNCTION adaptNoteData_Transpose
 **
 ** DESCRIPTION
 **   
 **
 *****************************************************************************/
-void AddTrack(
-  trackListItemType * &thisTrackList,
-  trackListItemType * cpyTrack,
-  unsigned int track,
-  unsigned int program,
-  char       * name,
-  char       * instrument
+int adaptNoteData_Transpose(
+  trackListItemType * trackItem,
+  unsigned char instMinNote,
+  unsigned char instMaxNote
   )
 {
-  trackListItemType * trackItem = new trackListItemType;
-  trackListItemType * trackItemHead = thisTrackList;
-
-  if( cpyTrack == NULL )
-  {
-    ZeroMemory( trackItem, sizeof( trackListItemType ) );
-
-    trackItem->active = true;
-
-    if( thisTrackList == NULL )
-    {
-      trackItem->lead = true;
-    }
-    else
-    {
-      trackItem->lead = false;
-    }
-    trackItem->transpose = 0;
-    trackItem->track = track;
-    trackItem->flip_oor = true;
-    trackItem->transpose_autoselect = true;
-    trackItem->program = program;
-  
-    unsigned int name_sz = (unsigned int)strlen(name);
-    unsigned int inst_sz = (unsigned int)strlen(instrument);
-
-    trackItem->name = new char[name_sz+1];
-    trackItem->instrument = new char[inst_sz+1];
-
-    strcpy_s(trackItem->name, name_sz + 1, name);
-    strcpy_s(trackItem->instrument, inst_sz + 1, instrument);
-  }
-  else
-  {
-    memcpy( trackItem, cpyTrack, sizeof( trackListItemType ) );
-
-    trackItem->next = NULL;
-    trackItem->prev = NULL;
-
-    unsigned int name_sz = (unsigned int)strlen(cpyTrack->name);
-    unsigned int inst_sz = (unsigned int)strlen(cpyTrack->instrument);
+  unsigned char minNote = 127;
+  unsigned char maxNote = 0;
+  unsigned int  numNotes = 0;
+  unsigned int  numTooLow = 0;
+  unsigned int  numTooHigh = 0;
+           char rmsAdjust = 0;
+           char medianAdjust = 0;
+           char noteAverage = 0;
 
-    trackItem->name = new char[name_sz+1];
-    trackItem->instrument = new char[inst_sz+1];
+           int  transpose = 0;
+           int  percentTooLow = 0;
+           int  percentTooHigh = 0;
 
-    strcpy_s(trackItem->name, name_sz + 1, cpyTrack->name);
-    strcpy_s(trackItem->instrument, inst_sz + 1, cpyTrack->instrument);
-    /* TODO: do lead */
-  }
+  int usrInput = 0;
 
-  if( thisTrackList == NULL )
+  if( trackItem->lead && trackItem->transpose_autoselect )
   {
-    thisTrackList = trackItem;
+    adaptNoteData_AutoFit(&gConversion,trackItem,instMinNote,instMaxNote);
+    trackItem->transpose_autoselect = false;
   }
-  else
-  {
-    while( trackItemHead->next != NULL )
-    {
-      trackItemHead = (trackListItemType *)trackItemHead->next;
-    }
 
-    trackItem->prev = (void *)trackItemHead;
-    trackItemHead->next = (void *)trackItem;
-  }
-}
+  numNotes = analyzeNotes(
+    &gConversion, instMinNote, instMaxNote, trackItem->track, trackItem->transpose,
+    &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
+      &noteAverage
+    );
 
+  percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes)); 
+  percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
 
-/*
-** FUNCTION ResetNoteList
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-void ResetNoteList(noteListItemType * &thisNoteList)
-{
-  noteListItemType * noteItem = thisNoteList;
+  NewScreen(true);
 
-  while( noteItem != NULL )
+  /* Analyze and select the transposition */
+  printf("\nTRANSPOSE\n");
+  printf("Press [left|right] to adjust, [enter] to accept changes.\n\n");
+  printf("    |----- too low ------|------ in range ----|----- too high -----|\n");
+  while( usrInput != 13 )
   {
-    noteListItemType * nextNoteItem = (noteListItemType *)noteItem->next;
-    delete noteItem;
-    noteItem = nextNoteItem;
-  }
-
-  thisNoteList = NULL;
-}
-
-/*
-** FUNCTION DeleteNote
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-noteListItemType * DeleteNote(
-  noteListItemType * &thisNoteList,
-  noteListItemType * delme
-  )
-{
-  noteListItemType * noteItem = thisNoteList;
-  noteListItemType * nextNoteItem = NULL;
 
-  while( noteItem != NULL )
-  {
-    nextNoteItem = (noteListItemType *)noteItem->next;
-    if( noteItem == delme )
+    if( numNotes > 0 )
     {
-      if( thisNoteList == noteItem )
+      int numLowDits = (int)ceil((double)percentTooLow / 5.0f);
+      int numHighDits = (int)ceil((double)percentTooHigh / 5.0f);
+
+      printf("\r");
+      for( int x = 0; x < 20 - numLowDits; x++ )
       {
-        thisNoteList = nextNoteItem;
+        printf(" ");
       }
-      if( noteItem->prev != NULL )
+      if( numLowDits > 0 )
       {
-        ((noteListItemType *)noteItem->prev)->next = (void *)nextNoteItem;
+        printf("%3d%%|",percentTooLow);
+        for( int x = 0; x < numLowDits; x++ )
+        {
+          printf("-");
+        }
       }
-      if( nextNoteItem != NULL )
+      else
       {
-        nextNoteItem->prev = noteItem->prev;
+        printf("   0%%");
+      }
+      printf("|-----%3d%% (%3d)-----|",100 - percentTooHigh - percentTooLow, (trackItem->transpose + transpose));
+      if( numHighDits > 0 )
+      {
+        for( int x = 0; x < numHighDits; x++ )
+        {
+          printf("-");
+        }
+        printf("|%3d%%",percentTooHigh);
+      }
+      else
+      {
+        printf("0%%   ");
+      }
+      for( int x = 0; x < 20 - numHighDits; x++ )
+      {
+        printf(" ");
       }
 
-      delete noteItem;
-      break;
-    }
-    noteItem = nextNoteItem;
-  }
-
-  return nextNoteItem;
-}
-
-/*
-** FUNCTION SortNoteListByNote
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-void SortNoteListByNote(noteListItemType * &thisNoteList)
-{
-  int setChanged = 1;
-
-  while( setChanged > 0 )
-  {
-    noteListItemType * noteItem = thisNoteList;
+    }
+    else
+    {
+      printf("No notes on track %d\n",trackItem->track);
+      return -1;
+    }
 
-    setChanged = 0;
+    do
+    {
+      usrInput = _getch();
+    } while( usrInput != 224 && usrInput != 13 );
 
-    while( noteItem != NULL && noteItem->next != NULL )
+    if( usrInput == 224 )
     {
-      if( noteItem->note > ((noteListItemType *)(noteItem->next))->note )
-      {
-        noteListItemType * nextNoteItem = (noteListItemType *)noteItem->next;
-        setChanged = 1;
+      usrInput = _getch();
 
-        if( thisNoteList == noteItem )
-        {
-          thisNoteList = nextNoteItem;
-        }
-        if( noteItem->prev != NULL )
+      if( usrInput == 72 || usrInput == 77 )
+      {
+        if( !trackItem->lead )
         {
-          ((noteListItemType *)noteItem->prev)->next = (void *)nextNoteItem;
+          transpose += 12;
         }
-        if( nextNoteItem->next != NULL )
+        else
         {
-          ((noteListItemType *)nextNoteItem->next)->prev = (void *)noteItem;
+          transpose++;
         }
-
-        nextNoteItem->prev = (noteListItemType *)noteItem->prev;
-        noteItem->next = (noteListItemType *)nextNoteItem->next;
-        nextNoteItem->next = (void *)noteItem;
-        noteItem->prev = (void *)nextNoteItem;
       }
-      else
+      else if( usrInput == 80 || usrInput == 75 )
       {
-        noteItem = (noteListItemType *)noteItem->next;
+        if( !trackItem->lead )
+        {
+          transpose -= 12;
+        }
+        else
+        {
+          transpose--;
+        }
       }
     }
+
+    numNotes = analyzeNotes(
+      &gConversion, instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
+      &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
+      &noteAverage
+      );
+
+    percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes));
+    percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
+  }
+
+
+  if( trackItem->lead )
+  {
+    adjustTrackTranspose( &gConversion, transpose );
+  }
+  else
+  {
+    trackItem->transpose += transpose;
+  }
+
+  printf("\n\nNotes out of range: %d. Do you wish to flip out of range notes? [y/n]",(numTooLow+numTooHigh));
+
+  usrInput = _getch();
+
+  if( usrInput == 'y' || usrInput == 'Y' )
+  {
+    trackItem->flip_oor = true;
+  }
+  else
+  {
+    trackItem->flip_oor = false;
   }
+
+  return 0;
 }
 
 /*
-** FUNCTION SortNoteListByStart
+** FUNCTION adaptNoteData_Quantize
 **
 ** DESCRIPTION
 **   
 **
 *****************************************************************************/
-void SortNoteListByStart(noteListItemType * &thisNoteList)
+int adaptNoteData_Quantize()
 {
-  int setChanged = 1;
-
-  while( setChanged > 0 )
+  int           usrInput = 0;
+  stretchType   stretch = { STRETCH_DEN, STRETCH_DEN };
+  unsigned int  numNotes = 0;
+  int           maxQError = 0;
+  float         biasLevel = 0.0f;
+  float         errorPower = 0.0f;
+  unsigned long lastLeadTrackStart = 0;
+  unsigned long nextLeadTrackStart = 0;
+  
+  /* Analyze and select the stretch */
+  while( usrInput != 'c' && usrInput != 'C' )
   {
-    noteListItemType * noteItem = thisNoteList;
+    numNotes = analyzeTiming(
+      &gConversion,
+      stretch,
+      &maxQError, &biasLevel, &errorPower
+      );
 
-    setChanged = 0;
+    if( numNotes > 0 )
+    {
+      printf("\nSTRETCH[duration = %0.1fx]\n",(double)stretch.num / (double)stretch.den);
+      printf("Max Q Error: %d, Bias Level: %0.03f, Error Power: %0.03f\n",
+        maxQError,
+        biasLevel,
+        errorPower
+        );
+    }
+    else
+    {
+      printf("No notes.\n");
+      return -1;
+    }
 
-    while( noteItem != NULL && noteItem->next != NULL )
+    printf("Press [c] to accept, or [up|down] to stretch|shrink, respectively.");
+    do
     {
-      if( noteItem->startTick > ((noteListItemType *)(noteItem->next))->startTick )
-      {
-        noteListItemType * nextNoteItem = (noteListItemType *)noteItem->next;
-        setChanged = 1;
+      usrInput = _getch();
+    } while( usrInput != 224 && usrInput != 'c' && usrInput != 'C' );
 
-        if( thisNoteList == noteItem )
-        {
-          thisNoteList = nextNoteItem;
-        }
-        if( noteItem->prev != NULL )
-        {
-          ((noteListItemType *)noteItem->prev)->next = (void *)nextNoteItem;
-        }
-        if( nextNoteItem->next != NULL )
-        {
-          ((noteListItemType *)nextNoteItem->next)->prev = (void *)noteItem;
-        }
+    printf("\r                                                                  \r");
+    if( usrInput == 224 )
+    {
+      usrInput = _getch();
 
-        nextNoteItem->prev = (noteListItemType *)noteItem->prev;
-        noteItem->next = (noteListItemType *)nextNoteItem->next;
-        nextNoteItem->next = (void *)noteItem;
-        noteItem->prev = (void *)nextNoteItem;
+      if( usrInput == 72 && stretch.num < STRETCH_NUM_MAX )
+      {
+        stretch.num++;
       }
-      else
+      else if( usrInput == 80 && stretch.num > 1 )
       {
-        noteItem = (noteListItemType *)noteItem->next;
+        stretch.num--;
       }
     }
   }
+
+  gConversion.stretch = stretch;
+
+  return 0;
 }
 
+
 /*
-** FUNCTION AddNote
+** FUNCTION makeABCFileName
 **
 ** DESCRIPTION
-**   
+**   Derives <base>_<instrument>.abc from the MIDI file name. outFileNameBase
+**   receives the MIDI file name without its extension.
 **
 *****************************************************************************/
-noteListItemType * AddNote(
-  noteListItemType * &thisNoteList,
-  unsigned char       note,
-  unsigned long       startTick,
-  unsigned long       endTick,
-  unsigned char       program,
-  unsigned char       channel,
-  unsigned char       track
-  )
+void makeABCFileName(char * inFileName, char * instName, char * outFileNameBase, char * outFileName)
 {
-  noteListItemType * noteItem = new noteListItemType;
-  noteListItemType * noteItemHead = thisNoteList;
-
-  ZeroMemory( noteItem, sizeof( noteListItemType ) );
-
-  noteItem->note = note;
-  noteItem->startTick = startTick;
-  noteItem->endTick = endTick;
-  noteItem->program = program;
-  noteItem->channel = channel;
-  noteItem->track = track;
+  char  * cpos = NULL;
+  char    outFileNamePart[MAX_STRING_SIZE] = { 0 };
 
-  if( thisNoteList == NULL )
+  strcpy_s( outFileNameBase, MAX_STRING_SIZE, inFileName );
+  cpos = outFileNameBase + strlen( outFileNameBase );
+  while( *cpos != '.' && cpos != outFileNameBase ) cpos--;
+  if ( cpos != outFileNameBase )
   {
-    thisNoteList = noteItem;
+    *cpos = '\0';
   }
-  else
-  {
-    while( noteItemHead->next != NULL )
-    {
-      noteItemHead = (noteListItemType *)noteItemHead->next;
-    }
 
-    noteItem->prev = (void *)noteItemHead;
-    noteItemHead->next = (void *)noteItem;
-  }
+  sprintf_s(outFileNamePart, MAX_STRING_SIZE, "_%s.abc",instName);
 
-  return noteItem;
+  strcpy_s( outFileName, MAX_STRING_SIZE, outFileNameBase );
+  strcat_s( outFileName, MAX_STRING_SIZE, outFileNamePart );
 }
 
-
 /*
-** FUNCTION OpenOutputFile
+** FUNCTION writeABCBuffer
 **
 ** DESCRIPTION
-**   
+**   Writes formatted ABC text to a file in one go.
 **
 *****************************************************************************/
-#if 0
-int OpenOutputFile(unsigned int trackNum)
+int writeABCBuffer(char * outFileName, abcBufferType * buf)
 {
-  char  * cpos = NULL;
+  FILE  * outFilePtr = NULL;
 
-  if( trackNum > MAX_TRACKS )
+  fopen_s( &outFilePtr, outFileName, "wb" );
+  if ( outFilePtr == NULL )
   {
-    return 0;
+    printf( "ERROR: Can not open %s for writing. (Is there enough space?)\n", 
+        outFileName );
+    abcBufferFree(buf);
+    exit(-1);   
   }
 
-  if( strlen( outFileName[trackNum-1] ) != 0 )
-  {
-    /* Generate output filenames. */  
-    strcpy( outFileName[trackNum-1], inFileName );
-    cpos = outFileName[trackNum-1] + strlen( outFileName[trackNum-1] );
-    while( *cpos != '.' && cpos != outFileName[trackNum-1] ) cpos--;
-    if ( cpos != outFileName[trackNum-1] )
-    {
-      *cpos = '\0';
-    }
-
-    strcat( outFileName[trackNum-1], ".abc" );
+  /* Show filenames to user. */
+  printf( "\n\n[output]\nABC file: %s\n\n", outFileName );
 
-    /* Attempt to open all output files for writing. */
-    outFilePtr[trackNum-1]    = fopen( outFileName[trackNum-1], "wb" );
-    if ( outFilePtr[trackNum-1] == NULL )
-    {
-      printf( "ERROR: Can not open %s for writing. (Is there enough space?)\n", 
-          outFileName[trackNum-1] );
-      exit(-1);   
-    }
+  if( buf->size > 0 && fwrite(buf->data, buf->size, 1, outFilePtr) != 1 )
+  {
+    printf( "ERROR: Can not write %s. (Is there enough space?)\n", outFileName );
+    fclose(outFilePtr);
+    return -1;
   }
 
-  return 1;
-} 
-#endif
-
+  fclose(outFilePtr);
+  return 0;
+}
 
 /*
-** FUNCTION reorder
+** FUNCTION writeABCFile
 **
 ** DESCRIPTION
 **   
 **
 *****************************************************************************/
+int writeABCFile(conversionType * conv, char * inFileName, char * instName)
+{
+  char    outFileNameBase[MAX_STRING_SIZE] = { 0 }, outFileName[MAX_STRING_SIZE] = { 0 };
+  abcPartType part = { 0 };
+  int     retval = 0;
 
-#define reorderFunc(type, tptr, size) \
-do {\
-  type *ptr = (type *)(tptr);\
-  type *end = (type *)(((char *)(ptr)) + (size) - sizeof(type)); \
-\
-  while( end > (ptr) )\
-  {\
-    type v = *(ptr);\
-    \
-    *(ptr) = *end;\
-    *end = v;\
-\
-    (ptr)++; end--;\
-  }\
-} while(0)
-
-
+  const instrumentType * instrument = findInstrument(instName);
 
-#define reorder1(ptr,size) reorderFunc(unsigned char, ptr, (unsigned int)size)
-#define reorder2(ptr,size) reorderFunc(unsigned short, ptr, (unsigned int)size)
+  /* Generate output filenames. */  
+  makeABCFileName( inFileName, instName, outFileNameBase, outFileName );
 
+  /*                                                                        *\
+  =============================== Format ABC Tune ============================
+  \*                                                                        */
+  part.conv = conv;
+  part.xNumber = 1;
+  part.title = outFileNameBase;
+  part.instName = instName;
+  part.inFileName = inFileName;
+  part.fixedLength = ( instrument != NULL && instrument->fixedLength );
+  part.notes = sortedNoteArray( conv, &part.numNotes );
 
-#if 0
-#define WORD_WIDTH unsigned char
-#define reorder(ptr,size) reorderFunc((WORD_WIDTH *)ptr,(unsigned int)size)
-void reorderFunc( WORD_WIDTH* ptr, unsigned int size )
-{
-  WORD_WIDTH *end = (WORD_WIDTH *)(((char *)ptr) + size - sizeof(WORD_WIDTH));
+  formatABCTune( &part );
+  reportFormatStats( conv, &part.stats );
 
-  while( end > ptr )
-  {
-    WORD_WIDTH v = *ptr;
-    
-    *ptr = *end;
-    *end = v;
+  delete [] part.notes;
 
-    ptr++; end--;
-  }
+  /*                                                                        *\
+  =============================== Write ABC File =============================
+  \*                                                                        */
+  retval = writeABCBuffer( outFileName, &part.buf );
 
-  return;
+  abcBufferFree(&part.buf);
+  return retval;
 }
-#endif
 
 /*
-** FUNCTION readVarLen
+** FUNCTION writeABCParts
 **
 ** DESCRIPTION
-**   
+**   Writes each active track as its own tune (X: 1, X: 2, ...) in a single
+**   ABC file, or to fd if it isn't -1. Tunes sent to fd are numbered from
+**   *xNumber up, which is moved past them so that several instruments in
+**   one stream never repeat a number.
 **
 *****************************************************************************/
-unsigned long readVarLen(unsigned char * data, unsigned long bytesRemaining, unsigned long * val)
+int writeABCParts(conversionType * conv, char * inFileName, char * instName, int fd, unsigned int * xNumber)
 {
-  unsigned long bytesConsumed = 0;
-  unsigned long value = 0;
+  char    outFileNameBase[MAX_STRING_SIZE] = { 0 }, outFileName[MAX_STRING_SIZE] = { 0 };
+  abcBufferType buf = { 0 };
+  int     retval = 0;
 
-  if( data != NULL && val != NULL )
-  {
-    while( bytesConsumed <= ( sizeof( unsigned long ) - 1 ) 
-          && bytesConsumed <= bytesRemaining
-          && 0 != (*data & 0x80) )
-    {
-      value = (value << 7) | ( *data & 0x7f );
-      //value &= *data;
-      bytesConsumed++;
-      data++;
-    }
+  const instrumentType * instrument = findInstrument(instName);
 
-    if( bytesConsumed <= ( sizeof( unsigned long ) - 1 ) 
-        && bytesConsumed <= bytesRemaining )
-    {
-      value = (value << 7) | ( *data & 0x7f );
+  /* Generate output filenames. */  
+  makeABCFileName( inFileName, instName, outFileNameBase, outFileName );
+
+  /*                                                                        *\
+  =============================== Format ABC Tunes ===========================
+  \*                                                                        */
+  unsigned int firstXNumber = ( fd != -1 ) ? *xNumber : 1;
 
-      *val += value;
+  *xNumber = firstXNumber + formatABCParts( conv, &buf, firstXNumber, outFileNameBase, instName, inFileName, ( instrument != NULL && instrument->fixedLength ) );
+
+  /*                                                                        *\
+  =============================== Write ABC File =============================
+  \*                                                                        */
+  if( fd != -1 )
+  {
+    abcEmitterType em;
 
-      bytesConsumed++;
+    abcEmitterInit( &em, conv, &buf, fd, false, NULL, 1 );
+    retval = abcEmitterFlush( &em );
+    if( retval == -1 )
+    {
+      printf( "ERROR: Can not write the ABC output.\n" );
     }
   }
+  else
+  {
+    retval = writeABCBuffer( outFileName, &buf );
+  }
 
-  return bytesConsumed;
+  abcBufferFree(&buf);
+  return retval;
 }
 
 /*
-** FUNCTION parseChannelEvent
+** FUNCTION writeABCStream
 **
 ** DESCRIPTION
-**   
+**   Streams the tune, numbered xNumber, to a file descriptor as it is
+**   formatted. Only the current line and chord are held in memory.
 **
 *****************************************************************************/
-unsigned long parseChannelEvent(unsigned char * data, unsigned long bytesRemaining, fileStatusType * fileStatus)
+int writeABCStream(conversionType * conv, int fd, unsigned int xNumber, char * inFileName, char * instName)
 {
-  unsigned long bytesConsumed = 0;
-  unsigned char thisMsgType = 0;
-  unsigned char channel = 0;
+  char    outFileNameBase[MAX_STRING_SIZE] = { 0 }, outFileName[MAX_STRING_SIZE] = { 0 };
+  abcBufferType  buf = { 0 };
+  abcEmitterType em;
+  int     retval = 0;
 
-  if( fileStatus->lastStatus != 0 )
-  {
-    thisMsgType = fileStatus->lastStatus;
-  }
-  else
+  const instrumentType * instrument = findInstrument(instName);
+
+  makeABCFileName( inFileName, instName, outFileNameBase, outFileName );
+
+  if( 0 == strcmp( inFileName, "-" ) )
   {
-    thisMsgType = *data;
-    data++; bytesRemaining--; bytesConsumed++;
+    strcpy_s( outFileNameBase, MAX_STRING_SIZE, "stdin" );
   }
 
-  channel = thisMsgType & 0x0F;
-  fileStatus->lastStatus = thisMsgType;
+  abcKeyType         key;
+  const abcKeyType * tuneKey = NULL;
 
-  if( (thisMsgType & 0xF0) == 0x80 )
+  if( !conv->explicitAccidentals )
   {
-    TRACEH("[%d ms] Note OFF event at 0x%x: channel=%d, key=%d\n",
-      fileStatus->trackStatus[fileStatus->currentTrack].tick,
-      (unsigned int)data,
-      channel,
-      *data,
-      0
-      );
-    /* note off */
-    if( fileStatus->channelStatus[channel].noteStatus[data[0]].on != 0 )
-    {
-      (void)AddNote(
-        noteList,
-        data[0],
-        fileStatus->channelStatus[channel].noteStatus[data[0]].startTick,
-        fileStatus->trackStatus[fileStatus->currentTrack].tick,
-        fileStatus->channelStatus[channel].noteStatus[data[0]].program,
-        channel,
-        fileStatus->currentTrack
-        );
+    unsigned int histogram[12] = { 0 };
 
-      fileStatus->channelStatus[channel].noteStatus[data[0]].on = 0;
-      fileStatus->channelStatus[channel].noteStatus[data[0]].startTick = 0;
+    for( noteListItemType * noteItem = conv->noteFilteredList; noteItem != NULL; noteItem = (noteListItemType *)noteItem->next )
+    {
+      histogram[noteItem->note % 12]++;
     }
-    bytesConsumed += 2;
+
+    selectKey( histogram, &key );
+    tuneKey = &key;
   }
-  /* MIDI NoteOn Event */
-  else if( (thisMsgType & 0xF0) == 0x90 )
+
+  /* The unit is picked from all the notes before any are written. */
+  bool                fixedLength = ( instrument != NULL && instrument->fixedLength );
+  unsigned int        numNotes = 0;
+  noteListItemType ** notes = sortedNoteArray( conv, &numNotes );
+  unsigned int        unitScale = selectUnitScale( conv, notes, numNotes, fixedLength );
+
+  abcEmitterInit( &em, conv, &buf, fd, fixedLength, tuneKey, unitScale );
+
+  formatABCHeader( conv, &buf, xNumber, outFileNameBase, instName, inFileName, tuneKey, unitScale );
+  retval = abcEmitterFlush( &em );
+
+  /* Repeats can only be found once the whole tune is known. */
+  if( conv->repeats )
   {
-    
-    TRACEH("[%d ms] Note ON event at 0x%x: channel=%d, key=%d, velocity=%d\n",
-      fileStatus->trackStatus[fileStatus->currentTrack].tick,
-      data,
-      channel,
-      *data,
-      data[1]
-      ); 
-    if( data[1] != 0 )
+    abcFormatStatsType stats = {};
+
+    formatABCBody( conv, &buf, notes, numNotes, fixedLength, tuneKey, unitScale, &stats );
+    reportFormatStats( conv, &stats );
+
+    delete [] notes;
+
+    if( retval != -1 )
     {
-#ifdef _DEBUG
-      if( fileStatus->trackStatus[fileStatus->currentTrack].tick > lastNoteOnTick )
-      {
-        lastNoteOnTick =
-          fileStatus->trackStatus[fileStatus->currentTrack].tick;
-      }
-#endif
-      /* note on */
-      fileStatus->channelStatus[channel].noteStatus[data[0]].on = 1;
-      fileStatus->channelStatus[channel].noteStatus[data[0]].program =
-        fileStatus->channelStatus[channel].currentProgram;
-      if( fileStatus->channelStatus[channel].noteStatus[data[0]].startTick == 0 )
-      {
-        fileStatus->channelStatus[channel].noteStatus[data[0]].startTick = 
-          fileStatus->trackStatus[fileStatus->currentTrack].tick;
-      }
+      retval = abcEmitterFlush( &em );
     }
-    else
+
+    if( retval == -1 )
     {
-      /* note off */
-      if( fileStatus->channelStatus[channel].noteStatus[data[0]].on != 0 )
-      {
-        (void)AddNote(
-          noteList,
-          data[0],
-          fileStatus->channelStatus[channel].noteStatus[data[0]].startTick,
-          fileStatus->trackStatus[fileStatus->currentTrack].tick,
-          fileStatus->channelStatus[channel].noteStatus[data[0]].program,
-          channel,
-          fileStatus->currentTrack
-          );
-
-        fileStatus->channelStatus[channel].noteStatus[data[0]].on = 0;
-        fileStatus->channelStatus[channel].noteStatus[data[0]].startTick = 0;
-      }
+      printf( "ERROR: Can not write the ABC output.\n" );
     }
-    bytesConsumed += 2;
-  }
-  /* MIDI Polyphonic Key Pressure Event */
-  else if( (thisMsgType & 0xF0) == 0xA0 )
-  {
-    TRACE("[%d ms] Polyphonic Aftertouch event at 0x%llx, skipping\n",
-      fileStatus->trackStatus[fileStatus->currentTrack].tick,
-      (unsigned __int64)data);
-    bytesConsumed += 1;
-  }
-  /* MIDI Controller Event */
-  else if( (thisMsgType & 0xF0) == 0xB0 )
-  {
-    TRACE("[%d ms] Controller event at 0x%llx, controller=0x%x = 0x%x, skipping\n",
-      fileStatus->trackStatus[fileStatus->currentTrack].tick,
-      (unsigned __int64)data,*data,data[1]);
-    bytesConsumed += 2;
+
+    abcBufferFree(&buf);
+    return retval;
   }
-  /* MIDI Program Change Event */
-  else if( (thisMsgType & 0xF0) == 0xC0 )
+
+  delete [] notes;
+
+  noteListItemType * noteItem = conv->noteFilteredList;
+  while( noteItem != NULL && retval != -1 )
   {
-    TRACE("[%d ms] Program Change event at 0x%llx: channel=%d, program=%d\n",
-      fileStatus->trackStatus[fileStatus->currentTrack].tick,
-      (unsigned __int64)data,channel,*data);
-    fileStatus->trackStatus[fileStatus->currentTrack].program = *data;
-    fileStatus->channelStatus[channel].currentProgram = *data;
-    bytesConsumed += 1;
+    retval = abcEmitterNote( &em, noteItem );
+    noteItem = (noteListItemType *)noteItem->next;
   }
-  /* MIDI Channel Key Pressure Event */
-  else if( (thisMsgType & 0xF0) == 0xD0 )
+
+  if( retval != -1 )
   {
-    TRACE("[%d ms] Channel Aftertouch event at 0x%llx, skipping\n",
-      fileStatus->trackStatus[fileStatus->currentTrack].tick,
-      (unsigned __int64)data);
-    bytesConsumed += 1;
+    retval = abcEmitterFinish( &em );
   }
-  /* MIDI Pitch Bend Event */
-  else if( (thisMsgType & 0xF0) == 0xE0 )
+
+  if( retval == -1 )
   {
-    TRACE("[%d ms] Pitch Bend event at 0x%llx, skipping\n",
-      fileStatus->trackStatus[fileStatus->currentTrack].tick,
-      (unsigned __int64)data);
-    bytesConsumed += 2;
+    printf( "ERROR: Can not write the ABC output.\n" );
   }
-  else
-  {
-    TRACE("[%d ms] Bad event: 0x%x\n",
-      fileStatus->trackStatus[fileStatus->currentTrack].tick,
-      thisMsgType);
 
-    fileStatus->lastStatus = 0;
-  }
+  reportDroppedNotes( conv, em.numDropped );
 
-  return bytesConsumed;
+  abcBufferFree(&buf);
+  return retval;
 }
 
 /*
-** FUNCTION parseEvent
+** FUNCTION previewMicroseconds
 **
 ** DESCRIPTION
-**   
+**   Microseconds since start on the high-resolution performance counter,
+**   which never goes backwards the way the wall clock can.
 **
 *****************************************************************************/
-unsigned long parseEvent(unsigned char * data, unsigned long bytesRemaining, fileStatusType * fileStatus)
+inline unsigned long long previewMicroseconds(const LARGE_INTEGER * start, const LARGE_INTEGER * frequency)
 {
-  unsigned long deltaTime = 0, lastStatus = 0;
-  unsigned long bytesConsumed = 0, tbC = 0;
+  LARGE_INTEGER now;
 
-  tbC = readVarLen( data, bytesRemaining, &deltaTime );
+  QueryPerformanceCounter( &now );
 
-  if( tbC == 0 )
-  {
-    TRACE("Error reading deltaTime at 0x%llx: [%02x%02x%02x%02x]\n",
-      (unsigned __int64)data,
-      data[0],
-      data[1],
-      data[2],
-      data[3]
-      );
-  }
-  else
-  {
-    TRACEH("deltaTime [%02x%02x%02x%02x] = %d ticks",
-      data[0],
-      data[1],
-      data[2],
-      data[3],
-      deltaTime);
-
-    bytesRemaining -= tbC;
-    data += tbC;
-    bytesConsumed += tbC;
-
-    deltaTime = (unsigned long)( 
-      (unsigned long)(
-        ((long double)deltaTime / (long double)fileStatus->ppqn) * (long double)fileStatus->currentTempo
-      ) / 1000
-    );
-
-    TRACEH(" = %d ms, used = %d bytes\n",
-      deltaTime,
-      tbC);
+  return (unsigned long long)( now.QuadPart - start->QuadPart ) * 1000000ULL / (unsigned long long)frequency->QuadPart;
+}
 
-    fileStatus->trackStatus[fileStatus->currentTrack].tick += deltaTime;
+/*
+** FUNCTION midiDevicesSend
+**
+** DESCRIPTION
+**   Backend for the Windows MIDI output devices: sends a message to every
+**   open device straight away.
+**
+*****************************************************************************/
+void midiDevicesSend(void * context, DWORD message, unsigned long long due)
+{
+  midiDevicesType * devices = (midiDevicesType *)context;
 
-    if( *data & 0x80 )
+  for( unsigned int i = 0; i < devices->numDevices; i++ )
+  {
+    if ( devices->devOpen[i] )
     {
-      fileStatus->lastStatus = 0;
-
-      /* Sysex Event */
-      if( *data == 0xF0 || *data == 0xF7 )
-      {
-        unsigned long val = 0;
-        TRACE("[%d ms] Sysex event at 0x%llx, ",
-          fileStatus->trackStatus[fileStatus->currentTrack].tick,
-          (unsigned __int64)data);
-        data++; bytesRemaining--; bytesConsumed++;
-        tbC = readVarLen( data, bytesRemaining, &val );
-        TRACE("length=%d\n",tbC);
-
-        data += tbC + val; bytesRemaining -= tbC + val; bytesConsumed += tbC + val;
-      } 
-      /* Meta Event */
-      else if( *data == 0xFF )
-      {
-        unsigned long val = 0;
-        TRACE("[%d ms] Meta event at 0x%llx, type=0x%x\n",
-          fileStatus->trackStatus[fileStatus->currentTrack].tick,
-          (unsigned __int64)data,data[1]);
-        if( data[1] == 0x51 )
-        {
-          unsigned long tmpo = 0;
-
-          tmpo = (*((unsigned long *)&data[2]) & 0xffffff00l);
-          reorder1(&tmpo,sizeof(unsigned long));
-
-          TRACE("[%d ms] Tempo change, was %0.2f bpm, now %0.2f bpm\n",
-            deltaTime,
-            (double)1 / ((double)(fileStatus->currentTempo) / (double)60000000),
-            (double)1 / ((double)(tmpo) / (double)60000000));
-          fileStatus->currentTempo = tmpo;
-        }
-        else if( data[1] == 0x03 )
-        { /* sequence name */
-          unsigned long len = 0, len_bytes = 0;;
-
-          len_bytes = readVarLen( &data[2], bytesRemaining - 2, &len );
+      midiOutShortMsg(devices->hMidiOut[i],message);
+    }
+  }
+}
 
-          strncpy_s(fileStatus->trackStatus[fileStatus->currentTrack].name,(char *)&data[2+len_bytes],len);
-        }
-        else if( data[1] == 0x04 )
-        { /* instrument name */
-          unsigned long len = 0, len_bytes = 0;;
+void midiDevicesReset(void * context)
+{
+  midiDevicesType * devices = (midiDevicesType *)context;
 
-          len_bytes = readVarLen( &data[2], bytesRemaining - 2, &len );
+  for( unsigned int i = 0; i < devices->numDevices; i++ )
+  {
+    if ( devices->devOpen[i] )
+    {
+      midiOutReset(devices->hMidiOut[i]);
+    }
+  }
+}
 
-          strncpy_s(fileStatus->trackStatus[fileStatus->currentTrack].instrument,(char *)&data[2+len_bytes],len);
-        }
-        data += 2; bytesRemaining -= 2; bytesConsumed += 2;
-        tbC = readVarLen( data, bytesRemaining, &val );
+void midiDevicesVolume(void * context, DWORD volume)
+{
+  midiDevicesType * devices = (midiDevicesType *)context;
 
-        data += tbC + val; bytesRemaining -= tbC + val; bytesConsumed += tbC + val;
-      }
-      /* Channel Event */
-      else if( (*data & 0xF0) >= 0x80 
-              && (*data & 0xF0) <= 0xE0 )
-      {
-        tbC = parseChannelEvent( data, bytesRemaining, fileStatus );
-        bytesRemaining -= tbC;
-        data += tbC;
-        bytesConsumed += tbC;
-      }
-      /* Unknown Event */
-      else
-      {
-        TRACE("********* ERROR: Unknown event at 0x%llx: 0x%x\n",(unsigned __int64)data,*data);
-      }
-    }
-    else
+  for( unsigned int i = 0; i < devices->numDevices; i++ )
+  {
+    if ( devices->devOpen[i] )
     {
-      if( fileStatus->lastStatus != 0 )
-      {
-        tbC = parseChannelEvent( data, bytesRemaining, fileStatus );
-        bytesRemaining -= tbC;
-        data += tbC;
-        bytesConsumed += tbC;
-      }
-      else
-      {
-        TRACE("********* ERROR: Unknown event at 0x%llx: 0x%x\n",(unsigned __int64)data,*data);
-      }
+      midiOutSetVolume(devices->hMidiOut[i],volume);
     }
   }
-
-  return bytesConsumed;
 }
 
-
 /*
-** FUNCTION parseTrack
+** FUNCTION midiNullCall
 **
 ** DESCRIPTION
-**   
+**   Backend that drops everything, for timing the scheduler on its own.
 **
 *****************************************************************************/
-void parseTrack(unsigned char * data, unsigned long bytesRemaining, fileStatusType * fileStatus)
+void midiNullCall(void * context)
 {
-  unsigned long bytesConsumed = 0, tbC = 0;
-
-  while( bytesRemaining > 0 )
-  {
-    tbC = parseEvent( data, bytesRemaining, fileStatus );
-    if( tbC == 0 )
-    {
-      break;
-    }
-    bytesConsumed += tbC; bytesRemaining -= tbC; data += tbC;
-  }
-
-  AddTrack(
-    trackList,
-    NULL,
-    fileStatus->currentTrack,
-    fileStatus->trackStatus[fileStatus->currentTrack].program,
-    fileStatus->trackStatus[fileStatus->currentTrack].name,
-    fileStatus->trackStatus[fileStatus->currentTrack].instrument
-    );
+}
 
-  fileStatus->currentTrack++;
+void midiNullSend(void * context, DWORD message, unsigned long long due)
+{
+}
 
+void midiNullVolume(void * context, DWORD volume)
+{
 }
 
 /*
-** FUNCTION parseMIDIFile
+** FUNCTION midiRecorderBegin
 **
 ** DESCRIPTION
-**   
+**   Backend that keeps every message in memory with the time it was sent.
+**   When the preview ends it reports how late the messages went out and how
+**   much that varied.
 **
 *****************************************************************************/
-
-int parseMIDIFile(char * inFileName, unsigned int * format, unsigned int * numTracks)
+void midiRecorderBegin(void * context)
 {
-  unsigned long     inFileSize = 0;
-  FILE             *inFilePtr = NULL;
-  fileStatusType    fileStatus;
-  unsigned long     fpos = 0;
-
-  ZeroMemory( &fileStatus, sizeof( fileStatusType ) );
-
-  /* This is expressed in microseconds per quarter note (aka beat).
-     120 beats/minute is default, so:
+  midiRecorderType * recorder = (midiRecorderType *)context;
 
-     1 minute / 120 qtr notes = 60000000 microseconds / 120 qtr notes 
-      = 500000 microseconds / 1 qtr note */
-  fileStatus.currentTempo = 500000;
-  fileStatus.currentTrack = 1;
+  recorder->numRecords = 0;
 
-  fopen_s( &inFilePtr, inFileName, "rb" );
-  if ( inFilePtr == NULL ) 
-  {
-    printf( "ERROR: Can not open %s for reading. (Did you get the filename and path correct?)\n", 
-      inFileName );
-    return -1;   
-  }
-
-  /* Validate size of input file. */
-  fseek(inFilePtr,0, SEEK_END);
-  inFileSize = ftell(inFilePtr);
-  if( inFileSize < sizeof( midiChunkHdrType ) ) 
-  {
-    printf( "ERROR: %s is too small. (It is not a valid MIDI file.)\n", inFileName );
-    return -1;
-  }
+  QueryPerformanceFrequency( &recorder->frequency );
+  QueryPerformanceCounter( &recorder->startTime );
+}
 
-  /* Show filenames to user. */
-  printf( "[input]\nMIDI file: %s\n\n", inFileName );
+void midiRecorderSend(void * context, DWORD message, unsigned long long due)
+{
+  midiRecorderType * recorder = (midiRecorderType *)context;
+  unsigned long long sent = previewMicroseconds( &recorder->startTime, &recorder->frequency );
 
-  /*                                                                        *\
-  ============================== Read MThd Header ============================
-  \*                                                                        */
+  if( recorder->numRecords == recorder->capacity )
   {
-    midiChunkMThdType MThdHeader = { 0 };
+    unsigned long capacity = ( recorder->capacity == 0 ) ? 4096 : recorder->capacity * 2;
+    midiRecordType * records = new midiRecordType[capacity];
 
-    /* Grab MThd header. */
-    fseek( inFilePtr, 0, SEEK_SET);
-    fread( &MThdHeader, sizeof( midiChunkMThdType ), 1, inFilePtr );
-
-    /* Check hdr */
-    if( 0 != strncmp( MThdHeader.hdr.ID, "MThd", 4 ) )
+    if( recorder->numRecords > 0 )
     {
-      printf( "ERROR: Header chunk has invalid ID: %s. (It is not a valid MIDI file.)\n",
-        MThdHeader.hdr.ID ); //TODO: cap length
-      return -1;
+      memcpy( records, recorder->records, recorder->numRecords * sizeof( midiRecordType ) );
     }
 
-    /* Reorder bytes */
-    reorder1( &MThdHeader.hdr.length, sizeof( MThdHeader.hdr.length ) );
-    reorder1( &MThdHeader.ppqn, sizeof( MThdHeader.ppqn ) );
-    reorder1( &MThdHeader.format, sizeof( MThdHeader.format ) );
-    reorder1( &MThdHeader.numTracks, sizeof( MThdHeader.numTracks ) );
+    delete [] recorder->records;
+    recorder->records = records;
+    recorder->capacity = capacity;
+  }
 
-    if( format != NULL )
-    {
-      *format = MThdHeader.format;
-    }
+  recorder->records[recorder->numRecords].message = message;
+  recorder->records[recorder->numRecords].due = due;
+  recorder->records[recorder->numRecords].sent = sent;
+  recorder->numRecords++;
+}
 
-    /* Check size */
-    if( MThdHeader.hdr.length != 6 )
-    {
-      printf( "ERROR: Header chunk has invalid size: %d. (It is not a valid MIDI file.)\n",
-        MThdHeader.hdr.length );
-      return -1;
-    }
+void midiRecorderEnd(void * context)
+{
+  midiRecorderType * recorder = (midiRecorderType *)context;
+  double             sum = 0.0, sumSquares = 0.0, worst = 0.0;
 
-    /* Check format */
-    if( MThdHeader.format != 0 && MThdHeader.format != 1 )
-    {
-      printf( "ERROR: Unsupported MIDI format: %d. (It is not a MIDI file that this tool supports.)\n",
-        MThdHeader.format );
-      return -1;
-    }
+  if( recorder->numRecords == 0 )
+  {
+    return;
+  }
+
+  for( unsigned long i = 0; i < recorder->numRecords; i++ )
+  {
+    double late = (double)( (long long)( recorder->records[i].sent - recorder->records[i].due ) ) / 1000.0;
 
-    /* Check PPQN */
-    if( MThdHeader.ppqn & (1 << 14) )
+    sum += late;
+    sumSquares += late * late;
+    if( late > worst )
     {
-      printf( "ERROR: PPQN SMPTE format unsupported: 0x%x. (It is not a MIDI file that this tool supports.)\n",
-        MThdHeader.ppqn );
-      return -1;
+      worst = late;
     }
-
-    printf( "Number of tracks: %d\nPPQN: %d\nFormat: %d\n\n",
-      MThdHeader.numTracks, MThdHeader.ppqn, MThdHeader.format );
-
-    fileStatus.ppqn = MThdHeader.ppqn;
-    fileStatus.numTracks = MThdHeader.numTracks;
-    fpos = sizeof( midiChunkMThdType );
-
   }
 
-  /*                                                                        *\
-  ================================== Read MTrks ==============================
-  \*                                                                        */
-  while( fpos < inFileSize )
-  {
-    unsigned char * data = NULL;
-    midiChunkHdrType  thisHeader = { 0 };
-
-    fseek( inFilePtr, fpos, SEEK_SET);
-    fread( &thisHeader, sizeof( thisHeader ), 1, inFilePtr );
+  double mean = sum / recorder->numRecords;
+  double variance = sumSquares / recorder->numRecords - mean * mean;
 
-    /* Check hdr */
-    if( 0 != strncmp( thisHeader.ID, "MTrk", 4 ) )
-    {
-      char tID[5] = { 0 };
+  printf("\nRecorded %lu MIDI messages: %0.03f ms late on average, %0.03f ms at worst, %0.03f ms jitter\n",
+    recorder->numRecords, mean, worst, sqrt( ( variance > 0.0 ) ? variance : 0.0 ));
+}
 
-      strncpy_s(tID,thisHeader.ID,4);
-      tID[4] = 0;
+/* Backends for -m. The first is the default. */
+midiDevicesType gMidiDevices = { 0 };
+midiRecorderType gMidiRecorder = { 0 };
 
-      printf( "ERROR: Track chunk has invalid ID: %s. (It is not a valid MIDI file.)\n",
-        tID );
-      return -1;
-    }
+midiBackendType midiBackends[] =
+{
+  { "devices", midiNullCall, midiDevicesSend, midiDevicesReset, midiDevicesVolume, midiNullCall, &gMidiDevices },
+  { "record", midiRecorderBegin, midiRecorderSend, midiNullCall, midiNullVolume, midiRecorderEnd, &gMidiRecorder },
+  { "null", midiNullCall, midiNullSend, midiNullCall, midiNullVolume, midiNullCall, NULL },
+};
 
-    reorder1( &thisHeader.length, sizeof( thisHeader.length ) );
-    
-    /* Check size */
-    if( thisHeader.length > (inFileSize - fpos) )
-    {
-      printf( "ERROR: Track chunk has invalid size: %d of %d remaining in the file. (It is not a valid MIDI file.)\n",
-        thisHeader.length, (inFileSize - fpos) );
-      return -1;
-    }
+#define NUM_MIDI_BACKENDS (sizeof(midiBackends) / sizeof(midiBackends[0]))
 
-    data = new unsigned char[thisHeader.length];
+const midiBackendType * gMidiBackend = &midiBackends[0];
 
-    ZeroMemory( data, thisHeader.length );
+/*
+** FUNCTION sendMidiMessage
+**
+** DESCRIPTION
+**   Hands a message due at the given time to the preview backend.
+**
+*****************************************************************************/
+inline void sendMidiMessage(midiEventType noteEvent, unsigned long long due)
+{
+  DWORD * val = (DWORD *)&noteEvent;
 
-    fseek( inFilePtr, fpos + sizeof( thisHeader ), SEEK_SET);
-    fread( data, thisHeader.length, 1, inFilePtr );
+  gMidiBackend->send( gMidiBackend->context, *val, due );
+}
 
+/*
+** FUNCTION sendMidiReset
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+inline void sendMidiReset()
+{
+  gMidiBackend->reset( gMidiBackend->context );
+}
 
-    TRACE("Track started at 0x%llx\n",(unsigned __int64)data);
-    parseTrack( data, thisHeader.length, &fileStatus );
-    TRACE("Track ended at 0x%llx\n",(unsigned __int64)data);
+/*
+** FUNCTION sendMidiVolume
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+inline void sendMidiVolume(DWORD vol)
+{
+  gMidiBackend->volume( gMidiBackend->context, vol );
+}
 
-    delete [] data;
-    data = NULL;
+/*
+** FUNCTION previewReadKey
+**
+** DESCRIPTION
+**   Reads what is waiting on the console and returns the first key that
+**   went down: its character, or PREVIEW_KEY_VIRTUAL plus the virtual key
+**   code for keys without one. Returns 0 when no key went down.
+**
+*****************************************************************************/
+int previewReadKey(HANDLE h)
+{
+  DWORD numInputRead = 0;
 
-    fpos += thisHeader.length + sizeof( midiChunkHdrType );
-  }
+  GetNumberOfConsoleInputEvents(h,&numInputRead);
 
-  if( numTracks != NULL )
+  for( unsigned int x = 0; x < numInputRead; x++ )
   {
-    *numTracks = fileStatus.currentTrack;
+    INPUT_RECORD inputRecord;
+    DWORD t_numInputRead = 0;
+
+    ReadConsoleInput(h,&inputRecord,1,&t_numInputRead);
+
+    if( t_numInputRead > 0
+        && inputRecord.EventType == KEY_EVENT
+        && inputRecord.Event.KeyEvent.bKeyDown )
+    {
+      if( inputRecord.Event.KeyEvent.uChar.AsciiChar != 0 )
+      {
+        return (unsigned char)inputRecord.Event.KeyEvent.uChar.AsciiChar;
+      }
+      return PREVIEW_KEY_VIRTUAL + inputRecord.Event.KeyEvent.wVirtualKeyCode;
+    }
   }
 
   return 0;
 }
 
-
 /*
-** FUNCTION transposeNote
+** FUNCTION previewHeapPush
 **
 ** DESCRIPTION
-**   
+**   Adds an event to a min-heap of events ordered by tick.
 **
 *****************************************************************************/
-unsigned char transposeNote(unsigned char note, char transpose)
+void previewHeapPush(previewEventType * heap, unsigned int * size, previewEventType event)
 {
-  unsigned char thisNote = note;
+  unsigned int i = (*size)++;
 
-  if( (int)thisNote + (int)transpose < 0 )
-  {
-    thisNote = 0;
-  }
-  else if( (int)thisNote + (int)transpose > 127 )
-  {
-    thisNote = 127;
-  }
-  else
+  while( i > 0 && heap[(i - 1) / 2].tick > event.tick )
   {
-    thisNote = (unsigned char)((char)thisNote + transpose);
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
   }
-
-  return thisNote;
+  heap[i] = event;
 }
 
 /*
-** FUNCTION analyzeNotes
+** FUNCTION previewHeapPop
 **
 ** DESCRIPTION
-**   
+**   Takes the event with the lowest tick off a min-heap.
 **
 *****************************************************************************/
-unsigned int analyzeNotes(
-  unsigned char instMin,
-  unsigned char instMax,
-  unsigned char track,
-           char transpose,
-
-  unsigned char * out_noteMin,
-  unsigned int  * out_numTooLow,
-  unsigned char * out_noteMax,
-  unsigned int  * out_numTooHigh,
-           char * out_rmsAdjust,
-           char * out_medianAdjust,
-           char * out_noteAverage
-  )
+previewEventType previewHeapPop(previewEventType * heap, unsigned int * size)
 {
-  noteListItemType * noteItem = noteList;
-
-  unsigned int numNotes = 0;
-  unsigned char minNote = 127;
-  unsigned int numTooLow = 0;
-  unsigned char maxNote = 0;
-  unsigned int numTooHigh = 0;
-  unsigned int noteAverage = 0;
-  long double rmsNote = 0;
-  long double midNote = ((long double)instMin + (((long double)instMax - (long double)instMin) / (long double)2));
+  previewEventType top = heap[0];
+  previewEventType last = heap[--(*size)];
+  unsigned int     i = 0;
 
-  while( noteItem != NULL )
+  for( ;; )
   {
-    unsigned char thisNote = transposeNote(noteItem->note,transpose);
-
-    if( noteItem->track != track )
-    {
-      noteItem = (noteListItemType *)noteItem->next;
-      continue;
-    }
+    unsigned int child = 2 * i + 1;
 
-    if( thisNote > maxNote )
+    if( child >= *size )
     {
-      maxNote = thisNote;
+      break;
     }
-
-    if( thisNote < minNote )
+    if( child + 1 < *size && heap[child + 1].tick < heap[child].tick )
     {
-      minNote = thisNote;
+      child++;
     }
-
-    if( thisNote > instMax )
+    if( heap[child].tick >= last.tick )
     {
-      numTooHigh++;
+      break;
     }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
 
-    if( thisNote < instMin )
-    {
-      numTooLow++;
-    }
+  return top;
+}
 
-    noteAverage += thisNote;
+/*
+** FUNCTION buildPreviewEvents
+**
+** DESCRIPTION
+**   Turns the filtered notes of one track, or of the whole file for track
+**   0, into a time-sorted array of note-on and note-off messages. Note-offs
+**   wait in a min-heap on their end tick and go into the array as soon as
+**   the notes reach it, ahead of any note-on at the same tick.
+**
+*****************************************************************************/
+previewEventType * buildPreviewEvents(unsigned int track, unsigned int * o_NumEvents)
+{
+  unsigned int numNotes = 0;
+  unsigned int numEvents = 0;
+  unsigned int numPending = 0;
+  noteListItemType * noteItem;
 
-    rmsNote += (((long double)thisNote - midNote) * ((long double)thisNote - midNote));
+  SortNoteListByStart(gConversion.noteFilteredList);
 
+  for( noteItem = gConversion.noteFilteredList; noteItem != NULL; noteItem = (noteListItemType *)noteItem->next )
+  {
     numNotes++;
-
-    noteItem = (noteListItemType *)noteItem->next;
   }
 
-  *out_noteMin = minNote;
-  *out_noteMax = maxNote;
-  *out_numTooLow = numTooLow;
-  *out_numTooHigh = numTooHigh;
+  previewEventType * events = new previewEventType[2 * numNotes + 1];
+  previewEventType * pending = new previewEventType[numNotes + 1];
 
-  if( numNotes > 0 )
+  for( noteItem = gConversion.noteFilteredList; noteItem != NULL; noteItem = (noteListItemType *)noteItem->next )
   {
+    if( ( track != 0 
+          && noteItem->track != track )
+        || noteItem->channel == 9
+        )
+    {
+      continue;
+    }
 
-    *out_noteAverage = (char)(noteAverage / numNotes);
-
-    rmsNote /= (long double)numNotes;
-    rmsNote = (long double)instMin + sqrt( rmsNote );
+    while( numPending > 0 && pending[0].tick <= noteItem->startTick )
+    {
+      events[numEvents++] = previewHeapPop( pending, &numPending );
+    }
 
-    *out_rmsAdjust = (char)(rmsNote - midNote);
+    midiEventType noteEvent;
+    previewEventType event;
 
+    noteEvent.channel = 1;
+    noteEvent.event = 9;
+    noteEvent.param1 = noteItem->note;
+    noteEvent.param2 = 127;
 
-    if( numNotes & 1 )
+    if( noteItem->note < N_C4 ) //(unsigned char)(OCTAVE((int)N_C4,(int)-1)) )
     {
-      unsigned int medianIndex = numNotes / 2;
-
-      noteItem = noteList;
-      while( medianIndex > 0 || noteItem->track != track )
-      {
-        if( noteItem->track == track )
-        {
-          medianIndex--;
-        }
-        noteItem = (noteListItemType *)noteItem->next;
-      }
-
-      //printf("Median note: %d\n",transposeNote(noteItem->note,transpose));
-      *out_medianAdjust = (char)((int)transposeNote(noteItem->note,transpose) - (int)midNote);
+      noteEvent.param1 = noteItem->note - 12;
     }
-    else
-    {
-      unsigned int medianIndex = (numNotes / 2) - 1;
-      unsigned char A = 0;
-      unsigned char B = 0;
 
-      noteItem = noteList;
-      while( medianIndex > 0 || noteItem->track != track )
-      {
-        if( noteItem->track == track )
-        {
-          medianIndex--;
-        }
-        noteItem = (noteListItemType *)noteItem->next;
-      }
-      A = transposeNote(noteItem->note,transpose);
-      B = transposeNote(((noteListItemType *)noteItem->next)->note,transpose);
+    event.tick = noteItem->startTick;
+    event.message = *(DWORD *)&noteEvent;
+    event.track = noteItem->track;
+    event.noteOn = true;
+    events[numEvents++] = event;
 
-      *out_medianAdjust = (char)(
-          ( (int)A + ( ( (int)B - (int)A ) / 2 ) ) - (int)midNote
-        );
-    }
+    noteEvent.event = 8;
+    noteEvent.param2 = 0x40;
+
+    event.tick = ( noteItem->endTick > noteItem->startTick ) ? noteItem->endTick : noteItem->startTick;
+    event.message = *(DWORD *)&noteEvent;
+    event.noteOn = false;
+    previewHeapPush( pending, &numPending, event );
   }
-  else
+
+  while( numPending > 0 )
   {
-    *out_rmsAdjust = 0;
+    events[numEvents++] = previewHeapPop( pending, &numPending );
   }
 
-  return numNotes;
+  delete [] pending;
+
+  *o_NumEvents = numEvents;
+  return events;
 }
 
 /*
-** FUNCTION adjustTrackTranspose
+** FUNCTION previewSeekIndex
 **
 ** DESCRIPTION
-**   
+**   Binary search for the first event at or after the given tick.
 **
 *****************************************************************************/
-void adjustTrackTranspose(
-  int transpose
-  )
+unsigned int previewSeekIndex(previewEventType * events, unsigned int numEvents, unsigned long tick)
 {
-  trackListItemType * trackItem = trackList;
+  unsigned int low = 0, high = numEvents;
 
-  while( trackItem != NULL )
+  while( low < high )
   {
-    trackItem->transpose += transpose;
-
-    trackItem = (trackListItemType *)trackItem->next;
-  }
-}
-
-
-/*
-** FUNCTION adaptNoteData_AutoFit
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-int adaptNoteData_AutoFit(
-  trackListItemType * trackItem,
-  unsigned char instMinNote,
-  unsigned char instMaxNote
-  )
-{
-  unsigned char minNote = 127;
-  unsigned char maxNote = 0;
-  unsigned int  numNotes = 0;
-  unsigned int  numTooLow = 0;
-  unsigned int  numTooHigh = 0;
-           char rmsAdjust = 0;
-           char medianAdjust = 0;
-           char noteAverage = 0;
-
-           int  transpose = 0;
-           int  percentTooLow = 0;
-           int  percentTooHigh = 0;
-
-           char midNote = (instMinNote + ((instMaxNote - instMinNote) / 2));
-
-  SortNoteListByNote(noteList);
-
-  numNotes = analyzeNotes(
-    instMinNote, instMaxNote, trackItem->track, trackItem->transpose,
-    &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
-    &noteAverage
-    );
-
-  percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes)); 
-  percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
-
-  if( trackItem->lead )
-  {
-    transpose = (((instMaxNote - midNote) / 2) + midNote) - noteAverage;
-
-    numNotes = analyzeNotes(
-      instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
-      &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
-      &noteAverage
-      );
-
-    percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes));
-    percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
-  }
-  else
-  {
-    while( numTooLow == 0 )
-    {
-      transpose -= 12;
-
-      numNotes = analyzeNotes(
-        instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
-        &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
-        &noteAverage
-        );
-
-      percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes));
-      percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
-    }
-
-    while( numTooLow > 0 )
-    {
-      transpose += 12;
-
-      numNotes = analyzeNotes(
-        instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
-        &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
-        &noteAverage
-        );
-
-      percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes));
-      percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
-    }
-  }
-
-  while( percentTooHigh > 10 )
-  {
-    if( !trackItem->lead )
-    {
-      transpose -= 12;
-    }
-    else
-    {
-      transpose--;
-    }
-
-
-    numNotes = analyzeNotes(
-      instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
-      &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
-      &noteAverage
-      );
-
-    percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes));
-    percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
-  }
-
-  if( trackItem->lead )
-  {
-    adjustTrackTranspose( transpose );
-  }
-  else
-  {
-    trackItem->transpose += transpose;
-  }
-
-  return 0;
-}
-
-/*
-** FUNCTION adaptNoteData_Transpose
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-int adaptNoteData_Transpose(
-  trackListItemType * trackItem,
-  unsigned char instMinNote,
-  unsigned char instMaxNote
-  )
-{
-  unsigned char minNote = 127;
-  unsigned char maxNote = 0;
-  unsigned int  numNotes = 0;
-  unsigned int  numTooLow = 0;
-  unsigned int  numTooHigh = 0;
-           char rmsAdjust = 0;
-           char medianAdjust = 0;
-           char noteAverage = 0;
-
-           int  transpose = 0;
-           int  percentTooLow = 0;
-           int  percentTooHigh = 0;
-
-  int usrInput = 0;
-
-  SortNoteListByNote(noteList);
-
-  if( trackItem->lead && trackItem->transpose_autoselect )
-  {
-    adaptNoteData_AutoFit(trackItem,instMinNote,instMaxNote);
-    trackItem->transpose_autoselect = false;
-  }
-
-  numNotes = analyzeNotes(
-    instMinNote, instMaxNote, trackItem->track, trackItem->transpose,
-    &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
-      &noteAverage
-    );
-
-  percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes)); 
-  percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
-
-  NewScreen(true);
-
-  /* Analyze and select the transposition */
-  printf("\nTRANSPOSE\n");
-  printf("Press [left|right] to adjust, [enter] to accept changes.\n\n");
-  printf("    |----- too low ------|------ in range ----|----- too high -----|\n");
-  while( usrInput != 13 )
-  {
-
-    if( numNotes > 0 )
-    {
-      int numLowDits = (int)ceil((double)percentTooLow / 5.0f);
-      int numHighDits = (int)ceil((double)percentTooHigh / 5.0f);
-
-      printf("\r");
-      for( int x = 0; x < 20 - numLowDits; x++ )
-      {
-        printf(" ");
-      }
-      if( numLowDits > 0 )
-      {
-        printf("%3d%%|",percentTooLow);
-        for( int x = 0; x < numLowDits; x++ )
-        {
-          printf("-");
-        }
-      }
-      else
-      {
-        printf("   0%%");
-      }
-      printf("|-----%3d%% (%3d)-----|",100 - percentTooHigh - percentTooLow, (trackItem->transpose + transpose));
-      if( numHighDits > 0 )
-      {
-        for( int x = 0; x < numHighDits; x++ )
-        {
-          printf("-");
-        }
-        printf("|%3d%%",percentTooHigh);
-      }
-      else
-      {
-        printf("0%%   ");
-      }
-      for( int x = 0; x < 20 - numHighDits; x++ )
-      {
-        printf(" ");
-      }
-
-    }
-    else
-    {
-      printf("No notes on track %d\n",trackItem->track);
-      return -1;
-    }
-
-    do
-    {
-      usrInput = _getch();
-    } while( usrInput != 224 && usrInput != 13 );
-
-    if( usrInput == 224 )
-    {
-      usrInput = _getch();
-
-      if( usrInput == 72 || usrInput == 77 )
-      {
-        if( !trackItem->lead )
-        {
-          transpose += 12;
-        }
-        else
-        {
-          transpose++;
-        }
-      }
-      else if( usrInput == 80 || usrInput == 75 )
-      {
-        if( !trackItem->lead )
-        {
-          transpose -= 12;
-        }
-        else
-        {
-          transpose--;
-        }
-      }
-    }
-
-    numNotes = analyzeNotes(
-      instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
-      &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
-      &noteAverage
-      );
-
-    percentTooLow = (int)ceil(100*((double)numTooLow / (double)numNotes));
-    percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
-  }
-
-
-  if( trackItem->lead )
-  {
-    adjustTrackTranspose( transpose );
-  }
-  else
-  {
-    trackItem->transpose += transpose;
-  }
-
-  printf("\n\nNotes out of range: %d. Do you wish to flip out of range notes? [y/n]",(numTooLow+numTooHigh));
-
-  usrInput = _getch();
-
-  if( usrInput == 'y' || usrInput == 'Y' )
-  {
-    trackItem->flip_oor = true;
-  }
-  else
-  {
-    trackItem->flip_oor = false;
-  }
-
-  return 0;
-}
-
-/*
-** FUNCTION stretchNote
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-unsigned long stretchNote(unsigned long time, float stretch)
-{
-  return (unsigned long)((double)time * (double)stretch);
-}
-
-/*
-** FUNCTION analyzeTiming
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-#define MIN_TIMING_MS 60
-
-unsigned int analyzeTiming(
-          float stretch,
-
-            int * out_maxQError,
-          float * out_biasLevel,
-          float * out_errorPower
-  )
-{
-  noteListItemType * noteItem = noteList;
-
-  unsigned int numNotes = 0;
-  long maxQError = 0;
-  long biasLevel = 0;
-  long errorPower = 0;
-
-  while( noteItem != NULL )
-  {
-    unsigned long thisStart = stretchNote(noteItem->startTick,stretch);
-    unsigned long thisEnd = stretchNote(noteItem->endTick,stretch);
-
-    long thisStartDelta = ((long)thisStart) % (long)MIN_TIMING_MS;
-
-    if( thisStartDelta > ((long)MIN_TIMING_MS / 2) )
-    {
-      thisStartDelta -= (long)MIN_TIMING_MS;
-    }
-
-    long thisEndDelta = ((long)thisEnd) % (long)MIN_TIMING_MS;
-
-    if( thisEndDelta > ((long)MIN_TIMING_MS / 2) )
-    {
-      thisEndDelta -= (long)MIN_TIMING_MS;
-    }
-
-
-    if( abs(thisStartDelta) > maxQError )
-    {
-      maxQError = abs(thisStartDelta);
-    }
-    if( abs(thisEndDelta) > maxQError )
-    {
-      maxQError = abs(thisEndDelta);
-    }
-
-    errorPower += (thisStartDelta * thisStartDelta) + (thisEndDelta * thisEndDelta);
-    biasLevel += thisStartDelta + thisEndDelta;
-
-    numNotes++;
-
-    noteItem = (noteListItemType *)noteItem->next;
-  }
-
-  *out_maxQError = (int)maxQError;
-
-  if( numNotes > 0 )
-  {
-    //*out_biasLevel = (int)(biasLevel);
-    *out_biasLevel = (float)((double)biasLevel / ((double)numNotes * (double)2));
-    *out_errorPower = (float)sqrt((double)errorPower / ((double)numNotes * (double)2));
-  }
-  else
-  {
-    *out_errorPower = 0;
-    *out_biasLevel = 0;
-  }
-
-  return numNotes;
-}
-
-
-/*
-** FUNCTION adaptNoteData_Quantize
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-int adaptNoteData_Quantize()
-{
-  int           usrInput = 0;
-  float         stretch = 1.0f;
-  unsigned int  numNotes = 0;
-  int           maxQError = 0;
-  float         biasLevel = 0.0f;
-  float         errorPower = 0.0f;
-  unsigned long lastLeadTrackStart = 0;
-  unsigned long nextLeadTrackStart = 0;
-  
-  /* Analyze and select the stretch */
-  while( usrInput != 'c' && usrInput != 'C' )
-  {
-    numNotes = analyzeTiming(
-      stretch,
-      &maxQError, &biasLevel, &errorPower
-      );
-
-    if( numNotes > 0 )
-    {
-      printf("\nSTRETCH[duration = %0.1fx]\n",stretch);
-      printf("Max Q Error: %d, Bias Level: %0.03f, Error Power: %0.03f\n",
-        maxQError,
-        biasLevel,
-        errorPower
-        );
-    }
-    else
-    {
-      printf("No notes.\n");
-      return -1;
-    }
-
-    printf("Press [c] to accept, or [up|down] to stretch|shrink, respectively.");
-    do
-    {
-      usrInput = _getch();
-    } while( usrInput != 224 && usrInput != 'c' && usrInput != 'C' );
-
-    printf("\r                                                                  \r");
-    if( usrInput == 224 )
-    {
-      usrInput = _getch();
-
-      if( usrInput == 72 )
-      {
-        stretch += 0.1f;
-      }
-      else if( usrInput == 80 )
-      {
-        stretch -= 0.1f;
-      }
-    }
-  }
-
-  gStretch = stretch;
-
-  return 0;
-}
-
-
-/*
-** FUNCTION adaptNoteData
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-int adaptNoteData(bool includeLeadTrack)
-{
-  trackListItemType * trackItem = trackList;
-
-  if( includeLeadTrack )
-  {
-    while( trackItem != NULL )
-    {
-      if( trackItem->lead )
-      {
-        break;
-      }
-      trackItem = (trackListItemType *)trackItem->next;
-    }
-
-    adaptNoteData_AutoFit(trackItem,instMinNote,instMaxNote);
-  }
-
-  trackItem = trackList;
-
-  while( trackItem != NULL )
-  {
-    if( !trackItem->lead )
-    {
-      adaptNoteData_AutoFit(trackItem,instMinNote,instMaxNote);
-    }
-    trackItem = (trackListItemType *)trackItem->next;
-  }
-
-  return 0;
-}
-
-/*
-** FUNCTION filterNoteData
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-int filterNoteData(unsigned int * o_NumDeleted, unsigned int * o_NumAdjusted)
-{
-  noteListItemType * noteItem;
-
-  unsigned int numDeleted = 0;
-  unsigned int numAdjusted = 0;
-  unsigned long numMsToDelete = 0;
-  unsigned long lastOnTime[MAX_TRACKS] = { 0 };
-  unsigned long lastLeadTrackStart = 0;
-
-  SortNoteListByStart( noteList );
-  ResetNoteList( noteFilteredList );
-  ResetTrackList( trackFilteredList );
-
-  noteItem = noteList;
-
-  if( noteItem != NULL )
-  {
-    numMsToDelete = noteItem->startTick;
-  }
-
-  trackListItemType * trackItem = trackList;
-  /* delete inactive tracks */
-  while( trackItem != NULL )
-  {
-    if( trackItem->active )
-    {
-      AddTrack(
-        trackFilteredList,
-        trackItem,
-        0,
-        0,
-        NULL,
-        NULL
-        );
-    }
-    
-    trackItem = (trackListItemType *)trackItem->next;
-  }
-
-  /* transpose notes */
-  while( noteItem != NULL )
-  {
-    if( noteItem->channel == 9 )
-    {
-      noteItem = (noteListItemType *)noteItem->next;
-      continue;
-    }
-
-    trackItem = GetTrack( 
-      trackFilteredList,
-      noteItem->track );
-
-    if( trackItem == NULL )
-    {
-      noteItem = (noteListItemType *)noteItem->next;
-      continue;
-    }
-
-    unsigned int tnote = transposeNote(noteItem->note,trackItem->transpose);
-
-    noteListItemType * noteFilteredItem = AddNote(
-      noteFilteredList,
-      tnote,
-      noteItem->startTick - numMsToDelete,
-      noteItem->endTick - numMsToDelete,
-      noteItem->program,
-      noteItem->channel,
-      noteItem->track
-      );
-
-    //noteItem->startTick -= numMsToDelete;
-    //noteItem->endTick -= numMsToDelete;
-
-    //noteItem->note = transposeNote(noteItem->note,trackItem->transpose);
-
-    if( trackItem->flip_oor )
-    {
-      unsigned long diffSinceLast = noteFilteredItem->startTick - lastOnTime[noteFilteredItem->track];
-
-      if( diffSinceLast != 0
-          && diffSinceLast <= ( MIN_TIMING_MS * 1 ) )
-      {
-        numDeleted++;
-        noteFilteredItem = DeleteNote( noteFilteredList, noteFilteredItem );
-        noteItem = (noteListItemType *)noteItem->next;
-        continue;
-      }
-
-      lastOnTime[noteFilteredItem->track] = noteFilteredItem->startTick;
-
-      /* Flip note back into range */
-      bool adjusted = false;
-
-      while( noteFilteredItem->note < instMinNote )
-      {
-        noteFilteredItem->note = transposeNote(noteFilteredItem->note,12);
-        adjusted = true;
-      }
-      while( noteFilteredItem->note > instMaxNote )
-      {
-        noteFilteredItem->note = transposeNote(noteFilteredItem->note,-12);
-        adjusted = true;
-      }
-      if( adjusted )
-      {
-        numAdjusted++;
-      }
-
-
-      unsigned long thisStart = stretchNote(noteFilteredItem->startTick,gStretch);
-      unsigned long thisEnd = stretchNote(noteFilteredItem->endTick,gStretch);
-
-      //unsigned long origMinTiming = 
-
-
-      long thisStartDelta = ((long)thisStart) % (long)MIN_TIMING_MS;
-
-      if( thisStartDelta > ((long)MIN_TIMING_MS / 2) )
-      {
-        thisStartDelta -= (long)MIN_TIMING_MS;
-      }
-
-      thisStart = thisStart - thisStartDelta;
-      thisEnd = thisEnd - thisStartDelta;
-
-      noteFilteredItem->startTick = thisStart;
-
-
-      /* snap to lead */
-      trackListItemType * trackItem = GetTrack(
-        trackFilteredList,
-        noteFilteredItem->track);
-
-      if( trackItem->lead )
-      {
-        lastLeadTrackStart = noteFilteredItem->startTick;
-      }
-      else
-      {
-        if( noteFilteredItem->startTick - lastLeadTrackStart <= (MIN_TIMING_MS * 2) )
-        {
-          noteFilteredItem->startTick = lastLeadTrackStart;
-        }
-      }
-
-
-      long thisDurationDelta = ((long)thisEnd - (long)thisStart) % (long)MIN_TIMING_MS;
-
-      if( thisDurationDelta > ((long)MIN_TIMING_MS / 2) )
-      {
-        thisDurationDelta -= (long)MIN_TIMING_MS;
-      }
-
-      noteFilteredItem->endTick = thisEnd - thisDurationDelta;
-
-      if( noteFilteredItem->endTick <= noteFilteredItem->startTick )
-      {
-        noteFilteredItem->endTick += MIN_TIMING_MS;
-      }
-
-    }
-    else
-    {
-      /* Filter out of range notes. */
-      if( noteFilteredItem->note < instMinNote || noteFilteredItem->note > instMaxNote )
-      {
-        numDeleted++;
-        noteFilteredItem = DeleteNote( noteFilteredList, noteFilteredItem );
-        noteItem = (noteListItemType *)noteItem->next;
-        continue;
-      }
-    }
-
-    noteItem = (noteListItemType *)noteItem->next;
-  }
-
-  if( o_NumDeleted != NULL )
-  {
-    *o_NumDeleted = numDeleted;
-  }
-  if( o_NumAdjusted != NULL )
-  {
-    *o_NumAdjusted = numAdjusted;
-  }
-
-  return 0;
-}
-
-/*
-** FUNCTION getNoteLetter
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-void getNoteLetter(unsigned char note, char * letter)
-{
-#define CENTER_OCTAVE 4
-  char octave = (char)((float)note / 12.0f);
-
-  switch( note % 12 )
-  {
-  case 0:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=C,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=c");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=C");
-    }
-    break;
-  case 1:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^C,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^c");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^C");
-    }
-    break;
-  case 2:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=D,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=d");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=D");
-    }
-    break;
-  case 3:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^D,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^d");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^D");
-    }
-    break;
-  case 4:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=E,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=e");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=E");
-    }
-    break;
-  case 5:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=F,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=f");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=F");
-    }
-    break;
-  case 6:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^F,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^f");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^F");
-    }
-    break;
-  case 7:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=G,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=g");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=G");
-    }
-    break;
-  case 8:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^G,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^g");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^G");
-    }
-    break;
-  case 9:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=A,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=a");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=A");
-    }
-    break;
-  case 10:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^A,");
-    }
-    else if( octave > CENTER_OCTAVE )
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^a");
-    }
-    else
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "^A");
-    }
-    break;
-  case 11:
-    if(octave < CENTER_OCTAVE)
-    {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=B,");
-    }
-    else if( octave > CENTER_OCTAVE )
+    unsigned int mid = low + ( high - low ) / 2;
+
+    if( events[mid].tick < tick )
     {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=b");
+      low = mid + 1;
     }
     else
     {
-      strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "=B");
+      high = mid;
     }
-    break;
-  default:
-    strcpy_s(letter, MAX_NOTE_LETTER_SIZE, "OMG");
-    break;
-
   }
+
+  return low;
 }
 
 /*
-** FUNCTION writeABCFile
+** FUNCTION previewSendState
 **
 ** DESCRIPTION
-**   
+**   Sends the program and controller state playing starts from, silencing
+**   whatever still sounds. Used at the start and after every jump.
 **
 *****************************************************************************/
-int writeABCFile(char * inFileName, char * instName)
+void previewSendState(unsigned long long due)
 {
-  char  * cpos = NULL;
-  char    outFileNameBase[MAX_STRING_SIZE] = { 0 }, outFileName[MAX_STRING_SIZE] = { 0 }, outFileNamePart[MAX_STRING_SIZE] = { 0 };
-  FILE  * outFilePtr = NULL;
+  midiEventType genMsg;
 
-  boolean fixedLength = false;
+  genMsg.channel = 1;
+  genMsg.event = 0xB; // controller change
+  genMsg.param1 = 0x7B; // all notes off
+  genMsg.param2 = 0;
 
-  if( 0 == strncmp(instName, "lute", 4) )
-  {
-    fixedLength = true;
-  }
-  else if( 0 == strncmp(instName, "theorbo", 7) )
-  {
-    fixedLength = true;
-  }
-  else if( 0 == strncmp(instName, "horn", 4) )
-  {
-    fixedLength = false;
-  }
-  else if( 0 == strncmp(instName, "flute", 5) )
-  {
-    fixedLength = false;
-  }
-  else if( 0 == strncmp(instName, "bagpipes", 8) )
-  {
-    fixedLength = false;
-  }
-  else if( 0 == strncmp(instName, "clarinet", 8) )
-  {
-    fixedLength = false;
-  }
+  sendMidiMessage(genMsg, due);
 
-  /* Generate output filenames. */  
-  strcpy_s( outFileNameBase, MAX_STRING_SIZE, inFileName );
-  cpos = outFileNameBase + strlen( outFileNameBase );
-  while( *cpos != '.' && cpos != outFileNameBase ) cpos--;
-  if ( cpos != outFileNameBase )
+  genMsg.event = 0xC; // program change
+  genMsg.param1 = 25; // nylon guitar
+  genMsg.param2 = 0;
+
+  sendMidiMessage(genMsg, due);
+
+  /* Notes end on their own note-offs, so the sustain pedal stays up. */
+  genMsg.event = 0xB; // controller change
+  genMsg.param1 = 0x40; // sustain
+  genMsg.param2 = 0x00; // off
+
+  sendMidiMessage(genMsg, due);
+}
+
+/*
+** FUNCTION previewPosition
+**
+** DESCRIPTION
+**   Converts microseconds since the preview started to a position in the
+**   file, in microseconds, at the given speed in percent.
+**
+*****************************************************************************/
+inline long long previewPosition(unsigned long long now, long long offset, unsigned int speed)
+{
+  return offset + (long long)( now * speed / 100 );
+}
+
+/*
+** FUNCTION previewDue
+**
+** DESCRIPTION
+**   The inverse of previewPosition: when, in microseconds since the preview
+**   started, the given file tick comes up.
+**
+*****************************************************************************/
+inline unsigned long long previewDue(unsigned long tick, long long offset, unsigned int speed)
+{
+  long long due = ( (long long)tick * 1000 - offset ) * 100 / speed;
+
+  return ( due > 0 ) ? (unsigned long long)due : 0;
+}
+
+/*
+** FUNCTION previewRingPush
+**
+** DESCRIPTION
+**   Queues a command for the scheduler. Called by the console thread only.
+**   Returns false when the ring is full.
+**
+*****************************************************************************/
+bool previewRingPush(previewRingType * ring, int command, long value)
+{
+  LONG tail = ring->tail;
+  LONG head = ring->head;
+
+  MemoryBarrier();
+
+  if( tail - head == PREVIEW_RING_SIZE )
   {
-    *cpos = '\0';
+    return false;
   }
 
-  sprintf_s(outFileNamePart, MAX_STRING_SIZE, "_%s.abc",instName);
+  ring->slots[tail & ( PREVIEW_RING_SIZE - 1 )].command = command;
+  ring->slots[tail & ( PREVIEW_RING_SIZE - 1 )].value = value;
 
-  strcpy_s( outFileName, MAX_STRING_SIZE, outFileNameBase );
-  strcat_s( outFileName, MAX_STRING_SIZE, outFileNamePart );
+  /* Publishes the slot before the new tail. */
+  InterlockedExchange( &ring->tail, tail + 1 );
 
-  /* Attempt to open all output files for writing. */
-  fopen_s( &outFilePtr, outFileName, "wb" );
-  if ( outFilePtr == NULL )
+  return true;
+}
+
+/*
+** FUNCTION previewRingPop
+**
+** DESCRIPTION
+**   Takes the oldest command off the ring. Called by the scheduler only.
+**   Returns false when the ring is empty.
+**
+*****************************************************************************/
+bool previewRingPop(previewRingType * ring, previewCommandType * o_Command)
+{
+  LONG head = ring->head;
+  LONG tail = ring->tail;
+
+  /* The slot must not be read before the tail that covers it. */
+  MemoryBarrier();
+
+  if( head == tail )
   {
-    printf( "ERROR: Can not open %s for writing. (Is there enough space?)\n", 
-        outFileName );
-    exit(-1);   
+    return false;
   }
 
-  /* Show filenames to user. */
-  printf( "\n\n[output]\nABC file: %s\n\n", outFileName );
+  *o_Command = ring->slots[head & ( PREVIEW_RING_SIZE - 1 )];
 
-  /*                                                                        *\
-  ============================== Write ABC Header ============================
-  \*                                                                        */
-  fprintf(outFilePtr, "X: 1\r\n");
-  fprintf(outFilePtr, "T: %s %s\r\n",outFileNameBase,instName);
-  fprintf(outFilePtr, "Z: Converted by MIDI2ABC: http://www.mindexpressions.com/users/lotro/\r\n");
-  fprintf(outFilePtr, "%%  From MIDI: %s\r\n",inFileName);
-  fprintf(outFilePtr, "%%  Transposed by: %d, Time scaled by: %0.02f\r\n", 0, gStretch);
-  fprintf(outFilePtr, "L: 1/16\r\n");
-  fprintf(outFilePtr, "Q: 1/4=250\r\n");
-  fprintf(outFilePtr, "K: C\r\n\r\n");
-
-  SortNoteListByStart(noteFilteredList);
-  
-  noteListItemType * noteItem = noteFilteredList;
-  char noteChordDef[256] = { 0 };
+  InterlockedExchange( &ring->head, head + 1 );
 
-  //unsigned long notesOn[127] = { 0 };
+  return true;
+}
 
-  int numPrinted = 0;
-  int minChordLength = 0;
-  int maxChordLength = 0;
-  unsigned long inChord = 0;
-  unsigned long lastStartTick = 0;
-  unsigned long lastEndTick = 0;
+/*
+** FUNCTION previewSchedulerThread
+**
+** DESCRIPTION
+**   Plays the preview messages of a previewPlayerType. It is the only
+**   thread that sends MIDI while the preview runs and it never touches the
+**   console, so drawing the clock or reading keys cannot hold a note up.
+**
+**   Commands from the console thread are taken off the ring each time it
+**   wakes. Between deadlines it sleeps on a waitable timer set for the next
+**   one on the performance counter, and on the wake event, so commands
+**   act at once. The timer is set to go off PREVIEW_SPIN_US early and the
+**   rest is waited out on the counter, which keeps messages within a
+**   fraction of a millisecond of their time. It wakes at least every
+**   PREVIEW_POSITION_US to publish the file position.
+**
+**   Jumps are a binary search of the message array and the loop start index
+**   is found once when it is marked. File position is an offset plus the
+**   time since the start scaled by the speed, so a speed change rescales the
+**   remaining deadlines from where playing is. Muted notes do not start;
+**   every note-off goes out so nothing hangs when a mask changes mid-note.
+**
+*****************************************************************************/
+DWORD WINAPI previewSchedulerThread(LPVOID param)
+{
+  previewPlayerType * player = (previewPlayerType *)param;
+  previewEventType *  events = player->events;
+  unsigned int        numEvents = player->numEvents;
 
-  int numChordNotes = 0;
-  while( noteItem != NULL )
-  {
-    char noteDef[MAX_NOTE_DEFINITION_SIZE] = { 0 };
-    char noteLetter[MAX_NOTE_LETTER_SIZE] = { 0 };
+  HANDLE        timer = CreateWaitableTimer( NULL, TRUE, NULL );
+  HANDLE        waitHandles[2] = { timer, player->wake };
 
-    if( lastStartTick != noteItem->startTick )
-    {
-      int silenceDuration = (int)((noteItem->startTick - lastEndTick) / MIN_TIMING_MS);
+  /* File position minus scaled time since start, in microseconds. */
+  long long          offset = 0;
+  unsigned int       speed = 100;       // percent
 
-      if( silenceDuration > 0 )
-      {
-        while( silenceDuration > 16 )
-        {
-          fprintf(outFilePtr,"z%d",16);
-          numPrinted++; silenceDuration -= 16;
-        }
+  unsigned long      lastTick = ( numEvents > 0 ) ? events[numEvents - 1].tick : 0;
+  unsigned long      loopStartTick = 0;
+  unsigned long      loopEndTick = 0;   // 0 when not looping
+  unsigned int       loopStartIndex = 0;
 
-        fprintf(outFilePtr,"z%d",silenceDuration);
-        numPrinted++;
+  bool               muted[MAX_TRACKS] = { false };
+  bool               soloed[MAX_TRACKS] = { false };
+  unsigned int       numSoloed = 0;
 
-      }
-    }
+  bool               play = true;
+  unsigned int       e = 0;
 
-    if( minChordLength != maxChordLength && inChord == 0 )
-    {
-      int chordMakeupZ = maxChordLength - minChordLength;
+  /* Ask for a 1 ms system timer while playing. */
+  timeBeginPeriod( 1 );
 
-      minChordLength = 0;
-      maxChordLength = 0;
+  while( play )
+  {
+    unsigned long long now = previewMicroseconds( &player->startTime, &player->frequency );
+    long long          position = previewPosition( now, offset, speed );
+    previewCommandType command;
+    long long          target = 0;     // milliseconds
+    bool               seek = false;
+    bool               wrap = false;
 
-      while( chordMakeupZ > 16 )
+    while( previewRingPop( &player->commands, &command ) )
+    {
+      if( command.command == PREVIEW_CMD_STOP )
+      {
+        play = false;
+      }
+      else if( command.command == PREVIEW_CMD_SEEK_TO )
+      {
+        target = command.value;
+        seek = true;
+      }
+      else if( command.command == PREVIEW_CMD_SEEK_BY )
+      {
+        target = position / 1000 + command.value;
+        seek = true;
+      }
+      else if( command.command == PREVIEW_CMD_LOOP_START )
+      {
+        loopStartTick = (unsigned long)( position / 1000 );
+        loopStartIndex = previewSeekIndex( events, numEvents, loopStartTick );
+        loopEndTick = 0;
+      }
+      else if( command.command == PREVIEW_CMD_LOOP_END )
+      {
+        if( position / 1000 > (long long)loopStartTick )
+        {
+          loopEndTick = (unsigned long)( position / 1000 );
+        }
+      }
+      else if( command.command == PREVIEW_CMD_LOOP_CLEAR )
+      {
+        loopEndTick = 0;
+      }
+      else if( command.command == PREVIEW_CMD_MUTE
+               && command.value >= 0 && command.value < MAX_TRACKS )
+      {
+        muted[command.value] = !muted[command.value];
+      }
+      else if( command.command == PREVIEW_CMD_SOLO
+               && command.value >= 0 && command.value < MAX_TRACKS )
+      {
+        soloed[command.value] = !soloed[command.value];
+        numSoloed = soloed[command.value] ? numSoloed + 1 : numSoloed - 1;
+      }
+      else if( command.command == PREVIEW_CMD_SPEED
+               && command.value >= PREVIEW_SPEED_MIN
+               && command.value <= PREVIEW_SPEED_MAX )
       {
-        fprintf(outFilePtr,"z%d",16);
-        numPrinted++; chordMakeupZ -= 16;
+        /* Carry on from the same place at the new speed. */
+        speed = (unsigned int)command.value;
+        offset = position - previewPosition( now, 0, speed );
       }
-      fprintf(outFilePtr,"z%d",chordMakeupZ);
-      numPrinted++;
     }
 
-    if( fixedLength )
+    if( !play )
     {
-      lastEndTick = noteItem->startTick + 60;
+      break;
     }
 
-
-    getNoteLetter(noteItem->note,noteLetter);
-
-    int noteDuration = (int)((noteItem->endTick - noteItem->startTick) / MIN_TIMING_MS);
-
-    if( fixedLength )
+    /* A loop wraps when playing reaches the B mark, not when the last
+       message before it has gone out, so the rest of the region is heard
+       too. */
+    if( !seek
+        && loopEndTick != 0
+        && ( e >= numEvents || events[e].tick >= loopEndTick )
+        && now >= previewDue( loopEndTick, offset, speed ) )
     {
-      noteDuration = 1;
+      target = loopStartTick;
+      seek = true;
+      wrap = true;
     }
 
-    if( noteItem->next != NULL
-        && noteItem->startTick == ((noteListItemType *)noteItem->next)->startTick )
+    if( seek )
     {
-      if( !inChord )
+      if( target < 0 )
       {
-        inChord = 1;
-        minChordLength = noteDuration;
-        maxChordLength = noteDuration;
-        fprintf(outFilePtr,"[");
+        target = 0;
+      }
+      if( target > (long long)lastTick )
+      {
+        target = lastTick;
       }
-    }
 
-    lastStartTick = noteItem->startTick;
+      e = wrap ? loopStartIndex : previewSeekIndex( events, numEvents, (unsigned long)target );
+      offset = target * 1000 - previewPosition( now, 0, speed );
+      position = target * 1000;
+      previewSendState( now );
+    }
 
-    sprintf_s(noteDef, MAX_NOTE_DEFINITION_SIZE, "%s", noteLetter);
+    InterlockedExchange( &player->position, (LONG)( position / 1000 ) );
+    InterlockedExchange( &player->looping, ( loopEndTick != 0 ) ? 1 : 0 );
 
-    if( inChord )
+    if( e >= numEvents && loopEndTick == 0 )
     {
-      numChordNotes++;
+      break;
+    }
 
-      if( minChordLength > noteDuration )
-      {
-        minChordLength = noteDuration;
-      }
-      if( maxChordLength < noteDuration )
-      {
-        maxChordLength = noteDuration;
-      }
+    /* Nothing more goes out before the B mark, so wait for it. A region
+       with no messages in it plays as silence for its length. */
+    bool atLoopEnd = ( loopEndTick != 0 && ( e >= numEvents || events[e].tick >= loopEndTick ) );
+
+    unsigned long long due = now;
+
+    if( atLoopEnd )
+    {
+      due = previewDue( loopEndTick, offset, speed );
+    }
+    else if( e < numEvents )
+    {
+      due = previewDue( events[e].tick, offset, speed );
     }
+    unsigned long long wake = ( due < now + PREVIEW_POSITION_US ) ? due : now + PREVIEW_POSITION_US;
 
-    if( numChordNotes < 6 )
+    if( now < due && timer != NULL && wake > now + PREVIEW_SPIN_US )
     {
-      while( noteDuration > 16 )
-      {
-        fprintf(outFilePtr,"%s%d",noteDef,16);
-        if( !inChord )
-        {
-          fprintf(outFilePtr,"-");
-        }
-        numPrinted++; noteDuration -= 16;
-      }
+      LARGE_INTEGER dueTime;
+
+      /* Relative, in 100 ns units. */
+      dueTime.QuadPart = -(LONGLONG)( ( wake - now - PREVIEW_SPIN_US ) * 10 );
 
-      fprintf(outFilePtr,"%s%d",noteDef,noteDuration);
-      numPrinted++;
+      SetWaitableTimer( timer, &dueTime, 0, NULL, NULL, FALSE );
+      WaitForMultipleObjects( 2, waitHandles, FALSE, INFINITE );
+      continue;
     }
 
-    if( noteItem->next == NULL
-        || noteItem->startTick != ((noteListItemType *)noteItem->next)->startTick )
+    while( now < due )
     {
-      if( inChord )
-      {
-        inChord = 0; numChordNotes = 0;
-        fprintf(outFilePtr,"]");
-      }
+      now = previewMicroseconds( &player->startTime, &player->frequency );
     }
 
-    if(!inChord && numPrinted >= 32)
+    if( e >= numEvents || atLoopEnd )
     {
-      fprintf(outFilePtr,"\\\r\n");
-      numPrinted = 0;
+      continue;
     }
 
-    noteItem = (noteListItemType *)noteItem->next;
-  }
+    /* Everything due at this tick goes out in one go. */
+    unsigned long tick = events[e].tick;
 
-  fclose(outFilePtr);
-  return 0;
-}
+    for( ; e < numEvents && events[e].tick == tick; e++ )
+    {
+      unsigned int t = events[e].track;
 
-/*
-** FUNCTION sendMidiMessage
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-inline void sendMidiMessage(midiEventType noteEvent)
-{
-  MMRESULT mmr;
-  DWORD * val = (DWORD *)&noteEvent;
+      if( events[e].noteOn
+          && t < MAX_TRACKS
+          && ( muted[t] || ( numSoloed > 0 && !soloed[t] ) ) )
+      {
+        continue;
+      }
 
-  for( unsigned int i = 0; i < numDevices; i++ )
-  {
-    if ( devOpen[i] )
-    {
-      mmr = midiOutShortMsg(hMidiOut[i],*val);
+      gMidiBackend->send( gMidiBackend->context, events[e].message, due );
     }
-  }
-}
-
-/*
-** FUNCTION sendMidiReset
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-inline void sendMidiReset()
-{
-  MMRESULT mmr;
 
-  for( unsigned int i = 0; i < numDevices; i++ )
-  {
-    if ( devOpen[i] )
+    player->totalLate += now - due;
+    if( now - due > player->maxLate )
     {
-      mmr = midiOutReset(hMidiOut[i]);
+      player->maxLate = now - due;
     }
+    player->numBatches++;
   }
-}
 
-/*
-** FUNCTION sendMidiVolume
-**
-** DESCRIPTION
-**   
-**
-*****************************************************************************/
-inline void sendMidiVolume(DWORD vol)
-{
-  MMRESULT mmr;
-  for( unsigned int i = 0; i < numDevices; i++ )
+  timeEndPeriod( 1 );
+
+  if( timer != NULL )
   {
-    if ( devOpen[i] )
-    {
-      mmr = midiOutSetVolume(hMidiOut[i],vol);
-    }
+    CloseHandle( timer );
   }
+
+  InterlockedExchange( &player->finished, 1 );
+
+  return 0;
 }
 
 /*
-** FUNCTION _tmain
+** FUNCTION previewTrack
 **
 ** DESCRIPTION
-**   Program entry-point.
+**   Plays the filtered notes of one track, or of the whole file for track
+**   0, through the MIDI backend, each for as long as it lasts.
+**
+**   The notes are turned into a time-sorted array of messages and handed to
+**   previewSchedulerThread, which sends them. This thread only reads keys
+**   and draws the clock: it passes commands to the scheduler through a
+**   lock-free single-producer, single-consumer ring and reads the position
+**   back from a shared counter, so a slow console never delays a note. How
+**   late each batch of messages went out is reported at the end.
+**
+**   While playing, keys move around the file: ',' and '.' (or the left and
+**   right arrows) go back and forward PREVIEW_SEEK_MS, the digits jump to
+**   that tenth of the file, 'a' and 'b' mark a region to loop and 'c'
+**   clears it. '[' and ']' pick a track, 'm' mutes it and 's' solos it.
+**   '-' and '+' change the speed. Every other key stops.
 **
 *****************************************************************************/
 int previewTrack(unsigned int track)
 {
-  char inputBuffer[256] = { 0 };
-  bool play = true;
+  previewPlayerType * player = new previewPlayerType;
 
-  noteListItemType * noteItem;
-
-  SortNoteListByStart(noteFilteredList);
+  ZeroMemory( player, sizeof( previewPlayerType ) );
 
-  noteItem = noteFilteredList;
+  player->track = track;
+  player->events = buildPreviewEvents( track, &player->numEvents );
 
   if( track > 0 )
   {
-    printf("\nPreviewing track: %d\nPress any key to stop.\n",track);
+    printf("\nPreviewing track: %d\n",track);
   }
   else
   {
-    printf("\nPreviewing file.\nPress any key to stop.\n");
+    printf("\nPreviewing file.\n");
+  }
+  if( !gPlayOnly )
+  {
+    printf(",/. seek, 0-9 jump, a/b loop region, c clear loop, any other key stops.\n");
+    printf("[/] pick track, m mute, s solo, -/+ speed.\n");
   }
-
-  DWORD startTime = GetTickCount();
-  DWORD fileTime = 0;
 
   /* Get a handle to the console */
-  HANDLE h = GetStdHandle ( STD_INPUT_HANDLE );
-
-  midiEventType noteOn,noteOff,genMsg;
-
-  sendMidiVolume(0);
-
-  genMsg.channel = 1;
-  genMsg.event = 0xC; // program change
-  genMsg.param1 = 25; // nylon guitar
-  genMsg.param2 = 0;
-
-  sendMidiMessage(genMsg);
-
-#if 0
-  genMsg.event = 0xC; // program change
-  genMsg.param1 = 25; // nylon guitar
-  genMsg.param2 = 0;
+  HANDLE h = GetStdHandle ( STD_INPUT_HANDLE );
 
-  sendMidiMessage(genMsg);
-#endif
+  /* Message times are measured from here, on the backend's clock too. */
+  gMidiBackend->begin( gMidiBackend->context );
 
-  genMsg.event = 0xB; // controller change
-  genMsg.param1 = 0x40; // sustain
-  genMsg.param2 = 0x7f; // on
+  QueryPerformanceFrequency( &player->frequency );
+  QueryPerformanceCounter( &player->startTime );
 
-  sendMidiMessage(genMsg);
+  sendMidiVolume(0);
+  previewSendState(0);
+  sendMidiVolume(0xFFFF);
+
+  if( !gPlayOnly )
+  {
+    SetConsoleMode(h,ENABLE_PROCESSED_INPUT);
+    FlushConsoleInputBuffer(h);
+  }
 
-  noteOn.channel = 1;
-  noteOn.event = 9;
-  noteOn.param2 = 127;
-  noteOn.param1 = 0;
+  /* What the keys have asked for, to draw the status line. */
+  unsigned long      lastTick = ( player->numEvents > 0 ) ? player->events[player->numEvents - 1].tick : 0;
+  unsigned int       speed = 100;       // percent
+  bool               muted[MAX_TRACKS] = { false };
+  bool               soloed[MAX_TRACKS] = { false };
 
-  noteOff.channel = 1;
-  noteOff.event = 8;
-  noteOff.param2 = 0x40;
-  noteOff.param1 = 0;
+  /* The tracks '[' and ']' step through. */
+  unsigned int       tracks[MAX_TRACKS];
+  unsigned int       numTracks = 0;
+  unsigned int       pick = 0;
+  trackListItemType * trackItem;
 
-  sendMidiVolume(0xFFFF);
+  for( trackItem = gConversion.trackFilteredList; trackItem != NULL; trackItem = (trackListItemType *)trackItem->next )
+  {
+    if( ( track == 0 || trackItem->track == track )
+        && trackItem->track < MAX_TRACKS
+        && numTracks < MAX_TRACKS )
+    {
+      tracks[numTracks++] = trackItem->track;
+    }
+  }
 
-  DWORD nextPrint = 0;
+  player->wake = CreateEvent( NULL, FALSE, FALSE, NULL );
 
-  SetConsoleMode(h,ENABLE_PROCESSED_INPUT);
-  FlushConsoleInputBuffer(h);
+  HANDLE scheduler = CreateThread( NULL, 0, previewSchedulerThread, player, 0, NULL );
 
-  while( play && noteItem != NULL )
+  if( scheduler == NULL )
   {
-    if( ( track != 0 
-          && noteItem->track != track )
-        || noteItem->channel == 9
-        )
+    /* No thread, so play it through with no controls. */
+    previewSchedulerThread( player );
+  }
+
+  while( player->finished == 0 )
+  {
+    /* Nothing to read or draw; the scheduler plays to the end. */
+    if( gPlayOnly )
     {
-      noteItem = (noteListItemType *)noteItem->next;
+      Sleep( PREVIEW_REDRAW_MS );
       continue;
     }
 
-    while( play && noteItem->startTick > fileTime )
-    {
-      DWORD numInputRead = 0;
+    WaitForSingleObject( h, PREVIEW_REDRAW_MS );
 
-      if( fileTime > nextPrint )
-      {
-        unsigned int sec = 0, min = 0;
+    int  key = previewReadKey(h);
+    int  command = -1;
+    long value = 0;
 
-        min = ((fileTime / 60) / 1000);
-        sec = (fileTime / 1000) - (60 * min);
-        printf("\r[%02d:%02d]",min,sec);
-        nextPrint += 500;
+    if( key == ',' || key == PREVIEW_KEY_VIRTUAL + VK_LEFT )
+    {
+      command = PREVIEW_CMD_SEEK_BY;
+      value = -PREVIEW_SEEK_MS;
+    }
+    else if( key == '.' || key == PREVIEW_KEY_VIRTUAL + VK_RIGHT )
+    {
+      command = PREVIEW_CMD_SEEK_BY;
+      value = PREVIEW_SEEK_MS;
+    }
+    else if( key >= '0' && key <= '9' )
+    {
+      command = PREVIEW_CMD_SEEK_TO;
+      value = (long)( (unsigned long long)lastTick * ( key - '0' ) / 10 );
+    }
+    else if( key == 'a' || key == 'A' )
+    {
+      command = PREVIEW_CMD_LOOP_START;
+    }
+    else if( key == 'b' || key == 'B' )
+    {
+      command = PREVIEW_CMD_LOOP_END;
+    }
+    else if( key == 'c' || key == 'C' )
+    {
+      command = PREVIEW_CMD_LOOP_CLEAR;
+    }
+    else if( key == '[' || key == ']' )
+    {
+      if( numTracks > 0 )
+      {
+        pick = ( pick + ( ( key == ']' ) ? 1 : numTracks - 1 ) ) % numTracks;
       }
-
-      Sleep(5);
-
-      //ReadConsole(h,&inputBuffer,1,&numInputRead,NULL);
-      GetNumberOfConsoleInputEvents(h,&numInputRead);
-      if( numInputRead > 0 )
+    }
+    else if( key == 'm' || key == 'M' || key == 's' || key == 'S' )
+    {
+      if( numTracks > 0 )
       {
-        INPUT_RECORD inputRecord;
-        DWORD t_numInputRead = 0;
+        unsigned int t = tracks[pick];
 
-        for( unsigned int x = 0; x < numInputRead; x++ )
+        if( key == 'm' || key == 'M' )
+        {
+          muted[t] = !muted[t];
+          command = PREVIEW_CMD_MUTE;
+        }
+        else
         {
-          ReadConsoleInput(h,&inputRecord,1,&t_numInputRead);
-
-          if( t_numInputRead > 0
-              && inputRecord.EventType == KEY_EVENT )
-          {
-            if( inputRecord.Event.KeyEvent.bKeyDown )
-            {
-              play = false;
-              break;
-            }
-          }
+          soloed[t] = !soloed[t];
+          command = PREVIEW_CMD_SOLO;
         }
-        numInputRead = 0;
+        value = t;
       }
-
-      fileTime = GetTickCount() - startTime;
     }
-
-    if( !play )
+    else if( key == '-' || key == '+' || key == '=' )
     {
-      break;
+      if( key == '-' && speed > PREVIEW_SPEED_MIN )
+      {
+        speed -= PREVIEW_SPEED_STEP;
+      }
+      else if( key != '-' && speed < PREVIEW_SPEED_MAX )
+      {
+        speed += PREVIEW_SPEED_STEP;
+      }
+      command = PREVIEW_CMD_SPEED;
+      value = speed;
     }
-
-    if( noteItem->note < N_C4 ) //(unsigned char)(OCTAVE((int)N_C4,(int)-1)) )
+    else if( key != 0 )
     {
-      noteOn.param1 = noteItem->note - 12;
-      noteOff.param1 = noteItem->note - 12;
+      command = PREVIEW_CMD_STOP;
     }
-    else
+
+    if( command >= 0 && previewRingPush( &player->commands, command, value ) )
     {
-      noteOn.param1 = noteItem->note;
-      noteOff.param1 = noteItem->note;
+      SetEvent( player->wake );
     }
 
-    sendMidiMessage(noteOn);
+    unsigned int sec = 0, min = 0;
+    unsigned long fileTime = (unsigned long)player->position;
 
-    /*
-    if( noteItem->next != NULL &&
-      noteItem->startTick != ((noteListItemType *)noteItem->next)->startTick )
+    min = ((fileTime / 60) / 1000);
+    sec = (fileTime / 1000) - (60 * min);
+    printf("\r[%02d:%02d]%s %3u%%",min,sec,player->looping ? " loop" : "     ",speed);
+    if( numTracks > 0 )
     {
-       Sleep(60);
+      unsigned int t = tracks[pick];
+
+      printf(" track %2u %s",t,soloed[t] ? "solo " : ( muted[t] ? "muted" : "     " ));
     }
-    */
+  }
 
-    sendMidiMessage(noteOff);
-/*    Sleep(1000);
-    break;
-*/
-    noteItem = (noteListItemType *)noteItem->next;
+  if( scheduler != NULL )
+  {
+    WaitForSingleObject( scheduler, INFINITE );
+    CloseHandle( scheduler );
+  }
+  if( player->wake != NULL )
+  {
+    CloseHandle( player->wake );
   }
 
-  printf("\r                ");
+  printf("\r                                      ");
+
+  if( player->numBatches > 0 )
+  {
+    printf("\r%lu batches of messages played, %0.02f ms late on average, %0.02f ms at worst\n",
+      player->numBatches, (double)player->totalLate / player->numBatches / 1000.0, (double)player->maxLate / 1000.0);
+  }
   sendMidiVolume(0);
   sendMidiReset();
+
+  gMidiBackend->end( gMidiBackend->context );
+
+  delete [] player->events;
+  delete player;
+
   return 0;
 }
 
@@ -2987,11 +2019,8 @@ int previewTrack(unsigned int track)
 *****************************************************************************/
 void CleanUpExit(int retval)
 {
-  ResetNoteList( noteList );
-  ResetNoteList( noteFilteredList );
-  ResetTrackList( trackList );
-  ResetTrackList( trackFilteredList );
-  midiCloseDevices();
+  resetConversion( &gConversion );
+  midiCloseDevices( &gMidiDevices );
   exit(retval);
 }
 
@@ -3010,166 +2039,277 @@ int _tmain(int argc, _TCHAR* argv[])
 
   SetConsoleTitle("MIDI2ABC " VERSION );
 
-  /* Print copyright information. */
-  print_header_info();
+  initConversion( &gConversion );
 
-  /* Check # of arguments. */
-  if( argc != 3 ) 
+  /* The pipeline reports what it does on the console. */
+  gConversion.report = vprintf;
+
+  /* Parse options. */
+  int argi = 1;
+  while( argi < argc && argv[argi][0] == '-' )
   {
-    if( argc > 3 )
+    if( 0 == strcmp(argv[argi], "-g") && argi + 1 < argc )
     {
-      printf("ERROR: Too many arguments.\n");
+      gConversion.quantizer = selectQuantizer( strtoul(argv[argi + 1], NULL, 10) );
+      if( gConversion.quantizer == NULL )
+      {
+        printf("ERROR: Unsupported timing grid: %s ms.\n", argv[argi + 1]);
+        print_usage();
+        exit(-1);
+      }
+      argi += 2;
     }
-    else
+    else if( 0 == strcmp(argv[argi], "-d") && argi + 1 < argc )
     {
-      printf("ERROR: Not enough arguments.\n");
+      gConversion.division = (unsigned int)strtoul(argv[argi + 1], NULL, 10);
+      if( gConversion.division != 8 && gConversion.division != 16 && gConversion.division != 32 && gConversion.division != 64 )
+      {
+        printf("ERROR: Unsupported note division: %s.\n", argv[argi + 1]);
+        print_usage();
+        exit(-1);
+      }
+      argi += 2;
     }
-    printf("\nUsage: MIDI2ABC <instrument> <inFileName>\n\n");
-    printf("  instrument\t= One of the following:\n");
-    printf("  \t\t    lute theorbo clarinet horn flute bagpipes\n");
-    printf("  inFileName\t= The filename of the MIDI file.\n\n");
-    exit(-1);
-  }
+    else if( 0 == strcmp(argv[argi], "-o") && argi + 1 < argc )
+    {
+      if( gAbcFd != -1 )
+      {
+        printf("ERROR: Only one -o may be given.\n");
+        exit(-1);
+      }
 
-  if( 0 == _strnicmp(argv[1], "lute", 4) )
-  {
-    instMaxNote = LUTE_NOTE_MAX;
-    instMinNote = LUTE_NOTE_MIN;
-  }
-  else if( 0 == _strnicmp(argv[1], "harp", 4) )
-  {
-    instMaxNote = HARP_NOTE_MAX;
-    instMinNote = HARP_NOTE_MIN;
-  }
-  else if( 0 == _strnicmp(argv[1], "theorbo", 7) )
-  {
-    instMaxNote = THEORBO_NOTE_MAX;
-    instMinNote = THEORBO_NOTE_MIN;
-  }
-  else if( 0 == _strnicmp(argv[1], "horn", 4) )
-  {
-    instMaxNote = HORN_NOTE_MAX;
-    instMinNote = HORN_NOTE_MIN;
-  }
-  else if( 0 == _strnicmp(argv[1], "flute", 5) )
-  {
-    instMaxNote = FLUTE_NOTE_MAX;
-    instMinNote = FLUTE_NOTE_MIN;
-  }
-  else if( 0 == _strnicmp(argv[1], "bagpipes", 8) )
-  {
-    instMaxNote = BAGPIPES_NOTE_MAX;
-    instMinNote = BAGPIPES_NOTE_MIN;
-  }
-  else if( 0 == _strnicmp(argv[1], "clarinet", 8) )
-  {
-    instMaxNote = CLARINET_NOTE_MAX;
-    instMinNote = CLARINET_NOTE_MIN;
-  }
-  else
-  {
-    printf("ERROR: Bad instrument name.\n");
-    CleanUpExit(-1);
+      if( 0 == strcmp(argv[argi + 1], "-") )
+      {
+        /* ABC goes to the real stdout; everything else printed from here
+           on goes to stderr. */
+        fflush(stdout);
+        gAbcFd = _dup(_fileno(stdout));
+        (void)_setmode(gAbcFd, _O_BINARY);
+        (void)_dup2(_fileno(stderr), _fileno(stdout));
+      }
+      else
+      {
+        gAbcFd = _open(argv[argi + 1], _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+      }
+
+      if( gAbcFd == -1 )
+      {
+        printf("ERROR: Can not open %s for writing.\n", argv[argi + 1]);
+        exit(-1);
+      }
+      argi += 2;
+    }
+    else if( 0 == strcmp(argv[argi], "-m") && argi + 1 < argc )
+    {
+      gMidiBackend = NULL;
+      for( unsigned int b = 0; b < NUM_MIDI_BACKENDS; b++ )
+      {
+        if( 0 == strcmp(argv[argi + 1], midiBackends[b].name) )
+        {
+          gMidiBackend = &midiBackends[b];
+        }
+      }
+      if( gMidiBackend == NULL )
+      {
+        printf("ERROR: Unknown MIDI backend: %s.\n", argv[argi + 1]);
+        print_usage();
+        exit(-1);
+      }
+      argi += 2;
+    }
+    else if( 0 == strcmp(argv[argi], "-t") )
+    {
+      gPlayOnly = true;
+      argi++;
+    }
+    else if( 0 == strcmp(argv[argi], "-w") && argi + 1 < argc )
+    {
+      gWavFileName = argv[argi + 1];
+      argi += 2;
+    }
+    else if( 0 == strcmp(argv[argi], "-a") )
+    {
+      gConversion.explicitAccidentals = true;
+      argi++;
+    }
+    else if( 0 == strcmp(argv[argi], "-r") )
+    {
+      gConversion.repeats = true;
+      argi++;
+    }
+    else if( 0 == strcmp(argv[argi], "-p") )
+    {
+      gWriteParts = true;
+      argi++;
+    }
+    else if( 0 == strcmp(argv[argi], "-c") && argi + 1 < argc )
+    {
+      gConversion.chordToleranceMs = strtoul(argv[argi + 1], NULL, 10);
+      argi += 2;
+    }
+    else if( 0 == strcmp(argv[argi], "-n") && argi + 1 < argc )
+    {
+      gConversion.maxChordNotes = (unsigned int)strtoul(argv[argi + 1], NULL, 10);
+      if( gConversion.maxChordNotes < 1 || gConversion.maxChordNotes > MAX_CHORD_LIMIT )
+      {
+        printf("ERROR: Chords can have 1 to %u notes: %s.\n", MAX_CHORD_LIMIT, argv[argi + 1]);
+        print_usage();
+        exit(-1);
+      }
+      argi += 2;
+    }
+    else
+    {
+      printf("ERROR: Bad option: %s\n", argv[argi]);
+      print_usage();
+      exit(-1);
+    }
   }
 
-  /* Enumerate and open the MIDI devices. */
-  numDevices = midiOutGetNumDevs();
-  if( numDevices < 1 )
+  if( gPlayOnly && ( gAbcFd != -1 || gWavFileName != NULL ) )
   {
-    printf("ERROR: Sorry about this, but I can't seem to find any MIDI input devices installed in your computer. My advice: check to make sure you have drivers for it installed properly. Beyond that, I can't help ya, I'm afraid. :-(\n");
-		CleanUpExit(-1);
+    printf("ERROR: -t plays the file and can not be used with -o or -w.\n");
+    print_usage();
+    exit(-1);
   }
 
-  unsigned int numOpened = 0;
+  /* Print copyright information. */
+  print_header_info();
 
-  for( unsigned int i = 0; i < 1/* numDevices */; i++ )
+  /* Check # of arguments. */
+  if( argc - argi != 2 ) 
   {
-    if( midiOpenDevice(i) )
+    if( argc - argi > 2 )
+    {
+      printf("ERROR: Too many arguments.\n");
+    }
+    else
     {
-      numOpened++;
+      printf("ERROR: Not enough arguments.\n");
     }
+    print_usage();
+    exit(-1);
   }
 
-  if( numOpened < 1 )
-  {
-    printf("ERROR: Sorry about this, but, though I did find at least one MIDI Input device to use, I can't seem to get control of any of them. My advice: make sure there are no other applications running that might use MIDI. Beyond that, I can't help ya, I'm afraid. :-(\n");
-		CleanUpExit(-1);
-  }
+  char * instArg = argv[argi];
+  char * inFileName = argv[argi + 1];
+
+  /* Several instruments may be given as a comma separated list. The file is
+     parsed once and an ABC file is written for each of them. */
+  char instNames[MAX_FANOUT_INSTRUMENTS][MAX_STRING_SIZE] = { 0 };
+  const instrumentType * instList[MAX_FANOUT_INSTRUMENTS] = { 0 };
+  unsigned int numInstruments = 0;
 
-  if( numOpened != numDevices )
   {
-    printf("NOTE: This may or may not cause a problem for you, but I was unable to get control over at least one of the MIDI Input devices in your system. I did manage to get control of at least one of them, so let's hope that it is the one you have your equipment plugged in to. :-) Otherwise, if you can't get this to work, check to make sure you don't have any other software running that would use the MIDI devices and try restarting this utility.\n");
-    //exit(-1); 
-    (void)_getch();
-  }
+    char * cpos = instArg;
 
+    while( *cpos != '\0' )
+    {
+      char * cend = strchr(cpos, ',');
+      size_t len = ( cend != NULL ) ? (size_t)(cend - cpos) : strlen(cpos);
 
+      if( numInstruments == MAX_FANOUT_INSTRUMENTS || len == 0 || len >= MAX_STRING_SIZE )
+      {
+        printf("ERROR: Bad instrument list.\n");
+        CleanUpExit(-1);
+      }
 
-  /* Parse MIDI file */
-  if( -1 == parseMIDIFile( argv[2], &format, &numTracks ) )
-  {
-    CleanUpExit(-1);
-  }
+      strncpy_s(instNames[numInstruments], MAX_STRING_SIZE, cpos, len);
 
-  trackListItemType * trackItem = trackList;
-  while( trackItem != NULL )
-  {
-    if( format == 1 )
-    {
-      trackItem->track--;
-    }
+      instList[numInstruments] = findInstrument(instNames[numInstruments]);
+      if( instList[numInstruments] == NULL )
+      {
+        printf("ERROR: Bad instrument name.\n");
+        CleanUpExit(-1);
+      }
 
-    if( trackItem->track == 0 )
-    {
-      trackItem = DeleteTrack( 
-        trackList, trackItem );
+      numInstruments++;
+      cpos += len;
+      if( *cpos == ',' )
+      {
+        cpos++;
+      }
     }
-    else
+
+    if( numInstruments == 0 )
     {
-      trackItem = (trackListItemType *)trackItem->next;
+      printf("ERROR: Bad instrument name.\n");
+      CleanUpExit(-1);
     }
   }
 
-  noteListItemType * noteItem = noteList;
-  while( noteItem != NULL )
+  gConversion.instMinNote = instList[0]->minNote;
+  gConversion.instMaxNote = instList[0]->maxNote;
+
+  /* Enumerate and open the MIDI devices. They are only needed for
+     previews played on them, which aren't offered when streaming. */
+  if( gAbcFd == -1 && gWavFileName == NULL && gMidiBackend == &midiBackends[0] )
   {
-    if( format == 1 )
+    gMidiDevices.numDevices = midiOutGetNumDevs();
+    if( gMidiDevices.numDevices > MAX_SUPPORTED_DEVICES )
     {
-      noteItem->track--;
+      gMidiDevices.numDevices = MAX_SUPPORTED_DEVICES;
     }
-
-    if( ( format == 1 && noteItem->track == 0 ) 
-        || noteItem->channel == 9 )
+    if( gMidiDevices.numDevices < 1 )
     {
-      noteItem = DeleteNote( noteList, noteItem );
+      printf("ERROR: Sorry about this, but I can't seem to find any MIDI input devices installed in your computer. My advice: check to make sure you have drivers for it installed properly. Beyond that, I can't help ya, I'm afraid. :-(\n");
+      CleanUpExit(-1);
     }
-    else
+
+    unsigned int numOpened = 0;
+
+    for( unsigned int i = 0; i < 1/* numDevices */; i++ )
     {
-      noteItem = (noteListItemType *)noteItem->next;
+      if( midiOpenDevice(&gMidiDevices, i) )
+      {
+        numOpened++;
+      }
     }
-  }
 
-  trackItem = trackList;
-  while( trackItem != NULL )
-  {
-    if( CountNotes( noteList, trackItem->track ) == 0 )
+    if( numOpened < 1 )
     {
-      trackItem = DeleteTrack( 
-        trackList, trackItem );
+      printf("ERROR: Sorry about this, but, though I did find at least one MIDI Input device to use, I can't seem to get control of any of them. My advice: make sure there are no other applications running that might use MIDI. Beyond that, I can't help ya, I'm afraid. :-(\n");
+      CleanUpExit(-1);
     }
-    else
+
+    if( numOpened != gMidiDevices.numDevices )
     {
-      trackItem = (trackListItemType *)trackItem->next;
+      printf("NOTE: This may or may not cause a problem for you, but I was unable to get control over at least one of the MIDI Input devices in your system. I did manage to get control of at least one of them, so let's hope that it is the one you have your equipment plugged in to. :-) Otherwise, if you can't get this to work, check to make sure you don't have any other software running that would use the MIDI devices and try restarting this utility.\n");
+      //exit(-1); 
+      if( !gPlayOnly )
+      {
+        (void)_getch();
+      }
     }
   }
 
+  /* Parse MIDI file */
+  if( -1 == parseMIDIFile( inFileName, &format, &numTracks ) )
+  {
+    CleanUpExit(-1);
+  }
+
+  if( -1 == setConversionDivision( &gConversion ) )
+  {
+    CleanUpExit(-1);
+  }
+
+  trimNoteData( &gConversion, format );
+
+  selectedTrack = gConversion.trackList;
 
-  selectedTrack = trackList;
+  adaptNoteData(&gConversion, true);
 
-  adaptNoteData(true);
+  /* Played as the menus would preview the file, and nothing is written. */
+  if( gPlayOnly )
+  {
+    filterNoteData( &gConversion, NULL, NULL );
+    previewTrack( 0 );
+    CleanUpExit(0);
+  }
 
   int usrInput = 0;
-  while( usrInput != 'w' && usrInput != 'W' )
+  while( gAbcFd == -1 && usrInput != 'w' && usrInput != 'W' )
   {
     usrInput = 0;
 
@@ -3217,7 +2357,7 @@ int _tmain(int argc, _TCHAR* argv[])
         selectedTrack = (trackListItemType *)selectedTrack->next;
       }
 
-      if( selectedTrack == NULL ) { selectedTrack = trackList; }
+      if( selectedTrack == NULL ) { selectedTrack = gConversion.trackList; }
     }
     else if( usrInput == 'm' || usrInput == 'M' )
     {
@@ -3225,7 +2365,7 @@ int _tmain(int argc, _TCHAR* argv[])
     }
     else if( usrInput == 's' || usrInput == 'S' )
     {
-      trackListItemType * t_trackItem = trackList;
+      trackListItemType * t_trackItem = gConversion.trackList;
 
       selectedTrack->active = true;
 
@@ -3239,13 +2379,27 @@ int _tmain(int argc, _TCHAR* argv[])
     }
     else if( usrInput == 'p' || usrInput == 'P' )
     {
-      filterNoteData( NULL, NULL );
-      previewTrack( selectedTrack->track );
+      filterNoteData( &gConversion, NULL, NULL );
+      if( gWavFileName != NULL )
+      {
+        (void)renderWAV( &gConversion, gWavFileName, selectedTrack->track, instList[0]->fixedLength );
+      }
+      else
+      {
+        previewTrack( selectedTrack->track );
+      }
     }
     else if( usrInput == 'f' || usrInput == 'F' )
     {
-      filterNoteData( NULL, NULL );
-      previewTrack( 0 );
+      filterNoteData( &gConversion, NULL, NULL );
+      if( gWavFileName != NULL )
+      {
+        (void)renderWAV( &gConversion, gWavFileName, 0, instList[0]->fixedLength );
+      }
+      else
+      {
+        previewTrack( 0 );
+      }
     }
     else if( usrInput == 'q' || usrInput == 'Q' )
     {
@@ -3257,7 +2411,7 @@ int _tmain(int argc, _TCHAR* argv[])
       if( selectedTrack != NULL )
       {
         /* Perform adaptation process */
-        if( -1 == adaptNoteData_Transpose( selectedTrack, instMinNote, instMaxNote ) )
+        if( -1 == adaptNoteData_Transpose( selectedTrack, gConversion.instMinNote, gConversion.instMaxNote ) )
         {
           printf("\nERROR adapting track: %d\n",selectedTrack->track);
           CleanUpExit(-1);
@@ -3271,20 +2425,99 @@ int _tmain(int argc, _TCHAR* argv[])
     }
   }
 
-  NewScreen(true);
+  if( gAbcFd == -1 )
+  {
+    NewScreen(true);
+  }
 
-  /* Filter note data */
-  unsigned int numDeleted = 0, numAdjusted = 0;
+  /* The musical grid follows the song tempo, so there is no stretch to
+     search for. The stretch is picked before any instrument is filtered so
+     that every file is written with the stretch its header gives. */
+  if( gConversion.division == 0 && gAbcFd == -1 )
+  {
+    (void)adaptNoteData_Quantize();
+  }
+
+  /* The first instrument keeps the track choices made above. The others
+     start from a copy of them, sharing the notes, and get their own fit
+     to their range. All of them are fitted and filtered at once. */
+  conversionType    forks[MAX_FANOUT_INSTRUMENTS];
+  instrumentFitType fits[MAX_FANOUT_INSTRUMENTS];
+
+  ZeroMemory( fits, sizeof( fits ) );
 
-  if( -1 == filterNoteData( &numDeleted, &numAdjusted ) )
+  fits[0].conv = &gConversion;
+
+  for( unsigned int inst = 1; inst < numInstruments; inst++ )
   {
-    CleanUpExit(-1);
+    forkConversion( &gConversion, &forks[inst] );
+    forks[inst].instMinNote = instList[inst]->minNote;
+    forks[inst].instMaxNote = instList[inst]->maxNote;
+
+    fits[inst].conv = &forks[inst];
+    fits[inst].refit = true;
   }
 
-  printf("\nNotes removed: %d, notes adjusted: %d\n",numDeleted,numAdjusted);
+  fitInstruments( fits, numInstruments );
+
+  /* Tunes streamed to one file are numbered on from one instrument to the
+     next. */
+  unsigned int xNumber = 1;
 
-  (void)adaptNoteData_Quantize();
+  for( unsigned int inst = 0; inst < numInstruments; inst++ )
+  {
+    conversionType * conv = fits[inst].conv;
+
+    if( inst > 0 )
+    {
+      printf("\n[%s]", instNames[inst]);
+    }
+
+    if( -1 == fits[inst].retval )
+    {
+      CleanUpExit(-1);
+    }
+
+    printf("\nNotes removed: %d, notes adjusted: %d\n",fits[inst].numDeleted,fits[inst].numAdjusted);
+
+    /* Tunes streamed one after another need a blank line between them. */
+    if( gAbcFd != -1 && inst > 0 )
+    {
+      (void)_write( gAbcFd, "\r\n\r\n", 4 );
+    }
+
+    /* Write ABC file */
+    if( gWriteParts )
+    {
+      retval = writeABCParts( conv, inFileName, instNames[inst], gAbcFd, &xNumber );
+    }
+    else if( gAbcFd != -1 )
+    {
+      retval = writeABCStream( conv, gAbcFd, xNumber++, inFileName, instNames[inst] );
+    }
+    else
+    {
+      retval = writeABCFile( conv, inFileName, instNames[inst] );
+    }
+
+    if( -1 == retval )
+    {
+      CleanUpExit(-1);
+    }
 
+    /* Without the menus, the first instrument is rendered as it was
+       written. */
+    if( gWavFileName != NULL && gAbcFd != -1 && inst == 0
+        && -1 == renderWAV( conv, gWavFileName, 0, instList[0]->fixedLength ) )
+    {
+      CleanUpExit(-1);
+    }
+  }
+
+  for( unsigned int inst = 1; inst < numInstruments; inst++ )
+  {
+    resetForkedConversion( &forks[inst] );
+  }
 
 #if 0
   {
@@ -3292,7 +2525,7 @@ int _tmain(int argc, _TCHAR* argv[])
 
     fprintf(tstptr,"track,channel,note,startTick,endTick,duration\n");
 
-    noteListItemType * noteItem = noteList;
+    noteListItemType * noteItem = gConversion.noteList;
     while( noteItem != NULL )
     {
       fprintf(tstptr,"%d,%d,%d,%d,%d,%d\n",
@@ -3309,10 +2542,9 @@ int _tmain(int argc, _TCHAR* argv[])
   }
 #endif
 
-  /* Write ABC file */
-  if( -1 == writeABCFile( argv[2], argv[1] ) )
+  if( gAbcFd != -1 )
   {
-    CleanUpExit(-1);
+    _close( gAbcFd );
   }
 
   return 0;
@@ -0,0 +1,4268 @@
+
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include <math.h>
+#include "MIDI2ABCCore.h"
+#include "MIDI2ABC.h"
+
+
+/****************************************************************************\
+                                DEBUG CODE
+\****************************************************************************/
+#ifdef _DEBUG
+/* TRACE output: the debugger's output window on Windows, stderr
+   elsewhere. */
+void DebugMsg(const char * const format, ...)
+{
+  va_list args;
+
+  va_start( args, format );
+#ifdef _WIN32
+  char i[255];
+
+  _vsnprintf_s( i, sizeof( i ), _TRUNCATE, format, args );
+  OutputDebugStringA( i );
+#else
+  vfprintf( stderr, format, args );
+#endif
+  va_end( args );
+}
+#endif
+
+
+/****************************************************************************\
+                             TYPE DEFINITIONS
+\****************************************************************************/
+#pragma pack(1)
+typedef struct {
+  char           ID[4];
+  unsigned int   length;   // 32 bits on every platform
+} midiChunkHdrType;
+
+typedef struct {
+    midiChunkHdrType  hdr;
+   /* Here are the 6 bytes */
+   unsigned short     format;
+   unsigned short     numTracks;
+   unsigned short     ppqn;
+} midiChunkMThdType;
+#pragma pack()
+
+
+typedef struct
+{
+  unsigned long tick;     // milliseconds from file start
+  unsigned long pulse;    // MIDI ticks (PPQN) from file start
+  char          name[MAX_STRING_SIZE];
+  char          instrument[MAX_STRING_SIZE];
+  unsigned int  track;
+  unsigned int  program;
+} trackStatusType;
+
+typedef struct
+{
+  unsigned char on;
+  unsigned long startTick;// milliseconds from file start
+  unsigned long startPulse;// MIDI ticks (PPQN) from file start
+  unsigned char program;
+} noteStatusType;
+
+
+/* A stretch of a tune formatted on its own, starting from the emitter state
+   a single pass would have reached there. */
+typedef struct
+{
+  abcEmitterType      em;
+  abcBufferType       buf;
+  noteListItemType ** notes;
+  unsigned int        first;
+  unsigned int        numNotes;
+} abcSegmentType;
+
+/* Longest run of bars that is looked for as a repeat. This bounds the
+   repeat search to a fixed amount of work per bar. */
+#define MAX_REPEAT_BARS 64
+
+/* Tunes with fewer notes per core than this are formatted in one pass. */
+#define MIN_SEGMENT_NOTES 4096
+#define MAX_SEGMENTS      64
+
+typedef struct
+{
+  unsigned char      currentProgram;
+  noteStatusType     noteStatus[MAX_NOTES];
+} channelStatusType;
+
+typedef struct
+{
+  unsigned char     lastStatus;
+  unsigned int      ppqn;
+  unsigned int      numTracks;
+  unsigned long     format;
+  unsigned char     currentTrack;
+  unsigned long     currentTempo;
+  bool              tempoSet;
+  conversionType  * conv;
+
+  trackStatusType   trackStatus[MAX_TRACKS];
+  channelStatusType channelStatus[MAX_CHANNELS];
+} fileStatusType;
+
+/* A thread formatting part of the output. */
+typedef struct
+{
+  void   (* entry)(void * param);
+  void    * param;
+#ifdef _WIN32
+  HANDLE    handle;
+#else
+  pthread_t thread;
+#endif
+} workerThreadType;
+
+/****************************************************************************\
+                     VARIABLE AND MACRO DECLARATIONS
+\****************************************************************************/
+const instrumentType instruments[] =
+{
+  { "lute",     LUTE_NOTE_MIN,     LUTE_NOTE_MAX,     true  },
+  { "harp",     HARP_NOTE_MIN,     HARP_NOTE_MAX,     false },
+  { "theorbo",  THEORBO_NOTE_MIN,  THEORBO_NOTE_MAX,  true  },
+  { "horn",     HORN_NOTE_MIN,     HORN_NOTE_MAX,     false },
+  { "flute",    FLUTE_NOTE_MIN,    FLUTE_NOTE_MAX,    false },
+  { "bagpipes", BAGPIPES_NOTE_MIN, BAGPIPES_NOTE_MAX, false },
+  { "clarinet", CLARINET_NOTE_MIN, CLARINET_NOTE_MAX, false },
+};
+
+#define NUM_INSTRUMENTS (sizeof(instruments) / sizeof(instruments[0]))
+
+
+/****************************************************************************\
+
+                F U N C T I O N   D E F I N I T I O N S
+
+\****************************************************************************/
+
+/*
+** FUNCTION reportMessage
+**
+** DESCRIPTION
+**   printf for progress and errors. Goes through the conversion's report
+**   function, and nowhere if that is NULL.
+**
+*****************************************************************************/
+void reportMessage(const conversionType * conv, const char * format, ...)
+{
+  if( conv->report != NULL )
+  {
+    va_list args;
+
+    va_start( args, format );
+    (void)conv->report( format, args );
+    va_end( args );
+  }
+}
+
+/*
+** FUNCTION workerThreadMain
+**
+** DESCRIPTION
+**   Entry point that runs a workerThreadType on its own thread.
+**
+*****************************************************************************/
+#ifdef _WIN32
+DWORD WINAPI workerThreadMain(LPVOID param)
+{
+  workerThreadType * worker = (workerThreadType *)param;
+
+  worker->entry( worker->param );
+  return 0;
+}
+#else
+void * workerThreadMain(void * param)
+{
+  workerThreadType * worker = (workerThreadType *)param;
+
+  worker->entry( worker->param );
+  return NULL;
+}
+#endif
+
+/*
+** FUNCTION startWorkerThread
+**
+** DESCRIPTION
+**   Runs entry(param) on a new thread. When no thread can be had it runs
+**   it here instead, so it has always run or is running on return. Every
+**   call is matched by a joinWorkerThread.
+**
+*****************************************************************************/
+void startWorkerThread(workerThreadType * worker, void (* entry)(void * param), void * param)
+{
+  worker->entry = entry;
+  worker->param = param;
+
+#ifdef _WIN32
+  worker->handle = CreateThread( NULL, 0, workerThreadMain, worker, 0, NULL );
+
+  if( worker->handle == NULL )
+  {
+    entry( param );
+  }
+#else
+  if( 0 != pthread_create( &worker->thread, NULL, workerThreadMain, worker ) )
+  {
+    worker->entry = NULL;
+    entry( param );
+  }
+#endif
+}
+
+/*
+** FUNCTION joinWorkerThread
+**
+** DESCRIPTION
+**   Waits for a thread started by startWorkerThread to finish.
+**
+*****************************************************************************/
+void joinWorkerThread(workerThreadType * worker)
+{
+#ifdef _WIN32
+  if( worker->handle != NULL )
+  {
+    WaitForSingleObject( worker->handle, INFINITE );
+    CloseHandle( worker->handle );
+  }
+#else
+  if( worker->entry != NULL )
+  {
+    (void)pthread_join( worker->thread, NULL );
+  }
+#endif
+}
+
+/*
+** FUNCTION numProcessors
+**
+** DESCRIPTION
+**   Number of processors the formatting may spread over.
+**
+*****************************************************************************/
+unsigned int numProcessors()
+{
+#ifdef _WIN32
+  SYSTEM_INFO sysInfo;
+
+  GetSystemInfo( &sysInfo );
+  return sysInfo.dwNumberOfProcessors;
+#else
+  long count = sysconf( _SC_NPROCESSORS_ONLN );
+
+  return ( count > 0 ) ? (unsigned int)count : 1;
+#endif
+}
+
+/*
+** FUNCTION ResetTrackList
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+void ResetTrackList(trackListItemType * &thisTrackList)
+{
+  trackListItemType * trackItem = thisTrackList;
+
+  while( trackItem != NULL )
+  {
+    trackListItemType * nextTrackItem = (trackListItemType *)trackItem->next;
+    if( trackItem->name != NULL )
+    {
+      delete [] trackItem->name;
+    }
+    if( trackItem->instrument != NULL )
+    {
+      delete [] trackItem->instrument;
+    }
+    delete trackItem;
+    trackItem = nextTrackItem;
+  }
+
+  thisTrackList = NULL;
+}
+
+/*
+** FUNCTION ResetTrackList
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+unsigned int CountNotes(
+  noteListItemType * &thisNoteList,
+  unsigned int track
+  )
+{
+  unsigned int count = 0;
+  noteListItemType * noteItem = thisNoteList;
+
+  while( noteItem != NULL )
+  {
+    if( noteItem->track == track )
+    {
+      count++;
+    }
+    noteItem = (noteListItemType *)noteItem->next;
+  }
+
+  return count;
+}
+
+/*
+** FUNCTION DeleteTrack
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+trackListItemType * DeleteTrack(
+  trackListItemType * &thisTrackList,
+  trackListItemType * delme
+  )
+{
+  trackListItemType * trackItem = thisTrackList;
+  trackListItemType * nextTrackItem = NULL;
+  bool reassignLead = false;
+
+  while( trackItem != NULL )
+  {
+    nextTrackItem = (trackListItemType *)trackItem->next;
+    if( trackItem == delme )
+    {
+      if( trackItem->lead )
+      {
+        reassignLead = true;
+      }
+
+      if( thisTrackList == trackItem )
+      {
+        thisTrackList = nextTrackItem;
+      }
+      if( trackItem->prev != NULL )
+      {
+        ((trackListItemType *)trackItem->prev)->next = (void *)nextTrackItem;
+      }
+      if( nextTrackItem != NULL )
+      {
+        nextTrackItem->prev = trackItem->prev;
+      }
+
+
+      if( trackItem->name != NULL )
+      {
+        delete [] trackItem->name;
+      }
+      if( trackItem->instrument != NULL )
+      {
+        delete [] trackItem->instrument;
+      }
+      delete trackItem;
+      break;
+    }
+    trackItem = nextTrackItem;
+  }
+
+  if( reassignLead )
+  {
+    if( thisTrackList != NULL )
+    {
+      thisTrackList->lead = true;
+    }
+  }
+  
+  return nextTrackItem;
+}
+
+/*
+** FUNCTION GetTrack
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+trackListItemType * GetTrack(
+  trackListItemType * &thisTrackList,
+  unsigned int track
+  )
+{
+  trackListItemType * retval = NULL;
+  trackListItemType * trackItem = thisTrackList;
+
+  while( trackItem != NULL )
+  {
+    if( trackItem->track == track )
+    {
+      retval = trackItem;
+      break;
+    }
+    trackItem = (trackListItemType *)trackItem->next;
+  }
+
+  return retval;
+}
+
+/*
+** FUNCTION AddTrack
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+void AddTrack(
+  trackListItemType * &thisTrackList,
+  trackListItemType * cpyTrack,
+  unsigned int track,
+  unsigned int program,
+  char       * name,
+  char       * instrument
+  )
+{
+  trackListItemType * trackItem = new trackListItemType;
+  trackListItemType * trackItemHead = thisTrackList;
+
+  if( cpyTrack == NULL )
+  {
+    ZeroMemory( trackItem, sizeof( trackListItemType ) );
+
+    trackItem->active = true;
+
+    if( thisTrackList == NULL )
+    {
+      trackItem->lead = true;
+    }
+    else
+    {
+      trackItem->lead = false;
+    }
+    trackItem->transpose = 0;
+    trackItem->track = track;
+    trackItem->flip_oor = true;
+    trackItem->transpose_autoselect = true;
+    trackItem->program = program;
+  
+    unsigned int name_sz = (unsigned int)strlen(name);
+    unsigned int inst_sz = (unsigned int)strlen(instrument);
+
+    trackItem->name = new char[name_sz+1];
+    trackItem->instrument = new char[inst_sz+1];
+
+    strcpy_s(trackItem->name, name_sz + 1, name);
+    strcpy_s(trackItem->instrument, inst_sz + 1, instrument);
+  }
+  else
+  {
+    memcpy( trackItem, cpyTrack, sizeof( trackListItemType ) );
+
+    trackItem->next = NULL;
+    trackItem->prev = NULL;
+
+    unsigned int name_sz = (unsigned int)strlen(cpyTrack->name);
+    unsigned int inst_sz = (unsigned int)strlen(cpyTrack->instrument);
+
+    trackItem->name = new char[name_sz+1];
+    trackItem->instrument = new char[inst_sz+1];
+
+    strcpy_s(trackItem->name, name_sz + 1, cpyTrack->name);
+    strcpy_s(trackItem->instrument, inst_sz + 1, cpyTrack->instrument);
+    /* TODO: do lead */
+  }
+
+  if( thisTrackList == NULL )
+  {
+    thisTrackList = trackItem;
+  }
+  else
+  {
+    while( trackItemHead->next != NULL )
+    {
+      trackItemHead = (trackListItemType *)trackItemHead->next;
+    }
+
+    trackItem->prev = (void *)trackItemHead;
+    trackItemHead->next = (void *)trackItem;
+  }
+}
+
+
+/*
+** FUNCTION ResetNoteList
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+void ResetNoteList(noteListItemType * &thisNoteList)
+{
+  noteListItemType * noteItem = thisNoteList;
+
+  while( noteItem != NULL )
+  {
+    noteListItemType * nextNoteItem = (noteListItemType *)noteItem->next;
+    delete noteItem;
+    noteItem = nextNoteItem;
+  }
+
+  thisNoteList = NULL;
+}
+
+/*
+** FUNCTION DeleteNote
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+noteListItemType * DeleteNote(
+  noteListItemType * &thisNoteList,
+  noteListItemType * delme
+  )
+{
+  noteListItemType * noteItem = thisNoteList;
+  noteListItemType * nextNoteItem = NULL;
+
+  while( noteItem != NULL )
+  {
+    nextNoteItem = (noteListItemType *)noteItem->next;
+    if( noteItem == delme )
+    {
+      if( thisNoteList == noteItem )
+      {
+        thisNoteList = nextNoteItem;
+      }
+      if( noteItem->prev != NULL )
+      {
+        ((noteListItemType *)noteItem->prev)->next = (void *)nextNoteItem;
+      }
+      if( nextNoteItem != NULL )
+      {
+        nextNoteItem->prev = noteItem->prev;
+      }
+
+      delete noteItem;
+      break;
+    }
+    noteItem = nextNoteItem;
+  }
+
+  return nextNoteItem;
+}
+
+/*
+** FUNCTION SortNoteListByNote
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+void SortNoteListByNote(noteListItemType * &thisNoteList)
+{
+  int setChanged = 1;
+
+  while( setChanged > 0 )
+  {
+    noteListItemType * noteItem = thisNoteList;
+
+    setChanged = 0;
+
+    while( noteItem != NULL && noteItem->next != NULL )
+    {
+      if( noteItem->note > ((noteListItemType *)(noteItem->next))->note )
+      {
+        noteListItemType * nextNoteItem = (noteListItemType *)noteItem->next;
+        setChanged = 1;
+
+        if( thisNoteList == noteItem )
+        {
+          thisNoteList = nextNoteItem;
+        }
+        if( noteItem->prev != NULL )
+        {
+          ((noteListItemType *)noteItem->prev)->next = (void *)nextNoteItem;
+        }
+        if( nextNoteItem->next != NULL )
+        {
+          ((noteListItemType *)nextNoteItem->next)->prev = (void *)noteItem;
+        }
+
+        nextNoteItem->prev = (noteListItemType *)noteItem->prev;
+        noteItem->next = (noteListItemType *)nextNoteItem->next;
+        nextNoteItem->next = (void *)noteItem;
+        noteItem->prev = (void *)nextNoteItem;
+      }
+      else
+      {
+        noteItem = (noteListItemType *)noteItem->next;
+      }
+    }
+  }
+}
+
+/*
+** FUNCTION SortNoteListByStart
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+void SortNoteListByStart(noteListItemType * &thisNoteList)
+{
+  int setChanged = 1;
+
+  while( setChanged > 0 )
+  {
+    noteListItemType * noteItem = thisNoteList;
+
+    setChanged = 0;
+
+    while( noteItem != NULL && noteItem->next != NULL )
+    {
+      if( noteItem->startTick > ((noteListItemType *)(noteItem->next))->startTick )
+      {
+        noteListItemType * nextNoteItem = (noteListItemType *)noteItem->next;
+        setChanged = 1;
+
+        if( thisNoteList == noteItem )
+        {
+          thisNoteList = nextNoteItem;
+        }
+        if( noteItem->prev != NULL )
+        {
+          ((noteListItemType *)noteItem->prev)->next = (void *)nextNoteItem;
+        }
+        if( nextNoteItem->next != NULL )
+        {
+          ((noteListItemType *)nextNoteItem->next)->prev = (void *)noteItem;
+        }
+
+        nextNoteItem->prev = (noteListItemType *)noteItem->prev;
+        noteItem->next = (noteListItemType *)nextNoteItem->next;
+        nextNoteItem->next = (void *)noteItem;
+        noteItem->prev = (void *)nextNoteItem;
+      }
+      else
+      {
+        noteItem = (noteListItemType *)noteItem->next;
+      }
+    }
+  }
+}
+
+/*
+** FUNCTION AddNote
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+noteListItemType * AddNote(
+  noteListItemType * &thisNoteList,
+  unsigned char       note,
+  unsigned long       startTick,
+  unsigned long       endTick,
+  unsigned long       startPulse,
+  unsigned long       endPulse,
+  unsigned char       program,
+  unsigned char       channel,
+  unsigned char       track
+  )
+{
+  noteListItemType * noteItem = new noteListItemType;
+  noteListItemType * noteItemHead = thisNoteList;
+
+  ZeroMemory( noteItem, sizeof( noteListItemType ) );
+
+  noteItem->note = note;
+  noteItem->startTick = startTick;
+  noteItem->endTick = endTick;
+  noteItem->startPulse = startPulse;
+  noteItem->endPulse = endPulse;
+  noteItem->program = program;
+  noteItem->channel = channel;
+  noteItem->track = track;
+
+  if( thisNoteList == NULL )
+  {
+    thisNoteList = noteItem;
+  }
+  else
+  {
+    while( noteItemHead->next != NULL )
+    {
+      noteItemHead = (noteListItemType *)noteItemHead->next;
+    }
+
+    noteItem->prev = (void *)noteItemHead;
+    noteItemHead->next = (void *)noteItem;
+  }
+
+  return noteItem;
+}
+
+
+/*
+** FUNCTION reorder
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+
+#define reorderFunc(type, tptr, size) \
+do {\
+  type *ptr = (type *)(tptr);\
+  type *end = (type *)(((char *)(ptr)) + (size) - sizeof(type)); \
+\
+  while( end > (ptr) )\
+  {\
+    type v = *(ptr);\
+    \
+    *(ptr) = *end;\
+    *end = v;\
+\
+    (ptr)++; end--;\
+  }\
+} while(0)
+
+
+
+#define reorder1(ptr,size) reorderFunc(unsigned char, ptr, (unsigned int)size)
+#define reorder2(ptr,size) reorderFunc(unsigned short, ptr, (unsigned int)size)
+
+
+#if 0
+#define WORD_WIDTH unsigned char
+#define reorder(ptr,size) reorderFunc((WORD_WIDTH *)ptr,(unsigned int)size)
+void reorderFunc( WORD_WIDTH* ptr, unsigned int size )
+{
+  WORD_WIDTH *end = (WORD_WIDTH *)(((char *)ptr) + size - sizeof(WORD_WIDTH));
+
+  while( end > ptr )
+  {
+    WORD_WIDTH v = *ptr;
+    
+    *ptr = *end;
+    *end = v;
+
+    ptr++; end--;
+  }
+
+  return;
+}
+#endif
+
+/* A MIDI variable-length quantity holds at most 28 bits in four bytes. */
+#define MAX_VARLEN_BYTES 4
+
+/*
+** FUNCTION readVarLen
+**
+** DESCRIPTION
+**   Reads a variable-length quantity and adds it to val. Returns the bytes
+**   it took, or 0 when the quantity runs past bytesRemaining or past
+**   MAX_VARLEN_BYTES.
+**
+*****************************************************************************/
+unsigned long readVarLen(const unsigned char * data, unsigned long bytesRemaining, unsigned long * val)
+{
+  unsigned long bytesConsumed = 0;
+  unsigned long value = 0;
+
+  if( data != NULL && val != NULL )
+  {
+    while( bytesConsumed < MAX_VARLEN_BYTES
+          && bytesConsumed < bytesRemaining )
+    {
+      value = (value << 7) | ( data[bytesConsumed] & 0x7f );
+      bytesConsumed++;
+
+      if( 0 == (data[bytesConsumed - 1] & 0x80) )
+      {
+        *val += value;
+
+        return bytesConsumed;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+** FUNCTION channelEventDataBytes
+**
+** DESCRIPTION
+**   Number of data bytes after a channel event's status byte.
+**
+*****************************************************************************/
+unsigned long channelEventDataBytes(unsigned char status)
+{
+  if( (status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0 )
+  {
+    return 1;
+  }
+
+  return 2;
+}
+
+/*
+** FUNCTION parseChannelEvent
+**
+** DESCRIPTION
+**   Returns the bytes the event took, or 0 when its data bytes run past
+**   bytesRemaining or are not data bytes.
+**
+*****************************************************************************/
+unsigned long parseChannelEvent(const unsigned char * data, unsigned long bytesRemaining, fileStatusType * fileStatus)
+{
+  unsigned long bytesConsumed = 0;
+  unsigned long dataBytes = 0;
+  unsigned char thisMsgType = 0;
+  unsigned char channel = 0;
+
+  if( fileStatus->lastStatus != 0 )
+  {
+    thisMsgType = fileStatus->lastStatus;
+  }
+  else if( bytesRemaining > 0 )
+  {
+    thisMsgType = *data;
+    data++; bytesRemaining--; bytesConsumed++;
+  }
+  else
+  {
+    return 0;
+  }
+
+  dataBytes = channelEventDataBytes( thisMsgType );
+
+  if( bytesRemaining < dataBytes
+      || ( data[0] & 0x80 ) != 0
+      || ( dataBytes > 1 && ( data[1] & 0x80 ) != 0 ) )
+  {
+    fileStatus->lastStatus = 0;
+    return 0;
+  }
+
+  channel = thisMsgType & 0x0F;
+  fileStatus->lastStatus = thisMsgType;
+
+  if( (thisMsgType & 0xF0) == 0x80 )
+  {
+    TRACEH("[%d ms] Note OFF event at 0x%x: channel=%d, key=%d\n",
+      fileStatus->trackStatus[fileStatus->currentTrack].tick,
+      (unsigned int)data,
+      channel,
+      *data,
+      0
+      );
+    /* note off */
+    if( fileStatus->channelStatus[channel].noteStatus[data[0]].on != 0 )
+    {
+      (void)AddNote(
+        fileStatus->conv->noteList,
+        data[0],
+        fileStatus->channelStatus[channel].noteStatus[data[0]].startTick,
+        fileStatus->trackStatus[fileStatus->currentTrack].tick,
+        fileStatus->channelStatus[channel].noteStatus[data[0]].startPulse,
+        fileStatus->trackStatus[fileStatus->currentTrack].pulse,
+        fileStatus->channelStatus[channel].noteStatus[data[0]].program,
+        channel,
+        fileStatus->currentTrack
+        );
+
+      fileStatus->channelStatus[channel].noteStatus[data[0]].on = 0;
+      fileStatus->channelStatus[channel].noteStatus[data[0]].startTick = 0;
+    }
+    bytesConsumed += 2;
+  }
+  /* MIDI NoteOn Event */
+  else if( (thisMsgType & 0xF0) == 0x90 )
+  {
+    
+    TRACEH("[%d ms] Note ON event at 0x%x: channel=%d, key=%d, velocity=%d\n",
+      fileStatus->trackStatus[fileStatus->currentTrack].tick,
+      data,
+      channel,
+      *data,
+      data[1]
+      ); 
+    if( data[1] != 0 )
+    {
+#ifdef _DEBUG
+      if( fileStatus->trackStatus[fileStatus->currentTrack].tick > fileStatus->conv->lastNoteOnTick )
+      {
+        fileStatus->conv->lastNoteOnTick =
+          fileStatus->trackStatus[fileStatus->currentTrack].tick;
+      }
+#endif
+      /* note on */
+      fileStatus->channelStatus[channel].noteStatus[data[0]].on = 1;
+      fileStatus->channelStatus[channel].noteStatus[data[0]].program =
+        fileStatus->channelStatus[channel].currentProgram;
+      if( fileStatus->channelStatus[channel].noteStatus[data[0]].startTick == 0 )
+      {
+        fileStatus->channelStatus[channel].noteStatus[data[0]].startTick = 
+          fileStatus->trackStatus[fileStatus->currentTrack].tick;
+        fileStatus->channelStatus[channel].noteStatus[data[0]].startPulse = 
+          fileStatus->trackStatus[fileStatus->currentTrack].pulse;
+      }
+    }
+    else
+    {
+      /* note off */
+      if( fileStatus->channelStatus[channel].noteStatus[data[0]].on != 0 )
+      {
+        (void)AddNote(
+          fileStatus->conv->noteList,
+          data[0],
+          fileStatus->channelStatus[channel].noteStatus[data[0]].startTick,
+          fileStatus->trackStatus[fileStatus->currentTrack].tick,
+          fileStatus->channelStatus[channel].noteStatus[data[0]].startPulse,
+          fileStatus->trackStatus[fileStatus->currentTrack].pulse,
+          fileStatus->channelStatus[channel].noteStatus[data[0]].program,
+          channel,
+          fileStatus->currentTrack
+          );
+
+        fileStatus->channelStatus[channel].noteStatus[data[0]].on = 0;
+        fileStatus->channelStatus[channel].noteStatus[data[0]].startTick = 0;
+      }
+    }
+    bytesConsumed += 2;
+  }
+  /* MIDI Polyphonic Key Pressure Event */
+  else if( (thisMsgType & 0xF0) == 0xA0 )
+  {
+    TRACE("[%lu ms] Polyphonic Aftertouch event at %p, skipping\n",
+      fileStatus->trackStatus[fileStatus->currentTrack].tick,
+      (const void *)data);
+    bytesConsumed += 2;
+  }
+  /* MIDI Controller Event */
+  else if( (thisMsgType & 0xF0) == 0xB0 )
+  {
+    TRACE("[%lu ms] Controller event at %p, controller=0x%x = 0x%x, skipping\n",
+      fileStatus->trackStatus[fileStatus->currentTrack].tick,
+      (const void *)data,*data,data[1]);
+    bytesConsumed += 2;
+  }
+  /* MIDI Program Change Event */
+  else if( (thisMsgType & 0xF0) == 0xC0 )
+  {
+    TRACE("[%lu ms] Program Change event at %p: channel=%d, program=%d\n",
+      fileStatus->trackStatus[fileStatus->currentTrack].tick,
+      (const void *)data,channel,*data);
+    fileStatus->trackStatus[fileStatus->currentTrack].program = *data;
+    fileStatus->channelStatus[channel].currentProgram = *data;
+    bytesConsumed += 1;
+  }
+  /* MIDI Channel Key Pressure Event */
+  else if( (thisMsgType & 0xF0) == 0xD0 )
+  {
+    TRACE("[%lu ms] Channel Aftertouch event at %p, skipping\n",
+      fileStatus->trackStatus[fileStatus->currentTrack].tick,
+      (const void *)data);
+    bytesConsumed += 1;
+  }
+  /* MIDI Pitch Bend Event */
+  else if( (thisMsgType & 0xF0) == 0xE0 )
+  {
+    TRACE("[%lu ms] Pitch Bend event at %p, skipping\n",
+      fileStatus->trackStatus[fileStatus->currentTrack].tick,
+      (const void *)data);
+    bytesConsumed += 2;
+  }
+  else
+  {
+    TRACE("[%lu ms] Bad event: 0x%x\n",
+      fileStatus->trackStatus[fileStatus->currentTrack].tick,
+      thisMsgType);
+
+    fileStatus->lastStatus = 0;
+  }
+
+  return bytesConsumed;
+}
+
+/*
+** FUNCTION parseEvent
+**
+** DESCRIPTION
+**   Returns the bytes the event took, or 0 when any part of it runs past
+**   bytesRemaining.
+**
+*****************************************************************************/
+unsigned long parseEvent(const unsigned char * data, unsigned long bytesRemaining, fileStatusType * fileStatus)
+{
+  unsigned long deltaTime = 0;
+  unsigned long bytesConsumed = 0, tbC = 0;
+
+  tbC = readVarLen( data, bytesRemaining, &deltaTime );
+
+  if( tbC == 0 || tbC == bytesRemaining )
+  {
+    TRACE("Error reading deltaTime at %p\n",
+      (const void *)data);
+    return 0;
+  }
+
+  TRACEH("deltaTime = %d ticks",
+    deltaTime);
+
+  bytesRemaining -= tbC;
+  data += tbC;
+  bytesConsumed += tbC;
+
+  fileStatus->trackStatus[fileStatus->currentTrack].pulse += deltaTime;
+
+  deltaTime = (unsigned long)( 
+    (unsigned long)(
+      ((long double)deltaTime / (long double)fileStatus->ppqn) * (long double)fileStatus->currentTempo
+    ) / 1000
+  );
+
+  TRACEH(" = %d ms, used = %d bytes\n",
+    deltaTime,
+    tbC);
+
+  fileStatus->trackStatus[fileStatus->currentTrack].tick += deltaTime;
+
+  if( *data & 0x80 )
+  {
+    fileStatus->lastStatus = 0;
+
+    /* Sysex Event */
+    if( *data == 0xF0 || *data == 0xF7 )
+    {
+      unsigned long val = 0;
+      TRACE("[%lu ms] Sysex event at %p, ",
+        fileStatus->trackStatus[fileStatus->currentTrack].tick,
+        (const void *)data);
+      data++; bytesRemaining--; bytesConsumed++;
+      tbC = readVarLen( data, bytesRemaining, &val );
+      TRACE("length=%lu\n",tbC);
+
+      if( tbC == 0 || val > bytesRemaining - tbC )
+      {
+        return 0;
+      }
+
+      data += tbC + val; bytesRemaining -= tbC + val; bytesConsumed += tbC + val;
+    } 
+    /* Meta Event */
+    else if( *data == 0xFF )
+    {
+      unsigned long         val = 0;
+      const unsigned char * metaData = NULL;
+
+      if( bytesRemaining < 2 )
+      {
+        return 0;
+      }
+
+      TRACE("[%lu ms] Meta event at %p, type=0x%x\n",
+        fileStatus->trackStatus[fileStatus->currentTrack].tick,
+        (const void *)data,data[1]);
+
+      /* FF, type, then the length of what follows */
+      tbC = readVarLen( &data[2], bytesRemaining - 2, &val );
+
+      if( tbC == 0 || val > bytesRemaining - 2 - tbC )
+      {
+        return 0;
+      }
+
+      metaData = &data[2 + tbC];
+
+      if( data[1] == 0x51 && val >= 3 )
+      {
+        unsigned long tmpo = 0;
+
+        /* 24-bit big-endian microseconds per quarter note */
+        tmpo = ( (unsigned long)metaData[0] << 16 )
+             | ( (unsigned long)metaData[1] << 8 )
+             | (unsigned long)metaData[2];
+
+        TRACE("[%lu ms] Tempo change, was %0.2f bpm, now %0.2f bpm\n",
+          deltaTime,
+          (double)1 / ((double)(fileStatus->currentTempo) / (double)60000000),
+          (double)1 / ((double)(tmpo) / (double)60000000));
+        fileStatus->currentTempo = tmpo;
+
+        if( !fileStatus->tempoSet )
+        {
+          fileStatus->conv->tempo = tmpo;
+          fileStatus->tempoSet = true;
+        }
+      }
+      else if( data[1] == 0x03 )
+      { /* sequence name */
+        strncpy_s(fileStatus->trackStatus[fileStatus->currentTrack].name,(const char *)metaData,
+          ( val < MAX_STRING_SIZE - 1 ) ? val : MAX_STRING_SIZE - 1);
+      }
+      else if( data[1] == 0x04 )
+      { /* instrument name */
+        strncpy_s(fileStatus->trackStatus[fileStatus->currentTrack].instrument,(const char *)metaData,
+          ( val < MAX_STRING_SIZE - 1 ) ? val : MAX_STRING_SIZE - 1);
+      }
+
+      tbC += 2;
+      data += tbC + val; bytesRemaining -= tbC + val; bytesConsumed += tbC + val;
+    }
+    /* Channel Event */
+    else if( (*data & 0xF0) >= 0x80 
+            && (*data & 0xF0) <= 0xE0 )
+    {
+      tbC = parseChannelEvent( data, bytesRemaining, fileStatus );
+      if( tbC == 0 )
+      {
+        return 0;
+      }
+      bytesRemaining -= tbC;
+      data += tbC;
+      bytesConsumed += tbC;
+    }
+    /* Unknown Event */
+    else
+    {
+      TRACE("********* ERROR: Unknown event at %p: 0x%x\n",(const void *)data,*data);
+    }
+  }
+  else
+  {
+    if( fileStatus->lastStatus != 0 )
+    {
+      tbC = parseChannelEvent( data, bytesRemaining, fileStatus );
+      if( tbC == 0 )
+      {
+        return 0;
+      }
+      bytesRemaining -= tbC;
+      data += tbC;
+      bytesConsumed += tbC;
+    }
+    else
+    {
+      TRACE("********* ERROR: Unknown event at %p: 0x%x\n",(const void *)data,*data);
+    }
+  }
+
+  return bytesConsumed;
+}
+
+
+/*
+** FUNCTION parseTrack
+**
+** DESCRIPTION
+**   Reads the events of one track chunk. An event that does not fit in
+**   the chunk ends the track there.
+**
+*****************************************************************************/
+void parseTrack(const unsigned char * data, unsigned long bytesRemaining, fileStatusType * fileStatus)
+{
+  unsigned long bytesConsumed = 0, tbC = 0;
+
+  while( bytesRemaining > 0 )
+  {
+    tbC = parseEvent( data, bytesRemaining, fileStatus );
+    if( tbC == 0 )
+    {
+      reportMessage( fileStatus->conv, "Track %d: the last %lu bytes do not hold a complete event and are skipped.\n",
+        fileStatus->currentTrack, bytesRemaining );
+      break;
+    }
+    bytesConsumed += tbC; bytesRemaining -= tbC; data += tbC;
+  }
+
+  AddTrack(
+    fileStatus->conv->trackList,
+    NULL,
+    fileStatus->currentTrack,
+    fileStatus->trackStatus[fileStatus->currentTrack].program,
+    fileStatus->trackStatus[fileStatus->currentTrack].name,
+    fileStatus->trackStatus[fileStatus->currentTrack].instrument
+    );
+
+  fileStatus->currentTrack++;
+
+}
+
+/*
+** FUNCTION parseMIDIData
+**
+** DESCRIPTION
+**   Parses a complete MIDI file held in memory.
+**
+*****************************************************************************/
+int parseMIDIData(conversionType * conv, const unsigned char * fileData, unsigned long inFileSize, unsigned int * format, unsigned int * numTracks)
+{
+  fileStatusType    fileStatus;
+  unsigned long     fpos = 0;
+
+  ZeroMemory( &fileStatus, sizeof( fileStatusType ) );
+  fileStatus.conv = conv;
+
+  /* This is expressed in microseconds per quarter note (aka beat).
+     120 beats/minute is default, so:
+
+     1 minute / 120 qtr notes = 60000000 microseconds / 120 qtr notes 
+      = 500000 microseconds / 1 qtr note */
+  fileStatus.currentTempo = 500000;
+  fileStatus.currentTrack = 1;
+
+  /* Validate size of input file. */
+  if( inFileSize < sizeof( midiChunkMThdType ) ) 
+  {
+    reportMessage( conv, "ERROR: The input is too small. (It is not a valid MIDI file.)\n" );
+    return -1;
+  }
+
+  /*                                                                        *\
+  ============================== Read MThd Header ============================
+  \*                                                                        */
+  {
+    midiChunkMThdType MThdHeader = {};
+
+    /* Grab MThd header. */
+    memcpy( &MThdHeader, fileData, sizeof( midiChunkMThdType ) );
+
+    /* Check hdr */
+    if( 0 != strncmp( MThdHeader.hdr.ID, "MThd", 4 ) )
+    {
+      reportMessage( conv, "ERROR: Header chunk has invalid ID: %s. (It is not a valid MIDI file.)\n",
+        MThdHeader.hdr.ID ); //TODO: cap length
+      return -1;
+    }
+
+    /* Reorder bytes */
+    reorder1( &MThdHeader.hdr.length, sizeof( MThdHeader.hdr.length ) );
+    reorder1( &MThdHeader.ppqn, sizeof( MThdHeader.ppqn ) );
+    reorder1( &MThdHeader.format, sizeof( MThdHeader.format ) );
+    reorder1( &MThdHeader.numTracks, sizeof( MThdHeader.numTracks ) );
+
+    if( format != NULL )
+    {
+      *format = MThdHeader.format;
+    }
+
+    /* Check size */
+    if( MThdHeader.hdr.length != 6 )
+    {
+      reportMessage( conv, "ERROR: Header chunk has invalid size: %d. (It is not a valid MIDI file.)\n",
+        MThdHeader.hdr.length );
+      return -1;
+    }
+
+    /* Check format */
+    if( MThdHeader.format != 0 && MThdHeader.format != 1 )
+    {
+      reportMessage( conv, "ERROR: Unsupported MIDI format: %d. (It is not a MIDI file that this tool supports.)\n",
+        MThdHeader.format );
+      return -1;
+    }
+
+    /* Check PPQN */
+    if( MThdHeader.ppqn & (1 << 14) )
+    {
+      reportMessage( conv, "ERROR: PPQN SMPTE format unsupported: 0x%x. (It is not a MIDI file that this tool supports.)\n",
+        MThdHeader.ppqn );
+      return -1;
+    }
+
+    reportMessage( conv, "Number of tracks: %d\nPPQN: %d\nFormat: %d\n\n",
+      MThdHeader.numTracks, MThdHeader.ppqn, MThdHeader.format );
+
+    fileStatus.ppqn = MThdHeader.ppqn;
+    conv->ppqn = MThdHeader.ppqn;
+    fileStatus.numTracks = MThdHeader.numTracks;
+    fpos = sizeof( midiChunkMThdType );
+
+  }
+
+  /*                                                                        *\
+  ================================== Read MTrks ==============================
+  \*                                                                        */
+  while( fpos < inFileSize )
+  {
+    midiChunkHdrType  thisHeader = {};
+
+    /* A short tail leaves the rest of the header zeroed, which fails the ID
+       check below. */
+    memcpy( &thisHeader, &fileData[fpos], 
+      ( inFileSize - fpos < sizeof( thisHeader ) ) ? inFileSize - fpos : sizeof( thisHeader ) );
+
+    /* Check hdr */
+    if( 0 != strncmp( thisHeader.ID, "MTrk", 4 ) )
+    {
+      char tID[5] = { 0 };
+
+      strncpy_s(tID,thisHeader.ID,4);
+      tID[4] = 0;
+
+      reportMessage( conv, "ERROR: Track chunk has invalid ID: %s. (It is not a valid MIDI file.)\n",
+        tID );
+      return -1;
+    }
+
+    reorder1( &thisHeader.length, sizeof( thisHeader.length ) );
+    
+    /* Check size */
+    if( thisHeader.length > (inFileSize - fpos) )
+    {
+      reportMessage( conv, "ERROR: Track chunk has invalid size: %u of %lu remaining in the file. (It is not a valid MIDI file.)\n",
+        thisHeader.length, (inFileSize - fpos) );
+      return -1;
+    }
+
+    unsigned long   available = inFileSize - fpos;
+
+    available = ( available > sizeof( thisHeader ) ) ? available - sizeof( thisHeader ) : 0;
+
+    if( fileStatus.currentTrack >= MAX_TRACKS )
+    {
+      reportMessage( conv, "ERROR: More than %d tracks. (It is not a MIDI file that this tool supports.)\n",
+        MAX_TRACKS - 1 );
+      return -1;
+    }
+
+    /* A chunk may run up to a header's length past the end of the file.
+       Only what is in the file is parsed. */
+    TRACE("Track started at byte %lu\n",fpos);
+    parseTrack( &fileData[fpos + sizeof( thisHeader )],
+      ( thisHeader.length > available ) ? available : thisHeader.length,
+      &fileStatus );
+    TRACE("Track ended at byte %lu\n",fpos);
+
+    fpos += thisHeader.length + sizeof( midiChunkHdrType );
+  }
+
+  if( numTracks != NULL )
+  {
+    *numTracks = fileStatus.currentTrack;
+  }
+
+  return 0;
+}
+
+/*
+** FUNCTION transposeNote
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+unsigned char transposeNote(unsigned char note, char transpose)
+{
+  unsigned char thisNote = note;
+
+  if( (int)thisNote + (int)transpose < 0 )
+  {
+    thisNote = 0;
+  }
+  else if( (int)thisNote + (int)transpose > 127 )
+  {
+    thisNote = 127;
+  }
+  else
+  {
+    thisNote = (unsigned char)((char)thisNote + transpose);
+  }
+
+  return thisNote;
+}
+
+/*
+** FUNCTION foldNotes
+**
+** DESCRIPTION
+**   Moves every note of a pitch column into [minNote, maxNote] by whole
+**   octaves, in closed form: a note k semitones too low goes up by
+**   ceil(k / 12) octaves, and likewise down. The range must span at least
+**   an octave. Returns the number of notes that were moved.
+**
+*****************************************************************************/
+unsigned int foldNotes(
+  unsigned char * notes,
+  unsigned int    count,
+  unsigned char   minNote,
+  unsigned char   maxNote
+  )
+{
+  unsigned int numAdjusted = 0;
+  unsigned int i = 0;
+
+#ifdef HAVE_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i lo = _mm_set1_epi16(minNote);
+  const __m128i hi = _mm_set1_epi16(maxNote);
+  const __m128i eleven = _mm_set1_epi16(11);
+  const __m128i twelve = _mm_set1_epi16(12);
+  /* (x * 5462) >> 16 == x / 12 for every x this can see (x < 8195). */
+  const __m128i div12 = _mm_set1_epi16(5462);
+
+  for( ; i + 16 <= count; i += 16 )
+  {
+    __m128i packed = _mm_loadu_si128((const __m128i *)&notes[i]);
+    __m128i n[2];
+
+    n[0] = _mm_unpacklo_epi8(packed, zero);
+    n[1] = _mm_unpackhi_epi8(packed, zero);
+
+    for( int h = 0; h < 2; h++ )
+    {
+      __m128i orig = n[h];
+      __m128i below = _mm_max_epi16(_mm_sub_epi16(lo, n[h]), zero);
+      __m128i up = _mm_mulhi_epu16(_mm_add_epi16(below, eleven), div12);
+
+      n[h] = _mm_add_epi16(n[h], _mm_mullo_epi16(up, twelve));
+
+      __m128i above = _mm_max_epi16(_mm_sub_epi16(n[h], hi), zero);
+      __m128i down = _mm_mulhi_epu16(_mm_add_epi16(above, eleven), div12);
+
+      n[h] = _mm_sub_epi16(n[h], _mm_mullo_epi16(down, twelve));
+
+      /* Two mask bits per unchanged 16-bit lane. */
+      int same = _mm_movemask_epi8(_mm_cmpeq_epi16(orig, n[h]));
+      int numSame = 0;
+      while( same != 0 )
+      {
+        same &= same - 1;
+        numSame++;
+      }
+      numAdjusted += 8 - ( numSame / 2 );
+    }
+
+    _mm_storeu_si128((__m128i *)&notes[i], _mm_packus_epi16(n[0], n[1]));
+  }
+#endif
+
+  for( ; i < count; i++ )
+  {
+    int note = notes[i];
+    int below = (int)minNote - note;
+    below = ( below > 0 ) ? below : 0;
+
+    note += 12 * ( ( below + 11 ) / 12 );
+
+    int above = note - (int)maxNote;
+    above = ( above > 0 ) ? above : 0;
+
+    note -= 12 * ( ( above + 11 ) / 12 );
+
+    numAdjusted += ( note != notes[i] ) ? 1 : 0;
+    notes[i] = (unsigned char)note;
+  }
+
+  return numAdjusted;
+}
+
+/*
+** FUNCTION pitchAtRank
+**
+** DESCRIPTION
+**   The pitch at the given place, counting from 0, when the notes counted
+**   in pitchCount are put in pitch order.
+**
+*****************************************************************************/
+unsigned char pitchAtRank(const unsigned int * pitchCount, unsigned int rank)
+{
+  unsigned int pitch = 0;
+
+  while( pitch < 255 && rank >= pitchCount[pitch] )
+  {
+    rank -= pitchCount[pitch];
+    pitch++;
+  }
+
+  return (unsigned char)pitch;
+}
+
+/*
+** FUNCTION analyzeNotes
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+unsigned int analyzeNotes(
+  const conversionType * conv,
+  unsigned char instMin,
+  unsigned char instMax,
+  unsigned char track,
+           char transpose,
+
+  unsigned char * out_noteMin,
+  unsigned int  * out_numTooLow,
+  unsigned char * out_noteMax,
+  unsigned int  * out_numTooHigh,
+           char * out_rmsAdjust,
+           char * out_medianAdjust,
+           char * out_noteAverage
+  )
+{
+  noteListItemType * noteItem = conv->noteList;
+
+  unsigned int numNotes = 0;
+  unsigned char minNote = 127;
+  unsigned int numTooLow = 0;
+  unsigned char maxNote = 0;
+  unsigned int numTooHigh = 0;
+  unsigned int noteAverage = 0;
+  long double rmsNote = 0;
+  long double midNote = ((long double)instMin + (((long double)instMax - (long double)instMin) / (long double)2));
+
+  /* How often each untransposed pitch occurs on the track, from which the
+     median is read without putting the notes in pitch order. */
+  unsigned int pitchCount[256] = { 0 };
+
+  while( noteItem != NULL )
+  {
+    unsigned char thisNote = transposeNote(noteItem->note,transpose);
+
+    if( noteItem->track != track )
+    {
+      noteItem = (noteListItemType *)noteItem->next;
+      continue;
+    }
+
+    pitchCount[noteItem->note]++;
+
+    if( thisNote > maxNote )
+    {
+      maxNote = thisNote;
+    }
+
+    if( thisNote < minNote )
+    {
+      minNote = thisNote;
+    }
+
+    if( thisNote > instMax )
+    {
+      numTooHigh++;
+    }
+
+    if( thisNote < instMin )
+    {
+      numTooLow++;
+    }
+
+    noteAverage += thisNote;
+
+    rmsNote += (((long double)thisNote - midNote) * ((long double)thisNote - midNote));
+
+    numNotes++;
+
+    noteItem = (noteListItemType *)noteItem->next;
+  }
+
+  *out_noteMin = minNote;
+  *out_noteMax = maxNote;
+  *out_numTooLow = numTooLow;
+  *out_numTooHigh = numTooHigh;
+
+  if( numNotes > 0 )
+  {
+
+    *out_noteAverage = (char)(noteAverage / numNotes);
+
+    rmsNote /= (long double)numNotes;
+    rmsNote = (long double)instMin + sqrt( rmsNote );
+
+    *out_rmsAdjust = (char)(rmsNote - midNote);
+
+
+    if( numNotes & 1 )
+    {
+      unsigned char median = pitchAtRank(pitchCount, numNotes / 2);
+
+      //printf("Median note: %d\n",transposeNote(median,transpose));
+      *out_medianAdjust = (char)((int)transposeNote(median,transpose) - (int)midNote);
+    }
+    else
+    {
+      unsigned char A = transposeNote(pitchAtRank(pitchCount, (numNotes / 2) - 1),transpose);
+      unsigned char B = transposeNote(pitchAtRank(pitchCount, numNotes / 2),transpose);
+
+      *out_medianAdjust = (char)(
+          ( (int)A + ( ( (int)B - (int)A ) / 2 ) ) - (int)midNote
+        );
+    }
+  }
+  else
+  {
+    *out_rmsAdjust = 0;
+  }
+
+  return numNotes;
+}
+
+/*
+** FUNCTION adjustTrackTranspose
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+void adjustTrackTranspose(
+  conversionType * conv,
+  int transpose
+  )
+{
+  trackListItemType * trackItem = conv->trackList;
+
+  while( trackItem != NULL )
+  {
+    trackItem->transpose += transpose;
+
+    trackItem = (trackListItemType *)trackItem->next;
+  }
+}
+
+
+/*
+** FUNCTION adaptNoteData_AutoFit
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+int adaptNoteData_AutoFit(
+  conversionType * conv,
+  trackListItemType * trackItem,
+  unsigned char instMinNote,
+  unsigned char instMaxNote
+  )
+{
+  unsigned char minNote = 127;
+  unsigned char maxNote = 0;
+  unsigned int  numNotes = 0;
+  unsigned int  numTooLow = 0;
+  unsigned int  numTooHigh = 0;
+           char rmsAdjust = 0;
+           char medianAdjust = 0;
+           char noteAverage = 0;
+
+           int  transpose = 0;
+           int  percentTooHigh = 0;
+
+           char midNote = (instMinNote + ((instMaxNote - instMinNote) / 2));
+
+  numNotes = analyzeNotes(
+    conv, instMinNote, instMaxNote, trackItem->track, trackItem->transpose,
+    &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
+    &noteAverage
+    );
+
+  percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
+
+  if( trackItem->lead )
+  {
+    transpose = (((instMaxNote - midNote) / 2) + midNote) - noteAverage;
+
+    numNotes = analyzeNotes(
+      conv, instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
+      &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
+      &noteAverage
+      );
+
+    percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
+  }
+  else
+  {
+    while( numTooLow == 0 )
+    {
+      transpose -= 12;
+
+      numNotes = analyzeNotes(
+        conv, instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
+        &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
+        &noteAverage
+        );
+
+      percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
+    }
+
+    while( numTooLow > 0 )
+    {
+      transpose += 12;
+
+      numNotes = analyzeNotes(
+        conv, instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
+        &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
+        &noteAverage
+        );
+
+      percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
+    }
+  }
+
+  while( percentTooHigh > 10 )
+  {
+    if( !trackItem->lead )
+    {
+      transpose -= 12;
+    }
+    else
+    {
+      transpose--;
+    }
+
+
+    numNotes = analyzeNotes(
+      conv, instMinNote, instMaxNote, trackItem->track, (trackItem->transpose + transpose),
+      &minNote, &numTooLow, &maxNote, &numTooHigh, &rmsAdjust, &medianAdjust,
+      &noteAverage
+      );
+
+    percentTooHigh = (int)ceil(100*((double)numTooHigh / (double)numNotes));
+  }
+
+  if( trackItem->lead )
+  {
+    adjustTrackTranspose( conv, transpose );
+  }
+  else
+  {
+    trackItem->transpose += transpose;
+  }
+
+  return 0;
+}
+
+/*
+** FUNCTION stretchFactor
+**
+** DESCRIPTION
+**   Converts a stretch ratio into a Q32 fixed-point multiplier. It is rounded
+**   up, which makes (time * factor) >> 32 equal floor(time * num / den) for
+**   every time below 2^32 / den, so no precision is lost on real songs.
+**
+*****************************************************************************/
+unsigned long long stretchFactor(stretchType stretch)
+{
+  return ( ( (unsigned long long)stretch.num << 32 ) + stretch.den - 1 ) / stretch.den;
+}
+
+/*
+** FUNCTION stretchNote
+**
+** DESCRIPTION
+**   Scales a single time by a multiplier from stretchFactor.
+**
+*****************************************************************************/
+inline unsigned long stretchNote(unsigned long time, unsigned long long factor)
+{
+  return (unsigned long)( ( (unsigned long long)time * factor ) >> 32 );
+}
+
+/*
+** FUNCTION stretchTicks
+**
+** DESCRIPTION
+**   Scales a whole column of times in place. The loop body is a single
+**   multiply and shift with no branches so the compiler can vectorize it.
+**
+*****************************************************************************/
+void stretchTicks(unsigned long * ticks, unsigned int count, stretchType stretch)
+{
+  unsigned long long factor = stretchFactor(stretch);
+
+  for( unsigned int i = 0; i < count; i++ )
+  {
+    ticks[i] = stretchNote(ticks[i], factor);
+  }
+}
+
+/*
+** FUNCTION gridQuantizer
+**
+** DESCRIPTION
+**   Quantizer for a timing grid that is fixed at compile time, so that every
+**   % and / by the grid is strength-reduced to multiplies and shifts.
+**   delta() returns the signed distance from the nearest grid line, in the
+**   range (-GRID/2, GRID/2].
+**
+*****************************************************************************/
+template <unsigned long GRID>
+struct gridQuantizer
+{
+  static long delta(long time)
+  {
+    long d = time % (long)GRID;
+
+    if( d > ((long)GRID / 2) )
+    {
+      d -= (long)GRID;
+    }
+
+    return d;
+  }
+
+  static unsigned long units(unsigned long time)
+  {
+    return time / GRID;
+  }
+
+  static void deltas(const unsigned long * times, long * out, unsigned int count)
+  {
+    for( unsigned int i = 0; i < count; i++ )
+    {
+      out[i] = delta((long)times[i]);
+    }
+  }
+};
+
+#define QUANTIZER(ms) \
+  { ms, gridQuantizer<ms>::delta, gridQuantizer<ms>::units, gridQuantizer<ms>::deltas }
+
+/* The timing grids that can be selected from the command line. */
+const quantizerType quantizers[] =
+{
+  QUANTIZER(30),
+  QUANTIZER(40),
+  QUANTIZER(50),
+  QUANTIZER(60),
+  QUANTIZER(80),
+};
+
+#define NUM_QUANTIZERS (sizeof(quantizers) / sizeof(quantizers[0]))
+
+/*
+** FUNCTION selectQuantizer
+**
+** DESCRIPTION
+**   Returns the quantizer for the given grid in milliseconds, or NULL if
+**   there is no specialisation for it.
+**
+*****************************************************************************/
+const quantizerType * selectQuantizer(unsigned long grid)
+{
+  for( unsigned int i = 0; i < NUM_QUANTIZERS; i++ )
+  {
+    if( quantizers[i].grid == grid )
+    {
+      return &quantizers[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+** FUNCTION quantizeDelta
+**
+** DESCRIPTION
+**   Same as gridQuantizer::delta, for a unit that is only known once the
+**   file has been read (the length of a musical division in MIDI ticks).
+**
+*****************************************************************************/
+long quantizeDelta(long time, unsigned long unit)
+{
+  long d = time % (long)unit;
+
+  if( d > ((long)unit / 2) )
+  {
+    d -= (long)unit;
+  }
+
+  return d;
+}
+
+/*
+** FUNCTION pulsesToMs
+**
+** DESCRIPTION
+**   Converts MIDI ticks to milliseconds at the song tempo.
+**
+*****************************************************************************/
+unsigned long pulsesToMs(const conversionType * conv, unsigned long pulse)
+{
+  return (unsigned long)( ( (unsigned long long)pulse * conv->tempo ) / ( (unsigned long long)conv->ppqn * 1000 ) );
+}
+
+/*
+** FUNCTION analyzeTiming
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+unsigned int analyzeTiming(
+    const conversionType * conv,
+    stretchType stretch,
+
+            int * out_maxQError,
+          float * out_biasLevel,
+          float * out_errorPower
+  )
+{
+  noteListItemType * noteItem = conv->noteList;
+
+  unsigned int numNotes = 0;
+  long maxQError = 0;
+  long biasLevel = 0;
+  long errorPower = 0;
+
+  while( noteItem != NULL )
+  {
+    numNotes++;
+    noteItem = (noteListItemType *)noteItem->next;
+  }
+
+  /* Gather start and end times into one column so they can be stretched in
+     a single pass. Starts occupy the first half, ends the second. */
+  unsigned long * ticks = new unsigned long[(numNotes * 2) + 1];
+  unsigned int i = 0;
+
+  noteItem = conv->noteList;
+  while( noteItem != NULL )
+  {
+    ticks[i] = noteItem->startTick;
+    ticks[numNotes + i] = noteItem->endTick;
+    i++;
+    noteItem = (noteListItemType *)noteItem->next;
+  }
+
+  stretchTicks( ticks, numNotes * 2, stretch );
+
+  long * deltas = new long[(numNotes * 2) + 1];
+
+  conv->quantizer->deltas( ticks, deltas, numNotes * 2 );
+
+  for( i = 0; i < numNotes; i++ )
+  {
+    long thisStartDelta = deltas[i];
+    long thisEndDelta = deltas[numNotes + i];
+
+    if( abs(thisStartDelta) > maxQError )
+    {
+      maxQError = abs(thisStartDelta);
+    }
+    if( abs(thisEndDelta) > maxQError )
+    {
+      maxQError = abs(thisEndDelta);
+    }
+
+    errorPower += (thisStartDelta * thisStartDelta) + (thisEndDelta * thisEndDelta);
+    biasLevel += thisStartDelta + thisEndDelta;
+  }
+
+  delete [] deltas;
+  delete [] ticks;
+
+  *out_maxQError = (int)maxQError;
+
+  if( numNotes > 0 )
+  {
+    //*out_biasLevel = (int)(biasLevel);
+    *out_biasLevel = (float)((double)biasLevel / ((double)numNotes * (double)2));
+    *out_errorPower = (float)sqrt((double)errorPower / ((double)numNotes * (double)2));
+  }
+  else
+  {
+    *out_errorPower = 0;
+    *out_biasLevel = 0;
+  }
+
+  return numNotes;
+}
+
+
+/*
+** FUNCTION adaptNoteData
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+int adaptNoteData(conversionType * conv, bool includeLeadTrack)
+{
+  trackListItemType * trackItem = conv->trackList;
+
+  if( includeLeadTrack )
+  {
+    while( trackItem != NULL )
+    {
+      if( trackItem->lead )
+      {
+        break;
+      }
+      trackItem = (trackListItemType *)trackItem->next;
+    }
+
+    /* A file without tracks has no lead. */
+    if( trackItem != NULL )
+    {
+      adaptNoteData_AutoFit(conv,trackItem,conv->instMinNote,conv->instMaxNote);
+    }
+  }
+
+  trackItem = conv->trackList;
+
+  while( trackItem != NULL )
+  {
+    if( !trackItem->lead )
+    {
+      adaptNoteData_AutoFit(conv,trackItem,conv->instMinNote,conv->instMaxNote);
+    }
+    trackItem = (trackListItemType *)trackItem->next;
+  }
+
+  return 0;
+}
+
+/*
+** FUNCTION filterNoteData
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+int filterNoteData(conversionType * conv, unsigned int * o_NumDeleted, unsigned int * o_NumAdjusted)
+{
+  noteListItemType * noteItem;
+
+  unsigned int numDeleted = 0;
+  unsigned int numAdjusted = 0;
+  unsigned long numMsToDelete = 0;
+  unsigned long numPulsesToDelete = 0;
+  unsigned long lastOnTime[MAX_TRACKS] = { 0 };
+  unsigned long lastLeadTrackStart = 0;
+  unsigned long long stretch = stretchFactor( conv->stretch );
+
+  /* trimNoteData left the notes in start order, and they are only read
+     here, so conversions that share them can filter at the same time. */
+  ResetNoteList( conv->noteFilteredList );
+  ResetTrackList( conv->trackFilteredList );
+
+  noteItem = conv->noteList;
+
+  if( noteItem != NULL )
+  {
+    numMsToDelete = noteItem->startTick;
+
+    /* Keep whole 4/4 bars of lead-in so the musical grid stays on the
+       beat. */
+    if( conv->ppqn > 0 )
+    {
+      numPulsesToDelete = noteItem->startPulse - ( noteItem->startPulse % ( conv->ppqn * 4 ) );
+    }
+  }
+
+  trackListItemType * trackItem = conv->trackList;
+  /* delete inactive tracks */
+  while( trackItem != NULL )
+  {
+    if( trackItem->active )
+    {
+      AddTrack(
+        conv->trackFilteredList,
+        trackItem,
+        0,
+        0,
+        NULL,
+        NULL
+        );
+    }
+    
+    trackItem = (trackListItemType *)trackItem->next;
+  }
+
+  /* transpose notes */
+  while( noteItem != NULL )
+  {
+    if( noteItem->channel == 9 )
+    {
+      noteItem = (noteListItemType *)noteItem->next;
+      continue;
+    }
+
+    trackItem = GetTrack( 
+      conv->trackFilteredList,
+      noteItem->track );
+
+    if( trackItem == NULL )
+    {
+      noteItem = (noteListItemType *)noteItem->next;
+      continue;
+    }
+
+    unsigned int tnote = transposeNote(noteItem->note,trackItem->transpose);
+
+    noteListItemType * noteFilteredItem = AddNote(
+      conv->noteFilteredList,
+      tnote,
+      noteItem->startTick - numMsToDelete,
+      noteItem->endTick - numMsToDelete,
+      noteItem->startPulse - numPulsesToDelete,
+      noteItem->endPulse - numPulsesToDelete,
+      noteItem->program,
+      noteItem->channel,
+      noteItem->track
+      );
+
+    //noteItem->startTick -= numMsToDelete;
+    //noteItem->endTick -= numMsToDelete;
+
+    //noteItem->note = transposeNote(noteItem->note,trackItem->transpose);
+
+    if( trackItem->flip_oor )
+    {
+      /* Notes are quantized on the wall-clock grid in stretched
+         milliseconds or, with a musical division, in MIDI ticks. */
+      bool musical = ( conv->division != 0 );
+      unsigned long unit = musical ? conv->pulsesPerUnit : conv->quantizer->grid;
+      unsigned long noteStart = musical ? noteFilteredItem->startPulse : noteFilteredItem->startTick;
+      unsigned long diffSinceLast = noteStart - lastOnTime[noteFilteredItem->track];
+
+      if( diffSinceLast != 0
+          && diffSinceLast <= ( unit * 1 ) )
+      {
+        numDeleted++;
+        noteFilteredItem = DeleteNote( conv->noteFilteredList, noteFilteredItem );
+        noteItem = (noteListItemType *)noteItem->next;
+        continue;
+      }
+
+      lastOnTime[noteFilteredItem->track] = noteStart;
+
+      unsigned long thisStart = 0;
+      unsigned long thisEnd = 0;
+      long thisStartDelta = 0;
+
+      if( musical )
+      {
+        thisStart = noteFilteredItem->startPulse;
+        thisEnd = noteFilteredItem->endPulse;
+        thisStartDelta = quantizeDelta((long)thisStart, unit);
+      }
+      else
+      {
+        thisStart = stretchNote(noteFilteredItem->startTick,stretch);
+        thisEnd = stretchNote(noteFilteredItem->endTick,stretch);
+        thisStartDelta = conv->quantizer->delta((long)thisStart);
+      }
+
+      thisStart = thisStart - thisStartDelta;
+      thisEnd = thisEnd - thisStartDelta;
+
+      unsigned long snapStart = thisStart;
+
+
+      /* snap to lead */
+      trackListItemType * trackItem = GetTrack(
+        conv->trackFilteredList,
+        noteFilteredItem->track);
+
+      if( trackItem->lead )
+      {
+        lastLeadTrackStart = snapStart;
+      }
+      else
+      {
+        if( snapStart - lastLeadTrackStart <= (unit * 2) )
+        {
+          snapStart = lastLeadTrackStart;
+        }
+      }
+
+
+      long thisDurationDelta = musical
+        ? quantizeDelta((long)thisEnd - (long)thisStart, unit)
+        : conv->quantizer->delta((long)thisEnd - (long)thisStart);
+
+      unsigned long snapEnd = thisEnd - thisDurationDelta;
+
+      if( snapEnd <= snapStart )
+      {
+        snapEnd += unit;
+      }
+
+      if( musical )
+      {
+        noteFilteredItem->startPulse = snapStart;
+        noteFilteredItem->endPulse = snapEnd;
+        noteFilteredItem->startTick = pulsesToMs(conv, snapStart);
+        noteFilteredItem->endTick = pulsesToMs(conv, snapEnd);
+      }
+      else
+      {
+        noteFilteredItem->startTick = snapStart;
+        noteFilteredItem->endTick = snapEnd;
+      }
+    }
+    else
+    {
+      /* Filter out of range notes. */
+      if( noteFilteredItem->note < conv->instMinNote || noteFilteredItem->note > conv->instMaxNote )
+      {
+        numDeleted++;
+        noteFilteredItem = DeleteNote( conv->noteFilteredList, noteFilteredItem );
+        noteItem = (noteListItemType *)noteItem->next;
+        continue;
+      }
+    }
+
+    noteItem = (noteListItemType *)noteItem->next;
+  }
+
+  /* Flip notes back into range. Notes on tracks that don't flip have been
+     dropped above if they were out of range, so the whole list can go
+     through the kernel. */
+  {
+    unsigned int numNotes = 0;
+    unsigned int i = 0;
+
+    for( noteItem = conv->noteFilteredList; noteItem != NULL; noteItem = (noteListItemType *)noteItem->next )
+    {
+      numNotes++;
+    }
+
+    unsigned char * pitches = new unsigned char[numNotes + 1];
+
+    for( noteItem = conv->noteFilteredList; noteItem != NULL; noteItem = (noteListItemType *)noteItem->next )
+    {
+      pitches[i++] = noteItem->note;
+    }
+
+    numAdjusted = foldNotes( pitches, numNotes, conv->instMinNote, conv->instMaxNote );
+
+    i = 0;
+    for( noteItem = conv->noteFilteredList; noteItem != NULL; noteItem = (noteListItemType *)noteItem->next )
+    {
+      noteItem->note = pitches[i++];
+    }
+
+    delete [] pitches;
+  }
+
+  if( o_NumDeleted != NULL )
+  {
+    *o_NumDeleted = numDeleted;
+  }
+  if( o_NumAdjusted != NULL )
+  {
+    *o_NumAdjusted = numAdjusted;
+  }
+
+  return 0;
+}
+
+/*
+** FUNCTION fitInstrumentThread
+**
+** DESCRIPTION
+**   Thread entry for fitting and filtering one instrument. It writes only
+**   to the track and filtered lists of its own conversion.
+**
+*****************************************************************************/
+void fitInstrumentThread(void * param)
+{
+  instrumentFitType * fit = (instrumentFitType *)param;
+
+  if( fit->refit )
+  {
+    trackListItemType * trackItem = fit->conv->trackList;
+    while( trackItem != NULL )
+    {
+      trackItem->transpose = 0;
+      trackItem = (trackListItemType *)trackItem->next;
+    }
+
+    fit->retval = adaptNoteData( fit->conv, true );
+  }
+
+  if( fit->retval != -1 )
+  {
+    fit->retval = filterNoteData( fit->conv, &fit->numDeleted, &fit->numAdjusted );
+  }
+}
+
+/*
+** FUNCTION fitInstruments
+**
+** DESCRIPTION
+**   Fits and filters the notes for several instruments at once, one thread
+**   each. The conversions must not share track lists, which forkConversion
+**   sees to. Those marked refit drop the transpositions they came with and
+**   have their tracks fitted to their own range first.
+**
+*****************************************************************************/
+void fitInstruments(instrumentFitType * fits, unsigned int numFits)
+{
+  workerThreadType * threads = new workerThreadType[numFits + 1];
+
+  for( unsigned int i = 0; i < numFits; i++ )
+  {
+    fits[i].retval = 0;
+    startWorkerThread( &threads[i], fitInstrumentThread, &fits[i] );
+  }
+
+  for( unsigned int i = 0; i < numFits; i++ )
+  {
+    joinWorkerThread( &threads[i] );
+  }
+
+  delete [] threads;
+}
+
+/*
+** FUNCTION emitStart
+**
+** DESCRIPTION
+**   Where a filtered note sits on the output time line: milliseconds on the
+**   wall-clock grid, or MIDI ticks on a musical grid. Conversion to ABC
+**   units happens only here, at emit time.
+**
+*****************************************************************************/
+inline unsigned long emitStart(const conversionType * conv, noteListItemType * noteItem)
+{
+  return ( conv->division != 0 ) ? noteItem->startPulse : noteItem->startTick;
+}
+
+inline unsigned long emitEnd(const conversionType * conv, noteListItemType * noteItem)
+{
+  return ( conv->division != 0 ) ? noteItem->endPulse : noteItem->endTick;
+}
+
+/* Length of one ABC unit on the output time line. */
+inline unsigned long emitUnit(const conversionType * conv)
+{
+  return ( conv->division != 0 ) ? conv->pulsesPerUnit : conv->quantizer->grid;
+}
+
+/* Converts a span on the output time line into whole ABC units. */
+inline unsigned long emitUnits(const conversionType * conv, unsigned long span)
+{
+  return ( conv->division != 0 ) ? span / conv->pulsesPerUnit : conv->quantizer->units(span);
+}
+
+/* ABC units that are tried for a tune, as multiples of the timing grid or
+   of 1/division notes. */
+const unsigned int unitScales[] = { 1, 2, 4 };
+
+#define NUM_UNIT_SCALES (sizeof(unitScales) / sizeof(unitScales[0]))
+
+/*
+** FUNCTION abcTempoHeader
+**
+** DESCRIPTION
+**   Formats the Q: field for L: 1/unitValue units lasting unitMs
+**   milliseconds. The longest note value that gives a whole number of beats
+**   per minute is used, which yields the familiar "1/4=250" for the default
+**   60 ms grid. Returns false if the tempo had to be rounded.
+**
+*****************************************************************************/
+bool abcTempoHeader(unsigned long unitMs, unsigned int unitValue, char * tempo, unsigned int size)
+{
+  for( unsigned long value = 4; value <= unitValue; value *= 2 )
+  {
+    unsigned long beatMs = unitMs * (unitValue / value);
+
+    if( (60000 % beatMs) == 0 )
+    {
+      sprintf_s(tempo, size, "1/%lu=%lu", value, 60000 / beatMs);
+      return true;
+    }
+  }
+
+  sprintf_s(tempo, size, "1/%u=%lu", unitValue, 60000 / unitMs);
+  return false;
+}
+
+/*
+** FUNCTION abcUnitScaleFits
+**
+** DESCRIPTION
+**   Tells whether units of scale times the base unit can be written with an
+**   L: and Q: that keep the timing exactly.
+**
+*****************************************************************************/
+bool abcUnitScaleFits(const conversionType * conv, unsigned int scale)
+{
+  char tempo[MAX_STRING_SIZE] = { 0 };
+
+  if( scale == 1 )
+  {
+    return true;
+  }
+
+  if( conv->division != 0 )
+  {
+    return ( conv->division % scale ) == 0;
+  }
+
+  return abcTempoHeader(conv->quantizer->grid * scale, 16 / scale, tempo, MAX_STRING_SIZE);
+}
+
+/*
+** Pitch spellings for all 128 MIDI notes, indexed by note number. Note 48
+** is ABC "C"; each octave below adds a "," and each octave above "c" adds
+** a "'". Every note carries its accidental so that no key has to be
+** tracked.
+*/
+const noteSpellingType noteSpellings[128] =
+{
+  /*   0 */ { "=C,,,,", 6 }, { "^C,,,,", 6 }, { "=D,,,,", 6 }, { "^D,,,,", 6 }, { "=E,,,,", 6 }, { "=F,,,,", 6 }, { "^F,,,,", 6 }, { "=G,,,,", 6 }, { "^G,,,,", 6 }, { "=A,,,,", 6 }, { "^A,,,,", 6 }, { "=B,,,,", 6 },
+  /*  12 */ { "=C,,,", 5 }, { "^C,,,", 5 }, { "=D,,,", 5 }, { "^D,,,", 5 }, { "=E,,,", 5 }, { "=F,,,", 5 }, { "^F,,,", 5 }, { "=G,,,", 5 }, { "^G,,,", 5 }, { "=A,,,", 5 }, { "^A,,,", 5 }, { "=B,,,", 5 },
+  /*  24 */ { "=C,,", 4 }, { "^C,,", 4 }, { "=D,,", 4 }, { "^D,,", 4 }, { "=E,,", 4 }, { "=F,,", 4 }, { "^F,,", 4 }, { "=G,,", 4 }, { "^G,,", 4 }, { "=A,,", 4 }, { "^A,,", 4 }, { "=B,,", 4 },
+  /*  36 */ { "=C,", 3 }, { "^C,", 3 }, { "=D,", 3 }, { "^D,", 3 }, { "=E,", 3 }, { "=F,", 3 }, { "^F,", 3 }, { "=G,", 3 }, { "^G,", 3 }, { "=A,", 3 }, { "^A,", 3 }, { "=B,", 3 },
+  /*  48 */ { "=C", 2 }, { "^C", 2 }, { "=D", 2 }, { "^D", 2 }, { "=E", 2 }, { "=F", 2 }, { "^F", 2 }, { "=G", 2 }, { "^G", 2 }, { "=A", 2 }, { "^A", 2 }, { "=B", 2 },
+  /*  60 */ { "=c", 2 }, { "^c", 2 }, { "=d", 2 }, { "^d", 2 }, { "=e", 2 }, { "=f", 2 }, { "^f", 2 }, { "=g", 2 }, { "^g", 2 }, { "=a", 2 }, { "^a", 2 }, { "=b", 2 },
+  /*  72 */ { "=c'", 3 }, { "^c'", 3 }, { "=d'", 3 }, { "^d'", 3 }, { "=e'", 3 }, { "=f'", 3 }, { "^f'", 3 }, { "=g'", 3 }, { "^g'", 3 }, { "=a'", 3 }, { "^a'", 3 }, { "=b'", 3 },
+  /*  84 */ { "=c''", 4 }, { "^c''", 4 }, { "=d''", 4 }, { "^d''", 4 }, { "=e''", 4 }, { "=f''", 4 }, { "^f''", 4 }, { "=g''", 4 }, { "^g''", 4 }, { "=a''", 4 }, { "^a''", 4 }, { "=b''", 4 },
+  /*  96 */ { "=c'''", 5 }, { "^c'''", 5 }, { "=d'''", 5 }, { "^d'''", 5 }, { "=e'''", 5 }, { "=f'''", 5 }, { "^f'''", 5 }, { "=g'''", 5 }, { "^g'''", 5 }, { "=a'''", 5 }, { "^a'''", 5 }, { "=b'''", 5 },
+  /* 108 */ { "=c''''", 6 }, { "^c''''", 6 }, { "=d''''", 6 }, { "^d''''", 6 }, { "=e''''", 6 }, { "=f''''", 6 }, { "^f''''", 6 }, { "=g''''", 6 }, { "^g''''", 6 }, { "=a''''", 6 }, { "^a''''", 6 }, { "=b''''", 6 },
+  /* 120 */ { "=c'''''", 7 }, { "^c'''''", 7 }, { "=d'''''", 7 }, { "^d'''''", 7 }, { "=e'''''", 7 }, { "=f'''''", 7 }, { "^f'''''", 7 }, { "=g'''''", 7 }
+};
+
+/*
+** FUNCTION buildKey
+**
+** DESCRIPTION
+**   Fills in a major key with the given number of sharps (negative for
+**   flats) and the spelling of every MIDI pitch in it. A pitch that is in
+**   the key is spelled the way the key has it, including B#, Cb, E# and
+**   Fb. Other pitches use the natural letter if there is one, and sharps or
+**   flats according to the key otherwise.
+**
+*****************************************************************************/
+void buildKey(int sharps, abcKeyType * key)
+{
+  static const int          letterPc[NUM_LETTERS] = { 0, 2, 4, 5, 7, 9, 11 };
+  static const char         letterName[NUM_LETTERS] = { 'C', 'D', 'E', 'F', 'G', 'A', 'B' };
+  static const unsigned int sharpOrder[NUM_LETTERS] = { 3, 0, 4, 1, 5, 2, 6 }; // F C G D A E B
+  static const char * const keyNames[15] =
+  {
+    "Cb", "Gb", "Db", "Ab", "Eb", "Bb", "F",
+    "C",
+    "G", "D", "A", "E", "B", "F#", "C#"
+  };
+
+  ZeroMemory( key, sizeof( abcKeyType ) );
+
+  key->sharps = sharps;
+  key->name = keyNames[sharps + 7];
+
+  for( int i = 0; i < sharps; i++ )
+  {
+    key->alter[sharpOrder[i]] = 1;
+  }
+  for( int i = 0; i < -sharps; i++ )
+  {
+    key->alter[sharpOrder[NUM_LETTERS - 1 - i]] = -1;
+  }
+
+  for( int note = 0; note < 128; note++ )
+  {
+    int pc = note % 12;
+    int letter = -1;
+    int alt = 0;
+
+    /* In the key? */
+    for( int l = 0; l < NUM_LETTERS && letter < 0; l++ )
+    {
+      if( ( letterPc[l] + key->alter[l] + 12 ) % 12 == pc )
+      {
+        letter = l;
+        alt = key->alter[l];
+      }
+    }
+
+    /* A natural? */
+    for( int l = 0; l < NUM_LETTERS && letter < 0; l++ )
+    {
+      if( letterPc[l] == pc )
+      {
+        letter = l;
+        alt = 0;
+      }
+    }
+
+    /* A black key outside the key. */
+    for( int l = 0; l < NUM_LETTERS && letter < 0; l++ )
+    {
+      if( sharps >= 0 && letterPc[l] == pc - 1 )
+      {
+        letter = l;
+        alt = 1;
+      }
+      else if( sharps < 0 && letterPc[l] == pc + 1 )
+      {
+        letter = l;
+        alt = -1;
+      }
+    }
+
+    /* Octave of the written letter, from the C it counts up from. */
+    int octave = ( note - alt - letterPc[letter] ) / 12;
+    if( note - alt - letterPc[letter] < 0 )
+    {
+      octave = -1;
+    }
+
+    noteSpellingType * text = &key->text[note];
+
+    key->letter[note] = (unsigned char)letter;
+    key->alt[note] = (signed char)alt;
+    key->octave[note] = (unsigned char)( octave + 1 );
+
+    if( octave <= CENTER_OCTAVE )
+    {
+      text->text[text->len++] = letterName[letter];
+      for( int o = octave; o < CENTER_OCTAVE; o++ )
+      {
+        text->text[text->len++] = ',';
+      }
+    }
+    else
+    {
+      text->text[text->len++] = (char)( letterName[letter] - 'A' + 'a' );
+      for( int o = CENTER_OCTAVE + 1; o < octave; o++ )
+      {
+        text->text[text->len++] = '\'';
+      }
+    }
+  }
+}
+
+/*
+** FUNCTION selectKey
+**
+** DESCRIPTION
+**   Picks the major key whose scale leaves the fewest notes needing an
+**   accidental, given how many notes there are of each pitch class. Ties
+**   go to the key with fewer sharps or flats.
+**
+*****************************************************************************/
+void selectKey(const unsigned int * histogram, abcKeyType * key)
+{
+  unsigned int bestCost = 0;
+  int          bestSharps = 0;
+
+  /* Try C, G, F, D, Bb, ... so that ties go to the simpler key. */
+  for( int k = 0; k < 15; k++ )
+  {
+    int sharps = ( k & 1 ) ? ( k + 1 ) / 2 : -( k / 2 );
+    int tonic = ( ( sharps * 7 ) % 12 + 12 ) % 12;
+    unsigned int cost = 0;
+
+    for( int pc = 0; pc < 12; pc++ )
+    {
+      int degree = ( pc - tonic + 12 ) % 12;
+
+      /* Not on the major scale. */
+      if( degree == 1 || degree == 3 || degree == 6 || degree == 8 || degree == 10 )
+      {
+        cost += histogram[pc];
+      }
+    }
+
+    if( k == 0 || cost < bestCost )
+    {
+      bestCost = cost;
+      bestSharps = sharps;
+    }
+  }
+
+  buildKey( bestSharps, key );
+}
+
+/*
+** FUNCTION abcBufferReserve
+**
+** DESCRIPTION
+**   Makes room for at least extra more bytes in an ABC output buffer. The
+**   buffer doubles as it grows so appends are amortised O(1).
+**
+*****************************************************************************/
+void abcBufferReserve(abcBufferType * buf, unsigned long extra)
+{
+  if( buf->size + extra <= buf->capacity )
+  {
+    return;
+  }
+
+  unsigned long capacity = ( buf->capacity > 0 ) ? buf->capacity : 4096;
+
+  while( capacity < buf->size + extra )
+  {
+    capacity *= 2;
+  }
+
+  char * data = new char[capacity];
+
+  if( buf->data != NULL )
+  {
+    memcpy( data, buf->data, buf->size );
+    delete [] buf->data;
+  }
+
+  buf->data = data;
+  buf->capacity = capacity;
+}
+
+/*
+** FUNCTION abcBufferFree
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+void abcBufferFree(abcBufferType * buf)
+{
+  if( buf->data != NULL )
+  {
+    delete [] buf->data;
+  }
+
+  buf->data = NULL;
+  buf->size = 0;
+  buf->capacity = 0;
+}
+
+/*
+** FUNCTION abcBufferAppend
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+inline void abcBufferAppend(abcBufferType * buf, const char * text, unsigned long len)
+{
+  abcBufferReserve( buf, len );
+  memcpy( &buf->data[buf->size], text, len );
+  buf->size += len;
+}
+
+inline void abcBufferAppend(abcBufferType * buf, const char * text)
+{
+  abcBufferAppend( buf, text, (unsigned long)strlen( text ) );
+}
+
+inline void abcBufferAppend(abcBufferType * buf, char c)
+{
+  abcBufferReserve( buf, 1 );
+  buf->data[buf->size++] = c;
+}
+
+/*
+** FUNCTION abcBufferAppendUInt
+**
+** DESCRIPTION
+**   Appends a number in decimal without going through the printf family.
+**
+*****************************************************************************/
+inline void abcBufferAppendUInt(abcBufferType * buf, unsigned long value)
+{
+  char digits[20];
+  unsigned int numDigits = 0;
+
+  do
+  {
+    digits[numDigits++] = (char)( '0' + ( value % 10 ) );
+    value /= 10;
+  } while( value != 0 );
+
+  abcBufferReserve( buf, numDigits );
+
+  while( numDigits > 0 )
+  {
+    buf->data[buf->size++] = digits[--numDigits];
+  }
+}
+
+/*
+** FUNCTION formatABCHeader
+**
+** DESCRIPTION
+**   
+**
+*****************************************************************************/
+void formatABCHeader(const conversionType * conv, abcBufferType * buf, unsigned int xNumber, const char * title, const char * instName, const char * inFileName, const abcKeyType * key, unsigned int unitScale)
+{
+  char line[MAX_STRING_SIZE] = { 0 };
+
+  abcBufferAppend(buf, "X: ");
+  abcBufferAppendUInt(buf, xNumber);
+  abcBufferAppend(buf, "\r\n");
+  abcBufferAppend(buf, "T: ");
+  abcBufferAppend(buf, title);
+  abcBufferAppend(buf, ' ');
+  abcBufferAppend(buf, instName);
+  abcBufferAppend(buf, "\r\n");
+  abcBufferAppend(buf, "Z: Converted by MIDI2ABC: http://www.mindexpressions.com/users/lotro/\r\n");
+  abcBufferAppend(buf, "%  From MIDI: ");
+  abcBufferAppend(buf, inFileName);
+  abcBufferAppend(buf, "\r\n");
+  sprintf_s(line, MAX_STRING_SIZE, "%%  Transposed by: %d, Time scaled by: %0.02f\r\n", 0,
+    (double)conv->stretch.num / (double)conv->stretch.den);
+  abcBufferAppend(buf, line);
+  if( conv->division != 0 )
+  {
+    /* Units are real note values, so the song tempo carries over. */
+    abcBufferAppend(buf, "L: 1/");
+    abcBufferAppendUInt(buf, conv->division / unitScale);
+    abcBufferAppend(buf, "\r\nQ: 1/4=");
+    abcBufferAppendUInt(buf, (60000000 + (conv->tempo / 2)) / conv->tempo);
+    abcBufferAppend(buf, "\r\n");
+  }
+  else
+  {
+    (void)abcTempoHeader(conv->quantizer->grid * unitScale, 16 / unitScale, line, MAX_STRING_SIZE);
+    abcBufferAppend(buf, "L: 1/");
+    abcBufferAppendUInt(buf, 16 / unitScale);
+    abcBufferAppend(buf, "\r\nQ: ");
+    abcBufferAppend(buf, line);
+    abcBufferAppend(buf, "\r\n");
+  }
+  abcBufferAppend(buf, "K: ");
+  abcBufferAppend(buf, ( key != NULL ) ? key->name : "C");
+  abcBufferAppend(buf, "\r\n\r\n");
+}
+
+/*
+** FUNCTION abcEmitterBar
+**
+** DESCRIPTION
+**   Starts a new bar, where only the key signature is in force.
+**
+*****************************************************************************/
+inline void abcEmitterBar(abcEmitterType * em)
+{
+  if( em->key == NULL )
+  {
+    return;
+  }
+
+  for( unsigned int l = 0; l < NUM_LETTERS; l++ )
+  {
+    for( unsigned int o = 0; o < NUM_WRITTEN_OCTAVES; o++ )
+    {
+      em->barAlter[l][o] = em->key->alter[l];
+    }
+  }
+}
+
+/*
+** FUNCTION abcEmitterPitch
+**
+** DESCRIPTION
+**   Appends a note name. In a key, the accidental is only written when the
+**   note differs from what the key and the bar so far would give it. Some
+**   players carry an accidental into other octaves, so writing one makes
+**   the other octaves of that letter state theirs again.
+**
+*****************************************************************************/
+inline void abcEmitterPitch(abcEmitterType * em, unsigned char note)
+{
+  const abcKeyType * key = em->key;
+  abcBufferType    * buf = em->buf;
+
+  note &= 0x7F;
+
+  if( key == NULL )
+  {
+    if( buf != NULL )
+    {
+      abcBufferAppend(buf, noteSpellings[note].text, noteSpellings[note].len);
+    }
+    return;
+  }
+
+  unsigned char letter = key->letter[note];
+  unsigned char octave = key->octave[note];
+  signed char   alt = key->alt[note];
+
+  if( em->barAlter[letter][octave] != alt )
+  {
+    if( buf != NULL )
+    {
+      abcBufferAppend(buf, "_=^"[alt + 1]);
+    }
+
+    for( unsigned int o = 0; o < NUM_WRITTEN_OCTAVES; o++ )
+    {
+      em->barAlter[letter][o] = BAR_ALTER_UNKNOWN;
+    }
+    em->barAlter[letter][octave] = alt;
+  }
+
+  if( buf != NULL )
+  {
+    abcBufferAppend(buf, key->text[note].text, key->text[note].len);
+  }
+}
+
+/*
+** FUNCTION abcEmitterInit
+**
+** DESCRIPTION
+**   Readies an emitter that appends to buf the notes of conv. With fd set
+**   to a file descriptor instead of -1, finished text is written out as it
+**   is made and buf only ever holds the current line.
+**
+*****************************************************************************/
+void abcEmitterInit(abcEmitterType * em, const conversionType * conv, abcBufferType * buf, int fd, bool fixedLength, const abcKeyType * key, unsigned int unitScale)
+{
+  ZeroMemory( em, sizeof( abcEmitterType ) );
+
+  em->conv = conv;
+  em->buf = buf;
+  em->fd = fd;
+  em->fixedLength = fixedLength;
+  em->key = key;
+  em->unitScale = unitScale;
+  em->leadTrack = -1;
+
+  for( trackListItemType * trackItem = conv->trackList; trackItem != NULL; trackItem = (trackListItemType *)trackItem->next )
+  {
+    if( trackItem->lead )
+    {
+      em->leadTrack = (int)trackItem->track;
+      break;
+    }
+  }
+
+  abcEmitterBar( em );
+}
+
+/*
+** FUNCTION abcEmitterFlush
+**
+** DESCRIPTION
+**   Hands the text made so far to the emitter's file descriptor, if it has
+**   one. Returns -1 if the write fails.
+**
+*****************************************************************************/
+int abcEmitterFlush(abcEmitterType * em)
+{
+  if( em->fd == -1 || em->buf == NULL || em->buf->size == 0 )
+  {
+    return 0;
+  }
+
+  if( _write( em->fd, em->buf->data, em->buf->size ) != (int)em->buf->size )
+  {
+    return -1;
+  }
+
+  em->buf->size = 0;
+  return 0;
+}
+
+/*
+** FUNCTION abcLengthBytes
+**
+** DESCRIPTION
+**   Size of the length written after a note or rest of the given number of
+**   base units, in ABC units of scale base units.
+**
+*****************************************************************************/
+unsigned int abcLengthBytes(unsigned long units, unsigned int scale)
+{
+  unsigned int bytes = 1;
+
+  /* Scales are powers of two, so halving reduces the fraction. */
+  while( scale > 1 && ( units % 2 ) == 0 )
+  {
+    units /= 2;
+    scale /= 2;
+  }
+
+  for( ; units >= 10; units /= 10 )
+  {
+    bytes++;
+  }
+
+  if( scale > 1 )
+  {
+    bytes += ( scale >= 10 ) ? 3 : 2;
+  }
+
+  return bytes;
+}
+
+/*
+** FUNCTION abcBufferAppendLength
+**
+** DESCRIPTION
+**   Appends the length of a note or rest of the given number of base units,
+**   as a whole number or a fraction of ABC units of scale base units.
+**
+*****************************************************************************/
+void abcBufferAppendLength(abcBufferType * buf, unsigned long units, unsigned int scale)
+{
+  while( scale > 1 && ( units % 2 ) == 0 )
+  {
+    units /= 2;
+    scale /= 2;
+  }
+
+  abcBufferAppendUInt(buf, units);
+
+  if( scale > 1 )
+  {
+    abcBufferAppend(buf, '/');
+    abcBufferAppendUInt(buf, scale);
+  }
+}
+
+/*
+** FUNCTION abcEmitterRest
+**
+** DESCRIPTION
+**   Appends a rest of the given number of base units as a single token.
+**
+*****************************************************************************/
+inline void abcEmitterRest(abcEmitterType * em, int duration)
+{
+  abcBufferType * buf = em->buf;
+
+  if( em->scaleBytes != NULL )
+  {
+    for( unsigned int s = 0; s < NUM_UNIT_SCALES; s++ )
+    {
+      em->scaleBytes[s] += 1 + abcLengthBytes((unsigned long)duration, unitScales[s]);
+    }
+  }
+
+  if( buf != NULL )
+  {
+    abcBufferAppend(buf, 'z');
+    abcBufferAppendLength(buf, (unsigned long)duration, em->unitScale);
+  }
+  em->numPrinted++;
+}
+
+/*
+** FUNCTION abcEmitterCountNote
+**
+** DESCRIPTION
+**   Adds up the bytes a note would take in each of unitScales, where it
+**   is tied over every 16 units.
+**
+*****************************************************************************/
+void abcEmitterCountNote(abcEmitterType * em, unsigned char note, int duration, bool inChord)
+{
+  unsigned int pitchBytes = noteSpellings[note].len;
+
+  for( unsigned int s = 0; s < NUM_UNIT_SCALES; s++ )
+  {
+    int          tieLength = 16 * unitScales[s];
+    unsigned int ties = ( duration > tieLength ) ? ( duration - 1 ) / tieLength : 0;
+
+    em->scaleBytes[s] += ties * ( pitchBytes + abcLengthBytes(tieLength, unitScales[s]) + ( inChord ? 0 : 1 ) )
+      + pitchBytes + abcLengthBytes(duration - ties * tieLength, unitScales[s]);
+  }
+}
+
+/*
+** FUNCTION abcEmitterGroup
+**
+** DESCRIPTION
+**   Writes out the pending chord group: the rest leading up to it, the
+**   notes, and a line break every 32 tokens. An emitter without a buffer
+**   only keeps count, which is enough to know the state it would be in.
+**
+*****************************************************************************/
+void abcEmitterGroup(abcEmitterType * em)
+{
+  abcBufferType * buf = em->buf;
+  bool inChord = ( em->groupSize > 1 );
+
+  if( em->groupSize == 0 )
+  {
+    return;
+  }
+
+  int silenceDuration = 0;
+
+  if( em->lastStartTick != em->groupStart )
+  {
+    silenceDuration = (int)emitUnits(em->conv, em->groupStart - em->lastEndTick);
+  }
+
+  if( em->barLength != 0 && em->groupStart >= em->nextBar )
+  {
+    unsigned long barStart = em->groupStart - ( em->groupStart % em->barLength );
+
+    /* The part of the rest that falls before the bar line stays in the bar
+       before, so that a bar reads the same wherever it is played from. */
+    if( em->barOpen )
+    {
+      if( silenceDuration > 0 && em->lastEndTick < barStart )
+      {
+        int beforeBar = (int)emitUnits(em->conv, barStart - em->lastEndTick);
+
+        if( beforeBar > silenceDuration )
+        {
+          beforeBar = silenceDuration;
+        }
+
+        if( beforeBar > 0 )
+        {
+          abcEmitterRest(em, beforeBar);
+          silenceDuration -= beforeBar;
+        }
+      }
+
+      if( buf != NULL )
+      {
+        abcBufferAppend(buf, '|');
+      }
+      abcEmitterBar(em);
+    }
+
+    em->nextBar = barStart + em->barLength;
+  }
+
+  em->barOpen = true;
+
+  if( silenceDuration > 0 )
+  {
+    abcEmitterRest(em, silenceDuration);
+  }
+
+  /* Wait out the longest note of the previous chord. */
+  if( em->minChordLength != em->maxChordLength )
+  {
+    int chordMakeupZ = em->maxChordLength - em->minChordLength;
+
+    em->minChordLength = 0;
+    em->maxChordLength = 0;
+
+    abcEmitterRest(em, chordMakeupZ);
+  }
+
+  if( em->fixedLength )
+  {
+    em->lastEndTick = em->groupStart + emitUnit(em->conv);
+  }
+
+  em->lastStartTick = em->groupStart;
+
+  if( inChord && buf != NULL )
+  {
+    abcBufferAppend(buf, '[');
+  }
+
+  /* Kept notes are written in the order they came in. */
+  for( unsigned int i = 1; i < em->groupKept; i++ )
+  {
+    pendingNoteType pending = em->group[i];
+    unsigned int    j = i;
+
+    for( ; j > 0 && em->group[j - 1].order > pending.order; j-- )
+    {
+      em->group[j] = em->group[j - 1];
+    }
+    em->group[j] = pending;
+  }
+
+  for( unsigned int i = 0; i < em->groupKept; i++ )
+  {
+    int noteDuration = em->group[i].duration;
+    int tieLength = 16 * em->unitScale;
+
+    if( em->scaleBytes != NULL )
+    {
+      abcEmitterCountNote(em, em->group[i].note, noteDuration, inChord);
+    }
+
+    while( noteDuration > tieLength )
+    {
+      abcEmitterPitch(em, em->group[i].note);
+      if( buf != NULL )
+      {
+        abcBufferAppendLength(buf, (unsigned long)tieLength, em->unitScale);
+        if( !inChord )
+        {
+          abcBufferAppend(buf, '-');
+        }
+      }
+      em->numPrinted++; noteDuration -= tieLength;
+    }
+
+    abcEmitterPitch(em, em->group[i].note);
+    if( buf != NULL )
+    {
+      abcBufferAppendLength(buf, (unsigned long)noteDuration, em->unitScale);
+    }
+    em->numPrinted++;
+  }
+
+  if( inChord )
+  {
+    em->minChordLength = em->groupMin;
+    em->maxChordLength = em->groupMax;
+
+    if( buf != NULL )
+    {
+      abcBufferAppend(buf, ']');
+    }
+  }
+
+  if( em->barLength == 0 && em->numPrinted >= 32 )
+  {
+    /* In a key, end the bar with the line so that accidentals never have
+       to be tracked from one line to the next. */
+    if( buf != NULL )
+    {
+      if( em->key != NULL )
+      {
+        abcBufferAppend(buf, '|');
+      }
+      abcBufferAppend(buf, "\\\r\n", 3);
+    }
+    em->numPrinted = 0;
+    abcEmitterBar(em);
+  }
+
+  em->groupSize = 0;
+  em->groupKept = 0;
+}
+
+/*
+** FUNCTION abcPendingWorse
+**
+** DESCRIPTION
+**   Tells whether pending note a is the one to drop before b: it scores
+**   lower, or scores the same and came in later.
+**
+*****************************************************************************/
+inline bool abcPendingWorse(const pendingNoteType * a, const pendingNoteType * b)
+{
+  return ( a->score < b->score ) || ( a->score == b->score && a->order > b->order );
+}
+
+/*
+** FUNCTION abcEmitterKeep
+**
+** DESCRIPTION
+**   Offers a note to the chord group being collected. The group keeps the
+**   best maxChordNotes notes in a heap with the worst on top, so a note
+**   that beats the worst replaces it in O(log n) and any other is dropped
+**   and counted.
+**
+*****************************************************************************/
+void abcEmitterKeep(abcEmitterType * em, const pendingNoteType * pending)
+{
+  pendingNoteType * heap = em->group;
+  unsigned int      i;
+
+  if( em->groupKept < em->conv->maxChordNotes )
+  {
+    i = em->groupKept++;
+
+    while( i > 0 && abcPendingWorse( pending, &heap[(i - 1) / 2] ) )
+    {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = *pending;
+    return;
+  }
+
+  em->numDropped++;
+
+  if( !abcPendingWorse( &heap[0], pending ) )
+  {
+    return;
+  }
+
+  i = 0;
+  for( ;; )
+  {
+    unsigned int child = 2 * i + 1;
+
+    if( child >= em->groupKept )
+    {
+      break;
+    }
+    if( child + 1 < em->groupKept && abcPendingWorse( &heap[child + 1], &heap[child] ) )
+    {
+      child++;
+    }
+    if( !abcPendingWorse( &heap[child], pending ) )
+    {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = *pending;
+}
+
+/*
+** FUNCTION abcEmitterNote
+**
+** DESCRIPTION
+**   Feeds the next note, in start order. A note joins the pending chord
+**   group when it starts no more than chordToleranceMs after the group's
+**   first note; otherwise the pending group is written out and the note
+**   starts a new one. Returns -1 if streamed output can't be written.
+**
+*****************************************************************************/
+int abcEmitterNote(abcEmitterType * em, noteListItemType * noteItem)
+{
+  int noteDuration = (int)emitUnits(em->conv, emitEnd(em->conv, noteItem) - emitStart(em->conv, noteItem));
+
+  if( em->fixedLength )
+  {
+    noteDuration = 1;
+  }
+
+  if( em->groupSize > 0
+      && noteItem->startTick - em->groupStartTick > em->conv->chordToleranceMs )
+  {
+    abcEmitterGroup(em);
+
+    /* Completed lines go out as soon as they are done. */
+    if( em->numPrinted == 0 && -1 == abcEmitterFlush(em) )
+    {
+      return -1;
+    }
+  }
+
+  if( em->groupSize == 0 )
+  {
+    em->groupStartTick = noteItem->startTick;
+    em->groupStart = emitStart(em->conv, noteItem);
+    em->groupMin = noteDuration;
+    em->groupMax = noteDuration;
+  }
+  else
+  {
+    if( em->groupMin > noteDuration )
+    {
+      em->groupMin = noteDuration;
+    }
+    if( em->groupMax < noteDuration )
+    {
+      em->groupMax = noteDuration;
+    }
+  }
+
+  /* Only the notes that get printed need to be kept. The lead track's
+     notes go first, then the notes furthest from the middle of the range,
+     where the tune and the bass tend to be, then the longest. */
+  pendingNoteType pending;
+  unsigned int    spread = ( noteItem->note > N_F4S ) ? noteItem->note - N_F4S : N_F4S - noteItem->note;
+
+  pending.note = noteItem->note;
+  pending.duration = noteDuration;
+  pending.order = em->groupSize;
+  pending.score = ( ( noteItem->track == em->leadTrack ) ? 0x10000UL : 0 )
+    + ( spread << 8 )
+    + ( ( noteDuration > 255 ) ? 255 : noteDuration );
+
+  abcEmitterKeep( em, &pending );
+
+  em->groupSize++;
+
+  return 0;
+}
+
+/*
+** FUNCTION abcEmitterFinish
+**
+** DESCRIPTION
+**   Writes out whatever is still pending.
+**
+*****************************************************************************/
+int abcEmitterFinish(abcEmitterType * em)
+{
+  abcEmitterGroup(em);
+
+  return abcEmitterFlush(em);
+}
+
+/*
+** FUNCTION abcRepeatAppendBars
+**
+** DESCRIPTION
+**   Appends bars first..last-1 of a tune, with a bar line between them.
+**   Their tokens are added to lineTokens, and a bar line that takes the
+**   line to 32 tokens ends it, so long repeats and endings are broken
+**   like any other run of bars.
+**
+*****************************************************************************/
+void abcRepeatAppendBars(
+  abcBufferType       * buf,
+  const char          * text,
+  const unsigned long * barStart,
+  const unsigned int  * barTokens,
+  unsigned int          first,
+  unsigned int          last,
+  unsigned int        * lineTokens
+  )
+{
+  for( unsigned int b = first; b < last; b++ )
+  {
+    if( b > first )
+    {
+      abcBufferAppend(buf, '|');
+
+      if( *lineTokens >= 32 )
+      {
+        abcBufferAppend(buf, "\\\r\n", 3);
+        *lineTokens = 0;
+      }
+    }
+    abcBufferAppend(buf, &text[barStart[b]], barStart[b + 1] - barStart[b] - 1);
+    *lineTokens += barTokens[b];
+  }
+}
+
+/*
+** FUNCTION formatABCRepeats
+**
+** DESCRIPTION
+**   Lays out a tune written as bars separated by bar lines, folding bars
+**   that are played twice in a row into |: :| repeats. A run whose last bar
+**   differs the second time round gets variant endings, |1 and :|2.
+**
+**   Each bar is hashed and a polynomial hash over the bar hashes gives any
+**   run of bars in O(1), so trying every run length up to MAX_REPEAT_BARS
+**   at every bar keeps the search linear in the number of bars. A repeat is
+**   only used once the bar text itself has been compared.
+**
+**   Lines are broken after the bar that takes them to 32 tokens, inside
+**   repeats and endings too. Returns the number of repeats written; o_Saved gets the bytes they
+**   save over writing every bar out.
+**
+*****************************************************************************/
+unsigned int formatABCRepeats(abcBufferType * buf, const char * text, unsigned long size, unsigned int * o_NumBars, unsigned int * o_NumWritten, unsigned long * o_Saved)
+{
+  const unsigned long long base = 1099511628211ULL;
+  unsigned int numBars = 1;
+
+  for( unsigned long c = 0; c < size; c++ )
+  {
+    if( text[c] == '|' )
+    {
+      numBars++;
+    }
+  }
+
+  /* barStart[b] is where bar b starts; a bar ends one before the next
+     start, on its bar line. */
+  unsigned long      * barStart = new unsigned long[numBars + 1];
+  unsigned int       * barTokens = new unsigned int[numBars];
+  unsigned long long * barHash = new unsigned long long[numBars];
+  unsigned long long * prefix = new unsigned long long[numBars + 1];
+  unsigned long long * power = new unsigned long long[MAX_REPEAT_BARS + 1];
+
+  unsigned int b = 0;
+  barStart[0] = 0;
+  barTokens[0] = 0;
+  barHash[0] = 14695981039346656037ULL;
+  for( unsigned long c = 0; c < size; c++ )
+  {
+    if( text[c] == '|' )
+    {
+      barStart[++b] = c + 1;
+      barTokens[b] = 0;
+      barHash[b] = 14695981039346656037ULL;
+      continue;
+    }
+
+    /* Every token ends in its length, which may be a fraction. */
+    if( text[c] >= '0' && text[c] <= '9'
+        && ( c + 1 == size || ( ( text[c + 1] < '0' || text[c + 1] > '9' ) && text[c + 1] != '/' ) ) )
+    {
+      barTokens[b]++;
+    }
+
+    barHash[b] = ( barHash[b] ^ (unsigned char)text[c] ) * base;
+  }
+  barStart[numBars] = size + 1;
+
+  prefix[0] = 0;
+  for( b = 0; b < numBars; b++ )
+  {
+    prefix[b + 1] = prefix[b] * base + barHash[b];
+  }
+
+  power[0] = 1;
+  for( unsigned int l = 1; l <= MAX_REPEAT_BARS; l++ )
+  {
+    power[l] = power[l - 1] * base;
+  }
+
+#define RUN_HASH(first, count) ( prefix[(first) + (count)] - prefix[(first)] * power[(count)] )
+#define RUN_BYTES(first, count) ( barStart[(first) + (count)] - barStart[(first)] )
+
+  unsigned int numRepeats = 0;
+  unsigned int numWritten = 0;
+  unsigned long saved = 0;
+  unsigned int lineTokens = 0;
+  bool         needBarLine = false;
+
+  b = 0;
+  while( b < numBars )
+  {
+    unsigned int  bestLength = 0;
+    bool          bestVariant = false;
+    unsigned long bestSaved = 0;
+
+    for( unsigned int l = 1; l <= MAX_REPEAT_BARS && b + 2 * l <= numBars; l++ )
+    {
+      /* |: l bars :| */
+      if( RUN_HASH(b, l) == RUN_HASH(b + l, l)
+          && RUN_BYTES(b, l) > 4 && RUN_BYTES(b, l) - 4 > bestSaved
+          && 0 == memcmp( &text[barStart[b]], &text[barStart[b + l]], RUN_BYTES(b, l) - 1 ) )
+      {
+        bestLength = l;
+        bestVariant = false;
+        bestSaved = RUN_BYTES(b, l) - 4;
+      }
+
+      /* |: l-1 bars |1 ending :|2 ending | */
+      if( l > 1
+          && barHash[b + l - 1] != barHash[b + 2 * l - 1]
+          && RUN_HASH(b, l - 1) == RUN_HASH(b + l, l - 1)
+          && RUN_BYTES(b, l - 1) > 8 && RUN_BYTES(b, l - 1) - 8 > bestSaved
+          && 0 == memcmp( &text[barStart[b]], &text[barStart[b + l]], RUN_BYTES(b, l - 1) - 1 ) )
+      {
+        bestLength = l;
+        bestVariant = true;
+        bestSaved = RUN_BYTES(b, l - 1) - 8;
+      }
+    }
+
+    unsigned int next = b + 1;
+
+    if( bestLength == 0 )
+    {
+      if( needBarLine )
+      {
+        abcBufferAppend(buf, '|');
+      }
+      abcRepeatAppendBars(buf, text, barStart, barTokens, b, b + 1, &lineTokens);
+      numWritten++;
+      needBarLine = true;
+    }
+    else
+    {
+      unsigned int common = bestVariant ? bestLength - 1 : bestLength;
+
+      abcBufferAppend(buf, "|:", 2);
+      abcRepeatAppendBars(buf, text, barStart, barTokens, b, b + common, &lineTokens);
+
+      if( bestVariant )
+      {
+        abcBufferAppend(buf, "|1", 2);
+        abcRepeatAppendBars(buf, text, barStart, barTokens, b + common, b + bestLength, &lineTokens);
+        abcBufferAppend(buf, ":|2", 3);
+        abcRepeatAppendBars(buf, text, barStart, barTokens, b + 2 * bestLength - 1, b + 2 * bestLength, &lineTokens);
+        numWritten += bestLength + 1;
+        needBarLine = true;
+      }
+      else
+      {
+        abcBufferAppend(buf, ":|", 2);
+        numWritten += bestLength;
+        needBarLine = false;
+      }
+
+      numRepeats++;
+      saved += bestSaved;
+      next = b + 2 * bestLength;
+    }
+
+    if( lineTokens >= 32 && next < numBars )
+    {
+      if( needBarLine )
+      {
+        abcBufferAppend(buf, '|');
+      }
+      abcBufferAppend(buf, "\\\r\n", 3);
+      lineTokens = 0;
+      needBarLine = false;
+    }
+
+    b = next;
+  }
+
+#undef RUN_HASH
+#undef RUN_BYTES
+
+  delete [] power;
+  delete [] prefix;
+  delete [] barHash;
+  delete [] barTokens;
+  delete [] barStart;
+
+  *o_NumBars = numBars;
+  *o_NumWritten = numWritten;
+  *o_Saved = saved;
+  return numRepeats;
+}
+
+/*
+** FUNCTION reportDroppedNotes
+**
+** DESCRIPTION
+**   Tells how many chord notes were left out for going over maxChordNotes.
+**
+*****************************************************************************/
+void reportDroppedNotes(const conversionType * conv, unsigned long numDropped)
+{
+  if( numDropped > 0 )
+  {
+    reportMessage(conv, "\nChord notes left out: %lu (more than %u at once)\n", numDropped, conv->maxChordNotes);
+  }
+}
+
+/*
+** FUNCTION reportFormatStats
+**
+** DESCRIPTION
+**   Reports what formatABCBody left in stats.
+**
+*****************************************************************************/
+void reportFormatStats(const conversionType * conv, const abcFormatStatsType * stats)
+{
+  reportDroppedNotes(conv, stats->numDropped);
+
+  if( stats->repeats )
+  {
+    reportMessage(conv, "\nRepeats: %u, bars written: %u of %u, %lu of %lu bytes saved\n",
+      stats->numRepeats, stats->numWritten, stats->numBars, stats->saved, stats->size);
+  }
+}
+
+/*
+** FUNCTION formatABCSegmentThread
+**
+** DESCRIPTION
+**   Thread entry for formatting one segment of a tune from the emitter
+**   state it starts in.
+**
+*****************************************************************************/
+void formatABCSegmentThread(void * param)
+{
+  abcSegmentType * segment = (abcSegmentType *)param;
+
+  segment->em.buf = &segment->buf;
+
+  for( unsigned int i = 0; i < segment->numNotes; i++ )
+  {
+    (void)abcEmitterNote(&segment->em, segment->notes[i]);
+  }
+
+  (void)abcEmitterFinish(&segment->em);
+}
+
+/*
+** FUNCTION formatABCBody
+**
+** DESCRIPTION
+**   Appends the notes of a tune from a start-sorted note array.
+**
+**   Long tunes are cut into segments where no note is sounding and the
+**   segments are formatted on one thread each. A counting pass with no
+**   text works out the emitter state at the start of every segment first,
+**   so rests, ties and line breaks come out exactly as they would from a
+**   single pass.
+**
+**   Nothing is reported from here, as parts call it on threads of their
+**   own. What there is to report is left in stats.
+**
+*****************************************************************************/
+void formatABCBody(
+  const conversionType * conv,
+  abcBufferType        * buf,
+  noteListItemType    ** notes,
+  unsigned int           numNotes,
+  bool                   fixedLength,
+  const abcKeyType     * key,
+  unsigned int           unitScale,
+  abcFormatStatsType   * stats
+  )
+{
+  abcEmitterType em;
+  unsigned int   numCores = numProcessors();
+
+  ZeroMemory( stats, sizeof( abcFormatStatsType ) );
+
+  if( numCores > MAX_SEGMENTS )
+  {
+    numCores = MAX_SEGMENTS;
+  }
+
+  unsigned int segmentSize = numNotes / numCores;
+
+  if( segmentSize < MIN_SEGMENT_NOTES )
+  {
+    segmentSize = MIN_SEGMENT_NOTES;
+  }
+
+  /* Repeats are found over the whole tune, written out in bars first. A
+     bar is four beats with -d, otherwise 16 grid units, a 4/4 bar at
+     L: 1/16. */
+  if( conv->repeats && numNotes > 0 )
+  {
+    abcBufferType bars = {};
+
+    abcEmitterInit(&em, conv, &bars, -1, fixedLength, key, unitScale);
+    em.barLength = ( conv->division != 0 ) ? conv->ppqn * 4 : emitUnit(conv) * 16;
+
+    for( unsigned int i = 0; i < numNotes; i++ )
+    {
+      (void)abcEmitterNote(&em, notes[i]);
+    }
+
+    (void)abcEmitterFinish(&em);
+
+    stats->numDropped = em.numDropped;
+    stats->repeats = true;
+    stats->numRepeats = formatABCRepeats(buf, bars.data, bars.size, &stats->numBars, &stats->numWritten, &stats->saved);
+    stats->size = bars.size;
+
+    abcBufferFree(&bars);
+    return;
+  }
+
+  if( numCores == 1 || numNotes < 2 * segmentSize )
+  {
+    abcEmitterInit(&em, conv, buf, -1, fixedLength, key, unitScale);
+
+    for( unsigned int i = 0; i < numNotes; i++ )
+    {
+      (void)abcEmitterNote(&em, notes[i]);
+    }
+
+    (void)abcEmitterFinish(&em);
+    stats->numDropped = em.numDropped;
+    return;
+  }
+
+  /*                                                                        *\
+  ============================== Find Segments ===============================
+  \*                                                                        */
+  abcSegmentType * segments = new abcSegmentType[MAX_SEGMENTS];
+  workerThreadType threads[MAX_SEGMENTS];
+  unsigned int     numSegments = 0;
+  unsigned long    lastEnd = 0;
+
+  ZeroMemory( segments, sizeof( abcSegmentType ) * MAX_SEGMENTS );
+
+  abcEmitterInit(&em, conv, NULL, -1, fixedLength, key, unitScale);
+
+  for( unsigned int i = 0; i < numNotes; i++ )
+  {
+    noteListItemType * noteItem = notes[i];
+
+    /* Cut before a note that opens a new chord group in silence. */
+    if( numSegments == 0
+        || ( numSegments < MAX_SEGMENTS
+             && i - segments[numSegments - 1].first >= segmentSize
+             && noteItem->startTick - em.groupStartTick > conv->chordToleranceMs
+             && lastEnd <= emitStart(conv, noteItem) ) )
+    {
+      abcEmitterGroup(&em);
+
+      segments[numSegments].first = i;
+      segments[numSegments].em = em;
+      segments[numSegments].notes = &notes[i];
+      numSegments++;
+    }
+
+    (void)abcEmitterNote(&em, noteItem);
+
+    if( emitEnd(conv, noteItem) > lastEnd )
+    {
+      lastEnd = emitEnd(conv, noteItem);
+    }
+  }
+
+  stats->numDropped = em.numDropped;
+
+  /*                                                                        *\
+  ============================= Format Segments ==============================
+  \*                                                                        */
+  for( unsigned int k = 0; k < numSegments; k++ )
+  {
+    unsigned int next = ( k + 1 < numSegments ) ? segments[k + 1].first : numNotes;
+
+    segments[k].numNotes = next - segments[k].first;
+
+    startWorkerThread( &threads[k], formatABCSegmentThread, &segments[k] );
+  }
+
+  for( unsigned int k = 0; k < numSegments; k++ )
+  {
+    joinWorkerThread( &threads[k] );
+
+    abcBufferAppend( buf, segments[k].buf.data, segments[k].buf.size );
+    abcBufferFree( &segments[k].buf );
+  }
+
+  delete [] segments;
+}
+
+/*
+** FUNCTION findInstrument
+**
+** DESCRIPTION
+**   Looks up an instrument by name, ignoring case. Returns NULL if there is
+**   no such instrument.
+**
+*****************************************************************************/
+const instrumentType * findInstrument(const char * name)
+{
+  for( unsigned int i = 0; i < NUM_INSTRUMENTS; i++ )
+  {
+    if( 0 == _strnicmp(name, instruments[i].name, strlen(instruments[i].name)) )
+    {
+      return &instruments[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+** FUNCTION selectUnitScale
+**
+** DESCRIPTION
+**   Picks the ABC unit for a tune from unitScales. A counting pass over the
+**   notes adds up the bytes every rest and note length would take in each
+**   unit, and the unit with the fewest that keeps the timing exact wins.
+**   Longer units mean fewer ties and shorter lengths where the notes are
+**   long, and fractions where they are short.
+**
+*****************************************************************************/
+unsigned int selectUnitScale(const conversionType * conv, noteListItemType ** notes, unsigned int numNotes, bool fixedLength)
+{
+  unsigned long  scaleBytes[NUM_UNIT_SCALES] = { 0 };
+  abcEmitterType em;
+  unsigned int   best = 0;
+
+  abcEmitterInit(&em, conv, NULL, -1, fixedLength, NULL, 1);
+  em.scaleBytes = scaleBytes;
+
+  for( unsigned int i = 0; i < numNotes; i++ )
+  {
+    (void)abcEmitterNote(&em, notes[i]);
+  }
+
+  (void)abcEmitterFinish(&em);
+
+  for( unsigned int s = 1; s < NUM_UNIT_SCALES; s++ )
+  {
+    if( scaleBytes[s] < scaleBytes[best] && abcUnitScaleFits(conv, unitScales[s]) )
+    {
+      best = s;
+    }
+  }
+
+  return unitScales[best];
+}
+
+/*
+** FUNCTION formatABCTune
+**
+** DESCRIPTION
+**   Formats one start-sorted run of notes as a complete tune.
+**
+*****************************************************************************/
+void formatABCTune(abcPartType * part)
+{
+  abcKeyType         key;
+  const abcKeyType * tuneKey = NULL;
+
+  if( !part->conv->explicitAccidentals )
+  {
+    unsigned int histogram[12] = { 0 };
+
+    for( unsigned int i = 0; i < part->numNotes; i++ )
+    {
+      histogram[part->notes[i]->note % 12]++;
+    }
+
+    selectKey( histogram, &key );
+    tuneKey = &key;
+  }
+
+  unsigned int unitScale = selectUnitScale(part->conv, part->notes, part->numNotes, part->fixedLength);
+
+  formatABCHeader(part->conv, &part->buf, part->xNumber, part->title, part->instName, part->inFileName, tuneKey, unitScale);
+
+  formatABCBody(part->conv, &part->buf, part->notes, part->numNotes, part->fixedLength, tuneKey, unitScale, &part->stats);
+}
+
+/*
+** FUNCTION formatABCPartThread
+**
+** DESCRIPTION
+**   Thread entry for formatting one part. Parts only read the conversion
+**   they belong to, and each one writes to its own buffer.
+**
+*****************************************************************************/
+void formatABCPartThread(void * param)
+{
+  formatABCTune( (abcPartType *)param );
+}
+
+/*
+** FUNCTION sortedNoteArray
+**
+** DESCRIPTION
+**   Sorts the filtered notes by start time and returns them as an array.
+**   The caller deletes the array.
+**
+*****************************************************************************/
+noteListItemType ** sortedNoteArray(conversionType * conv, unsigned int * o_NumNotes)
+{
+  unsigned int numNotes = 0;
+  noteListItemType * noteItem = NULL;
+
+  SortNoteListByStart(conv->noteFilteredList);
+
+  for( noteItem = conv->noteFilteredList; noteItem != NULL; noteItem = (noteListItemType *)noteItem->next )
+  {
+    numNotes++;
+  }
+
+  noteListItemType ** notes = new noteListItemType *[numNotes + 1];
+
+  numNotes = 0;
+  for( noteItem = conv->noteFilteredList; noteItem != NULL; noteItem = (noteListItemType *)noteItem->next )
+  {
+    notes[numNotes++] = noteItem;
+  }
+
+  *o_NumNotes = numNotes;
+  return notes;
+}
+
+/*
+** FUNCTION trimNoteData
+**
+** DESCRIPTION
+**   Tidies the lists parseMIDIData made. Format 1 files keep their tempo
+**   map in the first track, so the tracks are renumbered from 0 and that
+**   one is dropped. Drum notes and tracks left without notes go as well.
+**
+*****************************************************************************/
+void trimNoteData(conversionType * conv, unsigned int format)
+{
+  trackListItemType * trackItem = conv->trackList;
+  while( trackItem != NULL )
+  {
+    if( format == 1 )
+    {
+      trackItem->track--;
+    }
+
+    if( trackItem->track == 0 )
+    {
+      trackItem = DeleteTrack( 
+        conv->trackList, trackItem );
+    }
+    else
+    {
+      trackItem = (trackListItemType *)trackItem->next;
+    }
+  }
+
+  noteListItemType * noteItem = conv->noteList;
+  while( noteItem != NULL )
+  {
+    if( format == 1 )
+    {
+      noteItem->track--;
+    }
+
+    if( ( format == 1 && noteItem->track == 0 ) 
+        || noteItem->channel == 9 )
+    {
+      noteItem = DeleteNote( conv->noteList, noteItem );
+    }
+    else
+    {
+      noteItem = (noteListItemType *)noteItem->next;
+    }
+  }
+
+  trackItem = conv->trackList;
+  while( trackItem != NULL )
+  {
+    if( CountNotes( conv->noteList, trackItem->track ) == 0 )
+    {
+      trackItem = DeleteTrack( 
+        conv->trackList, trackItem );
+    }
+    else
+    {
+      trackItem = (trackListItemType *)trackItem->next;
+    }
+  }
+
+  /* The notes go in start order, and by pitch within a start, for good:
+     no later stage reorders them. */
+  SortNoteListByNote( conv->noteList );
+  SortNoteListByStart( conv->noteList );
+}
+
+/*
+** FUNCTION formatABCParts
+**
+** DESCRIPTION
+**   Formats each active track as its own tune, numbered from firstXNumber
+**   up, titled "<title> <track>. <name> -". The tunes are formatted on one
+**   thread each and joined in track order, so the text is the same as
+**   formatting them one by one.
+**
+**   Returns the number of tunes formatted.
+**
+*****************************************************************************/
+unsigned int formatABCParts(conversionType * conv, abcBufferType * buf, unsigned int firstXNumber, const char * title, const char * instName, const char * inFileName, bool fixedLength)
+{
+  char    titles[MAX_TRACKS][MAX_STRING_SIZE];
+  abcPartType parts[MAX_TRACKS];
+  workerThreadType threads[MAX_TRACKS];
+  unsigned int numParts = 0;
+  unsigned int numNotes = 0;
+
+  /* Split the notes by track. Each track's notes stay in start order. */
+  noteListItemType ** notes = sortedNoteArray( conv, &numNotes );
+  noteListItemType ** trackNotes = new noteListItemType *[numNotes + 1];
+  unsigned int numTrackNotes = 0;
+
+  ZeroMemory( parts, sizeof( parts ) );
+
+  trackListItemType * trackItem = conv->trackFilteredList;
+  while( trackItem != NULL && numParts < MAX_TRACKS )
+  {
+    abcPartType * part = &parts[numParts];
+
+    part->notes = &trackNotes[numTrackNotes];
+
+    for( unsigned int i = 0; i < numNotes; i++ )
+    {
+      if( notes[i]->track == trackItem->track )
+      {
+        part->notes[part->numNotes++] = notes[i];
+      }
+    }
+
+    if( part->numNotes > 0 )
+    {
+      sprintf_s(titles[numParts], MAX_STRING_SIZE, "%s %d. %s -", title, trackItem->track, trackItem->name);
+
+      part->conv = conv;
+      part->xNumber = firstXNumber + numParts;
+      part->title = titles[numParts];
+      part->instName = instName;
+      part->inFileName = inFileName;
+      part->fixedLength = fixedLength;
+
+      numTrackNotes += part->numNotes;
+      numParts++;
+    }
+
+    trackItem = (trackListItemType *)trackItem->next;
+  }
+
+  /*                                                                        *\
+  =============================== Format ABC Tunes ===========================
+  \*                                                                        */
+  for( unsigned int i = 0; i < numParts; i++ )
+  {
+    startWorkerThread( &threads[i], formatABCPartThread, &parts[i] );
+  }
+
+  for( unsigned int i = 0; i < numParts; i++ )
+  {
+    joinWorkerThread( &threads[i] );
+    reportFormatStats( conv, &parts[i].stats );
+
+    if( i > 0 )
+    {
+      abcBufferAppend( buf, "\r\n\r\n", 4 );
+    }
+    abcBufferAppend( buf, parts[i].buf.data, parts[i].buf.size );
+    abcBufferFree( &parts[i].buf );
+  }
+
+  delete [] trackNotes;
+  delete [] notes;
+
+  return numParts;
+}
+
+/*
+** FUNCTION initConversion
+**
+** DESCRIPTION
+**   Readies a conversion with no notes, the default timing grid, no time
+**   stretch and no instrument range yet.
+**
+*****************************************************************************/
+void initConversion(conversionType * conv)
+{
+  ZeroMemory( conv, sizeof( conversionType ) );
+
+  conv->stretch.num = STRETCH_DEN;
+  conv->stretch.den = STRETCH_DEN;
+
+  /* 120 beats per minute until the file says otherwise. */
+  conv->tempo = 500000;
+  conv->quantizer = selectQuantizer( MIN_TIMING_MS );
+  conv->maxChordNotes = MAX_CHORD_NOTES;
+}
+
+/*
+** FUNCTION resetConversion
+**
+** DESCRIPTION
+**   Frees the note and track lists of a conversion. The settings are kept.
+**
+*****************************************************************************/
+void resetConversion(conversionType * conv)
+{
+  ResetNoteList( conv->noteList );
+  ResetNoteList( conv->noteFilteredList );
+  ResetTrackList( conv->trackList );
+  ResetTrackList( conv->trackFilteredList );
+}
+
+/*
+** FUNCTION forkConversion
+**
+** DESCRIPTION
+**   Starts a conversion with the settings and a copy of the track list of
+**   conv, sharing its notes. Several forks can fit and filter the same
+**   notes at once, as nothing past trimNoteData changes them, so conv must
+**   outlive its forks. A fork is freed with resetForkedConversion.
+**
+*****************************************************************************/
+void forkConversion(const conversionType * conv, conversionType * fork)
+{
+  *fork = *conv;
+
+  fork->noteFilteredList = NULL;
+  fork->trackList = NULL;
+  fork->trackFilteredList = NULL;
+
+  trackListItemType * trackItem = conv->trackList;
+  while( trackItem != NULL )
+  {
+    AddTrack( fork->trackList, trackItem, 0, 0, NULL, NULL );
+    trackItem = (trackListItemType *)trackItem->next;
+  }
+}
+
+/*
+** FUNCTION resetForkedConversion
+**
+** DESCRIPTION
+**   Frees the lists a fork owns, leaving the notes it shares alone.
+**
+*****************************************************************************/
+void resetForkedConversion(conversionType * fork)
+{
+  fork->noteList = NULL;
+
+  resetConversion( fork );
+}
+
+/*
+** FUNCTION setConversionDivision
+**
+** DESCRIPTION
+**   Works out the MIDI ticks per ABC unit for a musical division once the
+**   file's PPQN is known. A file without a PPQN, or one that can not be cut
+**   into 1/division notes, is refused.
+**
+**   Returns 0 on success or -1 on error.
+**
+*****************************************************************************/
+int setConversionDivision(conversionType * conv)
+{
+  if( conv->division == 0 )
+  {
+    return 0;
+  }
+
+  if( conv->ppqn == 0 || ( conv->ppqn * 4 ) % conv->division != 0 )
+  {
+    reportMessage(conv, "ERROR: PPQN %d can not be divided into 1/%d notes.\n", conv->ppqn, conv->division);
+    return -1;
+  }
+
+  conv->pulsesPerUnit = ( conv->ppqn * 4 ) / conv->division;
+  return 0;
+}
+
+/*
+** FUNCTION initABCSettings
+**
+** DESCRIPTION
+**   Fills in the settings the command line uses when no options are given,
+**   for lute and a MIDI file read from standard input.
+**
+*****************************************************************************/
+void initABCSettings(abcSettingsType * settings)
+{
+  ZeroMemory( settings, sizeof( abcSettingsType ) );
+
+  settings->instrument = "lute";
+  settings->title = "stdin";
+  settings->fileName = "-";
+  settings->gridMs = MIN_TIMING_MS;
+  settings->division = 0;
+  settings->chordToleranceMs = 0;
+  settings->maxChordNotes = MAX_CHORD_NOTES;
+  settings->stretchNum = STRETCH_DEN;
+}
+
+/*
+** FUNCTION prepareConversion
+**
+** DESCRIPTION
+**   Reads a MIDI file held in memory into conv and fits and filters its
+**   notes for settings, the way the console tool does with -o: every track
+**   is kept and fitted to the instrument without asking. o_Instrument gets
+**   the instrument. Returns -1, with conv left empty, if the settings or
+**   the file are bad.
+**
+*****************************************************************************/
+int prepareConversion(conversionType * conv, const unsigned char * data, unsigned long size, const abcSettingsType * settings, const instrumentType ** o_Instrument)
+{
+  unsigned int format = 0;
+  unsigned int numTracks = 0;
+
+  const instrumentType * instrument = findInstrument( settings->instrument );
+  const quantizerType  * quantizer = selectQuantizer( settings->gridMs );
+
+  initConversion( conv );
+
+  if( instrument == NULL
+      || quantizer == NULL
+      || ( settings->division != 0 && settings->division != 8 && settings->division != 16
+           && settings->division != 32 && settings->division != 64 )
+      || settings->maxChordNotes < 1
+      || settings->maxChordNotes > MAX_CHORD_LIMIT
+      || settings->stretchNum < 1
+      || settings->stretchNum > STRETCH_NUM_MAX )
+  {
+    return -1;
+  }
+
+  conv->stretch.num = settings->stretchNum;
+  conv->quantizer = quantizer;
+  conv->division = settings->division;
+  conv->chordToleranceMs = settings->chordToleranceMs;
+  conv->maxChordNotes = settings->maxChordNotes;
+  conv->explicitAccidentals = settings->explicitAccidentals;
+  conv->repeats = settings->repeats;
+  conv->instMinNote = instrument->minNote;
+  conv->instMaxNote = instrument->maxNote;
+  conv->report = settings->report;
+
+  if( -1 == parseMIDIData( conv, data, size, &format, &numTracks )
+      || -1 == setConversionDivision( conv ) )
+  {
+    resetConversion( conv );
+    return -1;
+  }
+
+  trimNoteData( conv, format );
+  (void)adaptNoteData( conv, true );
+  (void)filterNoteData( conv, NULL, NULL );
+
+  *o_Instrument = instrument;
+  return 0;
+}
+
+/*
+** FUNCTION convertMIDIToABC
+**
+** DESCRIPTION
+**   Converts a MIDI file held in memory to ABC text, as prepareConversion
+**   reads it. Returns the text, which is not NUL terminated, and its
+**   length in o_Size, or NULL if the settings or the file are bad. The
+**   text is released with freeABCText. settings->stretchNum is the
+**   duration stretch picked in the tool's interactive timing menu.
+**
+**   Messages go to settings->report, and nowhere if that is NULL. Every
+**   call works on a conversion of its own, so calls may run on several
+**   threads at once.
+**
+*****************************************************************************/
+char * convertMIDIToABC(const unsigned char * data, unsigned long size, const abcSettingsType * settings, unsigned long * o_Size)
+{
+  conversionType conv;
+  abcPartType    part;
+  char         * text = NULL;
+
+  const instrumentType * instrument = NULL;
+
+  if( -1 == prepareConversion( &conv, data, size, settings, &instrument ) )
+  {
+    return NULL;
+  }
+
+  ZeroMemory( &part, sizeof( part ) );
+
+  if( settings->parts )
+  {
+    (void)formatABCParts( &conv, &part.buf, 1, settings->title, settings->instrument, settings->fileName, instrument->fixedLength );
+  }
+  else
+  {
+    part.conv = &conv;
+    part.xNumber = 1;
+    part.title = settings->title;
+    part.instName = settings->instrument;
+    part.inFileName = settings->fileName;
+    part.fixedLength = instrument->fixedLength;
+    part.notes = sortedNoteArray( &conv, &part.numNotes );
+
+    formatABCTune( &part );
+    reportFormatStats( &conv, &part.stats );
+
+    delete [] part.notes;
+  }
+
+  resetConversion( &conv );
+
+  /* An empty buffer has no storage, but NULL means failure. */
+  abcBufferReserve( &part.buf, 1 );
+
+  text = part.buf.data;
+  *o_Size = part.buf.size;
+
+  return text;
+}
+
+/*
+** FUNCTION freeABCText
+**
+** DESCRIPTION
+**   Releases text returned by convertMIDIToABC.
+**
+*****************************************************************************/
+void freeABCText(char * text)
+{
+  delete [] text;
+}
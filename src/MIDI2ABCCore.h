@@ -0,0 +1,500 @@
+#pragma once
+
+/* The conversion pipeline: reading MIDI, fitting the notes to an
+   instrument and formatting them as ABC. None of it touches the console,
+   the MIDI devices or the rest of Win32, so it also builds on its own as
+   the midi2abc_core library, which converts a file held in memory with
+   convertMIDIToABC, or renders it with renderMIDIToWAV (MIDI2ABCWav.h). */
+
+/****************************************************************************\
+
+                          D E C L A R A T I O N S
+
+\****************************************************************************/
+#define MAX_TRACKS 32
+#define MAX_CHANNELS 16
+#define MAX_PROGRAMS 127
+#define MAX_NOTES 128
+
+#define MAX_STRING_SIZE 255
+#define MAX_NOTE_LETTER_SIZE 8
+#define CENTER_OCTAVE 4
+#define MAX_NOTE_DEFINITION_SIZE 12
+
+/* Default for how many notes of one chord go into the ABC file, and the
+   most that -n allows. */
+#define MAX_CHORD_NOTES 5
+#define MAX_CHORD_LIMIT 16
+
+/* These are MIDI note values. N_C is middle-C, aka C4. These should not vary
+   from keyboard to keyboard, so these should never change. */
+#define N_C4  (0x3c)
+#define N_C4S (N_C4+1)
+#define N_D4  (N_C4+2)
+#define N_D4S (N_C4+3)
+#define N_E4  (N_C4+4)
+#define N_E4S (N_C4+5)
+#define N_F4  (N_C4+5)
+#define N_F4S (N_C4+6)
+#define N_G4  (N_C4+7)
+#define N_G4S (N_C4+8)
+#define N_A5  (N_C4+9)
+#define N_A5S (N_C4+10)
+#define N_B5  (N_C4+11)
+#define N_B5S  (N_C4+12)
+
+/* Since I'm too lazy to actually write out the MIDI note values for each
+   octave as above, I use this macro to "offset" the octave given the note
+   as identified by one of the macros above (n parameter), and a signed
+   value indicating the relative octave from that (o parameter). For
+   example:
+
+   OCTAVE(N_DS,-1) is the same as what we'd otherwise get by doing N_DS, but
+   one octave lower. WARNING: No bounds checking! (OMG, heathen!) */
+#define OCTAVE(n,o) ((n)+(12*(o)))
+
+#define LUTE_NOTE_MIN OCTAVE(N_C4,-2)
+#define LUTE_NOTE_MAX OCTAVE(N_C4,1)
+
+#define HARP_NOTE_MIN OCTAVE(N_C4,-2)
+#define HARP_NOTE_MAX OCTAVE(N_C4,1)
+
+#define THEORBO_NOTE_MIN OCTAVE(N_C4,-2)
+#define THEORBO_NOTE_MAX OCTAVE(N_C4,1)
+
+#define HORN_NOTE_MIN OCTAVE(N_C4S,-2)
+#define HORN_NOTE_MAX OCTAVE(N_C4,1)
+
+#define FLUTE_NOTE_MIN OCTAVE(N_C4,-2)
+#define FLUTE_NOTE_MAX OCTAVE(N_C4,1)
+
+#define BAGPIPES_NOTE_MIN OCTAVE(N_C4,-2)
+#define BAGPIPES_NOTE_MAX OCTAVE(N_C4,1)
+
+#define CLARINET_NOTE_MIN OCTAVE(N_D4,-2)
+#define CLARINET_NOTE_MAX OCTAVE(N_C4,1)
+
+/* Default timing grid in milliseconds. Override with -g on the command
+   line; see quantizers[] for the supported values. */
+#define MIN_TIMING_MS 60
+
+
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+/* The Win32 and MSVC names the pipeline uses, for other platforms. */
+typedef uint32_t DWORD;
+
+#define ZeroMemory(p,s) memset((p),0,(s))
+#define _strnicmp strncasecmp
+#define _write write
+#define sprintf_s snprintf
+
+inline int fopen_s(FILE ** filePtr, const char * fileName, const char * mode)
+{
+  *filePtr = fopen(fileName, mode);
+  return ( *filePtr == NULL ) ? -1 : 0;
+}
+
+inline int strcpy_s(char * dst, size_t size, const char * src)
+{
+  snprintf(dst, size, "%s", src);
+  return 0;
+}
+
+template <size_t SIZE>
+inline int strncpy_s(char (&dst)[SIZE], const char * src, size_t count)
+{
+  size_t len = ( count < SIZE - 1 ) ? count : SIZE - 1;
+
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+  return 0;
+}
+#endif
+
+
+/****************************************************************************\
+                             TYPE DEFINITIONS
+\****************************************************************************/
+typedef struct
+{
+  void * prev;
+  void * next;
+
+  unsigned char note;
+
+  unsigned long startTick; // milliseconds from file start
+  unsigned long endTick;   // milliseconds from file start
+
+  unsigned long startPulse; // MIDI ticks (PPQN) from file start
+  unsigned long endPulse;   // MIDI ticks (PPQN) from file start
+
+  unsigned char program;
+  unsigned char channel;
+  unsigned char track;
+} noteListItemType;
+
+
+typedef struct
+{
+  void * prev;
+  void * next;
+
+  char * name;
+  char * instrument;
+  unsigned int track;
+  bool   active;
+  bool   lead;
+  int    transpose;
+  bool   flip_oor;
+  bool   transpose_autoselect;
+  unsigned int program;
+} trackListItemType;
+
+/* Time stretch is kept as an exact integer ratio so that stretched ticks come
+   out the same on every run and every platform. The user adjusts it in steps
+   of 1/STRETCH_DEN, up to STRETCH_NUM_MAX/STRETCH_DEN, which keeps the
+   fixed-point products used by stretchTicks inside 64 bits. */
+#define STRETCH_DEN     10
+#define STRETCH_NUM_MAX (STRETCH_DEN * 9)
+
+typedef struct
+{
+  unsigned long num;
+  unsigned long den;
+} stretchType;
+
+/* A timing grid and its compile-time specialised arithmetic; see
+   gridQuantizer. */
+typedef struct
+{
+  unsigned long   grid;
+  long          (*delta)(long time);
+  unsigned long (*units)(unsigned long time);
+  void          (*deltas)(const unsigned long * times, long * out, unsigned int count);
+} quantizerType;
+
+/* A vprintf-like function that progress and error messages are sent to. */
+typedef int (* reportFunctionType)(const char * format, va_list args);
+
+/* Everything one conversion reads and writes on its way from MIDI to ABC.
+   Each stage is handed the conversion it works on, so conversions on
+   different threads share nothing. initConversion fills in the defaults
+   and resetConversion frees the note and track lists. */
+typedef struct
+{
+  noteListItemType    * noteList;
+  noteListItemType    * noteFilteredList;
+  trackListItemType   * trackList;
+  trackListItemType   * trackFilteredList;
+
+  stretchType           stretch;
+  unsigned char         instMinNote;
+  unsigned char         instMaxNote;
+
+  /* Song timing from the MThd header and the first tempo event. */
+  unsigned int          ppqn;
+  unsigned long         tempo;
+
+  /* When non-zero, notes are quantized to 1/division notes in MIDI ticks
+     instead of to the millisecond grid, and pulsesPerUnit holds the length
+     of one such note in MIDI ticks. */
+  const quantizerType * quantizer;
+  unsigned int          division;
+  unsigned long         pulsesPerUnit;
+
+  /* Notes starting within this many milliseconds of each other are
+     written as one chord, of at most maxChordNotes notes. */
+  unsigned long         chordToleranceMs;
+  unsigned int          maxChordNotes;
+
+  /* Write K: C with an accidental on every note instead of inferring the
+     key. */
+  bool                  explicitAccidentals;
+
+  /* Look for repeated runs of bars and write them with |: :| and variant
+     endings. */
+  bool                  repeats;
+
+  /* Where this conversion reports progress and errors, in printf style.
+     NULL, the default, keeps it quiet. Forks report through it too. */
+  reportFunctionType    report;
+
+  /* Latest note on, kept by debug builds only. */
+  unsigned long         lastNoteOnTick;
+} conversionType;
+
+/* One instrument fitted by fitInstruments. The conversion is either the
+   one the notes were read into or a fork of it. */
+typedef struct
+{
+  conversionType * conv;
+  bool             refit;        // fit the tracks to the range afresh
+  int              retval;
+  unsigned int     numDeleted;
+  unsigned int     numAdjusted;
+} instrumentFitType;
+
+/* ABC spelling of a MIDI pitch, including accidental and octave marks. */
+typedef struct
+{
+  char          text[MAX_NOTE_LETTER_SIZE];
+  unsigned char len;
+} noteSpellingType;
+
+/* ABC text is built up in one of these and written out in a single call. */
+typedef struct
+{
+  char        * data;
+  unsigned long size;
+  unsigned long capacity;
+} abcBufferType;
+
+/* What formatting a tune body has to report. The thread that formats the
+   body fills it in and reportFormatStats prints it once that thread is
+   joined, so parts formatted at the same time report in part order. */
+typedef struct
+{
+  unsigned long numDropped;  // chord notes left out
+  bool          repeats;     // the repeat search ran
+  unsigned int  numRepeats;
+  unsigned int  numBars;
+  unsigned int  numWritten;  // bars left after repeats
+  unsigned long saved;       // bytes
+  unsigned long size;        // bytes before repeats
+} abcFormatStatsType;
+
+/* One tune of an ABC file: the notes that go into it, how to head it, and
+   the buffer it gets formatted into. */
+typedef struct
+{
+  const conversionType * conv;
+  abcBufferType          buf;
+  abcFormatStatsType     stats;
+  unsigned int           xNumber;
+  const char           * title;
+  const char           * instName;
+  const char           * inFileName;
+  noteListItemType    ** notes;
+  unsigned int           numNotes;
+  bool                   fixedLength;
+} abcPartType;
+
+/* A major key signature and how every MIDI pitch is spelled in it. Letters
+   run C D E F G A B (0 to 6), alterations are -1 for flat, 0 for natural
+   and 1 for sharp, and written octaves are stored one up so that B#
+   below the lowest C still fits. */
+#define NUM_LETTERS 7
+#define NUM_WRITTEN_OCTAVES 12
+
+typedef struct
+{
+  int              sharps; // negative for flats
+  const char     * name;
+  signed char      alter[NUM_LETTERS];
+  unsigned char    letter[128];
+  signed char      alt[128];
+  unsigned char    octave[128];
+  noteSpellingType text[128]; // without accidental
+} abcKeyType;
+
+/* A note waiting in the emitter for the rest of its chord group. */
+typedef struct
+{
+  unsigned char note;
+  int           duration; // grid units, or 1/division notes
+  unsigned long score;    // notes with the lowest scores are dropped first
+  unsigned int  order;    // place in the group
+} pendingNoteType;
+
+/* Incremental ABC writer. Notes are fed in start order and only the chord
+   group they may still join is held back, so memory stays the same however
+   long the song is. */
+typedef struct
+{
+  /* Conversion whose settings the notes are written with. */
+  const conversionType * conv;
+
+  abcBufferType   * buf;
+  int               fd;
+  bool              fixedLength;
+
+  /* Key to spell notes in, or NULL to write every accidental out. */
+  const abcKeyType * key;
+
+  /* Alteration in force for each letter and written octave in the current
+     bar. BAR_ALTER_UNKNOWN forces the next note to state its own. */
+  signed char       barAlter[NUM_LETTERS][NUM_WRITTEN_OCTAVES];
+
+  /* The ABC unit as a multiple of the timing grid, or of 1/division notes.
+     A counting pass sets scaleBytes to add up the bytes each of
+     unitScales would take instead. */
+  unsigned int      unitScale;
+  unsigned long   * scaleBytes;
+
+  /* With a bar length set, a bar line goes before the first chord group
+     of each new bar instead of line breaks every 32 tokens. Bars are
+     measured on the output time line. */
+  unsigned long     barLength;
+  unsigned long     nextBar;
+  bool              barOpen;
+
+  /* Carried from one chord group to the next. */
+  int               numPrinted;
+  int               minChordLength;
+  int               maxChordLength;
+  unsigned long     lastStartTick;
+  unsigned long     lastEndTick;
+
+  /* The chord group being collected. group holds the best maxChordNotes
+     of its notes so far as a heap with the lowest score on top. */
+  unsigned int      groupSize;
+  unsigned int      groupKept;
+  unsigned long     groupStartTick; // milliseconds, for the chord tolerance
+  unsigned long     groupStart;     // on the output time line
+  int               groupMin;
+  int               groupMax;
+  pendingNoteType   group[MAX_CHORD_LIMIT];
+
+  /* Track whose notes are kept first in a full chord, or -1. */
+  int               leadTrack;
+  unsigned long     numDropped;
+} abcEmitterType;
+
+#define BAR_ALTER_UNKNOWN 2
+
+/* Playable range and note style of one LOTRO instrument. Fixed length
+   instruments (plucked strings) can't hold a note, so every note is
+   written one unit long. */
+typedef struct
+{
+  const char  * name;
+  unsigned char minNote;
+  unsigned char maxNote;
+  bool          fixedLength;
+} instrumentType;
+
+/* Settings for convertMIDIToABC, named after the command line options
+   they stand for. initABCSettings fills in the same defaults. */
+typedef struct
+{
+  const char  * instrument;          // lute, harp, ... as on the command line
+  const char  * title;               // T: of the tune
+  const char  * fileName;            // MIDI file named in the header
+  unsigned long gridMs;              // -g
+  unsigned int  division;            // -d, or 0 for the millisecond grid
+  unsigned long chordToleranceMs;    // -c
+  unsigned int  maxChordNotes;       // -n
+  unsigned long stretchNum;          // duration stretch in 1/STRETCH_DEN
+  bool          parts;               // -p
+  bool          repeats;             // -r
+  bool          explicitAccidentals; // -a
+  reportFunctionType report;         // progress and errors, or NULL
+} abcSettingsType;
+
+/****************************************************************************\
+                          FUNCTION PROTOTYPES
+\****************************************************************************/
+
+/* Conversions. */
+void reportMessage(const conversionType * conv, const char * format, ...);
+void initConversion(conversionType * conv);
+void resetConversion(conversionType * conv);
+int setConversionDivision(conversionType * conv);
+void forkConversion(const conversionType * conv, conversionType * fork);
+void resetForkedConversion(conversionType * fork);
+
+/* Note and track lists. */
+void ResetTrackList(trackListItemType * &thisTrackList);
+void ResetNoteList(noteListItemType * &thisNoteList);
+void SortNoteListByNote(noteListItemType * &thisNoteList);
+void SortNoteListByStart(noteListItemType * &thisNoteList);
+noteListItemType ** sortedNoteArray(conversionType * conv, unsigned int * o_NumNotes);
+
+/* Reading MIDI. */
+int parseMIDIData(conversionType * conv, const unsigned char * fileData, unsigned long inFileSize, unsigned int * format, unsigned int * numTracks);
+void trimNoteData(conversionType * conv, unsigned int format);
+
+/* Fitting the notes to an instrument. */
+const instrumentType * findInstrument(const char * name);
+const quantizerType * selectQuantizer(unsigned long grid);
+unsigned int analyzeNotes(
+  const conversionType * conv,
+  unsigned char instMin,
+  unsigned char instMax,
+  unsigned char track,
+           char transpose,
+
+  unsigned char * out_noteMin,
+  unsigned int  * out_numTooLow,
+  unsigned char * out_noteMax,
+  unsigned int  * out_numTooHigh,
+           char * out_rmsAdjust,
+           char * out_medianAdjust,
+           char * out_noteAverage
+  );
+void adjustTrackTranspose(conversionType * conv, int transpose);
+int adaptNoteData_AutoFit(conversionType * conv, trackListItemType * trackItem, unsigned char instMinNote, unsigned char instMaxNote);
+int adaptNoteData(conversionType * conv, bool includeLeadTrack);
+unsigned int analyzeTiming(
+    const conversionType * conv,
+    stretchType stretch,
+
+            int * out_maxQError,
+          float * out_biasLevel,
+          float * out_errorPower
+  );
+int filterNoteData(conversionType * conv, unsigned int * o_NumDeleted, unsigned int * o_NumAdjusted);
+void fitInstruments(instrumentFitType * fits, unsigned int numFits);
+
+/* Formatting ABC. */
+void abcBufferFree(abcBufferType * buf);
+void selectKey(const unsigned int * histogram, abcKeyType * key);
+unsigned int selectUnitScale(const conversionType * conv, noteListItemType ** notes, unsigned int numNotes, bool fixedLength);
+void formatABCHeader(const conversionType * conv, abcBufferType * buf, unsigned int xNumber, const char * title, const char * instName, const char * inFileName, const abcKeyType * key, unsigned int unitScale);
+void formatABCBody(
+  const conversionType * conv,
+  abcBufferType        * buf,
+  noteListItemType    ** notes,
+  unsigned int           numNotes,
+  bool                   fixedLength,
+  const abcKeyType     * key,
+  unsigned int           unitScale,
+  abcFormatStatsType   * stats
+  );
+void formatABCTune(abcPartType * part);
+unsigned int formatABCParts(conversionType * conv, abcBufferType * buf, unsigned int firstXNumber, const char * title, const char * instName, const char * inFileName, bool fixedLength);
+void abcEmitterInit(abcEmitterType * em, const conversionType * conv, abcBufferType * buf, int fd, bool fixedLength, const abcKeyType * key, unsigned int unitScale);
+int abcEmitterNote(abcEmitterType * em, noteListItemType * noteItem);
+int abcEmitterFinish(abcEmitterType * em);
+int abcEmitterFlush(abcEmitterType * em);
+void reportDroppedNotes(const conversionType * conv, unsigned long numDropped);
+void reportFormatStats(const conversionType * conv, const abcFormatStatsType * stats);
+
+/* In-process API. */
+void initABCSettings(abcSettingsType * settings);
+int prepareConversion(conversionType * conv, const unsigned char * data, unsigned long size, const abcSettingsType * settings, const instrumentType ** o_Instrument);
+char * convertMIDIToABC(const unsigned char * data, unsigned long size, const abcSettingsType * settings, unsigned long * o_Size);
+void freeABCText(char * text);
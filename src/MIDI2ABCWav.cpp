@@ -0,0 +1,448 @@
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include <math.h>
+#include "MIDI2ABCWav.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+
+/****************************************************************************\
+
+                F U N C T I O N   D E F I N I T I O N S
+
+\****************************************************************************/
+
+/*
+** FUNCTION wavMicroseconds
+**
+** DESCRIPTION
+**   Microseconds on a clock that never goes backwards, for timing renders.
+**
+*****************************************************************************/
+unsigned long long wavMicroseconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER now, frequency;
+
+  QueryPerformanceCounter( &now );
+  QueryPerformanceFrequency( &frequency );
+
+  return (unsigned long long)( now.QuadPart / frequency.QuadPart ) * 1000000ULL
+    + (unsigned long long)( now.QuadPart % frequency.QuadPart ) * 1000000ULL / (unsigned long long)frequency.QuadPart;
+#else
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return (unsigned long long)now.tv_sec * 1000000ULL + (unsigned long long)now.tv_nsec / 1000;
+#endif
+}
+
+/*
+** FUNCTION wavPutLE
+**
+** DESCRIPTION
+**   Stores a value little-endian, as WAV files want it.
+**
+*****************************************************************************/
+inline void wavPutLE(unsigned char * p, unsigned long value, unsigned int bytes)
+{
+  for( unsigned int i = 0; i < bytes; i++ )
+  {
+    p[i] = (unsigned char)( value >> ( 8 * i ) );
+  }
+}
+
+/*
+** FUNCTION wavWriteHeader
+**
+** DESCRIPTION
+**   Writes the RIFF header for numSamples mono 16-bit samples.
+**
+*****************************************************************************/
+int wavWriteHeader(FILE * wavFilePtr, unsigned long numSamples)
+{
+  unsigned char header[44] = { 0 };
+  unsigned long dataSize = numSamples * 2;
+
+  memcpy( &header[0], "RIFF", 4 );
+  wavPutLE( &header[4], 36 + dataSize, 4 );
+  memcpy( &header[8], "WAVEfmt ", 8 );
+  wavPutLE( &header[16], 16, 4 );                  // fmt chunk size
+  wavPutLE( &header[20], 1, 2 );                   // PCM
+  wavPutLE( &header[22], 1, 2 );                   // mono
+  wavPutLE( &header[24], WAV_SAMPLE_RATE, 4 );
+  wavPutLE( &header[28], WAV_SAMPLE_RATE * 2, 4 ); // bytes per second
+  wavPutLE( &header[32], 2, 2 );                   // bytes per sample
+  wavPutLE( &header[34], 16, 2 );                  // bits per sample
+  memcpy( &header[36], "data", 4 );
+  wavPutLE( &header[40], dataSize, 4 );
+
+  return ( fwrite( header, sizeof( header ), 1, wavFilePtr ) == 1 ) ? 0 : -1;
+}
+
+/*
+** FUNCTION wavStartVoice
+**
+** DESCRIPTION
+**   Starts a voice for a note. Plucked instruments die away over about a
+**   second whatever the note length; the others hold until the note ends.
+**   Both fade in over the first millisecond or so and fade out quickly at
+**   the end of the note.
+**
+*****************************************************************************/
+void wavStartVoice(wavVoicesType * voices, noteListItemType * noteItem, bool plucked)
+{
+  unsigned int v = voices->numVoices;
+
+  if( voices->numVoices < WAV_MAX_VOICES )
+  {
+    voices->numVoices++;
+  }
+  else
+  {
+    v = 0;
+    for( unsigned int w = 1; w < WAV_MAX_VOICES; w++ )
+    {
+      if( voices->gain[w] < voices->gain[v] )
+      {
+        v = w;
+      }
+    }
+  }
+
+  /* Same octave as the MIDI preview plays. */
+  int note = ( noteItem->note < N_C4 ) ? noteItem->note - 12 : noteItem->note;
+  double step = 2.0 * 3.14159265358979 * 440.0 * pow( 2.0, ( note - 69 ) / 12.0 ) / WAV_SAMPLE_RATE;
+
+  voices->re[v] = 1.0f;
+  voices->im[v] = 0.0f;
+  voices->stepRe[v] = (float)cos( step );
+  voices->stepIm[v] = (float)sin( step );
+  voices->gain[v] = 0.1f;
+  voices->attack[v] = voices->gain[v];
+  voices->decay[v] = (float)pow( 0.5, 1.0 / ( ( plucked ? 0.25 : 4.0 ) * WAV_SAMPLE_RATE ) );
+  voices->startSample[v] = (unsigned long long)noteItem->startTick * WAV_SAMPLE_RATE / 1000;
+  voices->endSample[v] = (unsigned long long)noteItem->endTick * WAV_SAMPLE_RATE / 1000;
+
+  if( voices->endSample[v] < voices->startSample[v] )
+  {
+    voices->endSample[v] = voices->startSample[v];
+  }
+}
+
+/*
+** FUNCTION wavRenderSpan
+**
+** DESCRIPTION
+**   Adds voice v into mix[from] to mix[to - 1], a stretch over which its
+**   decay does not change. attackDecay is what the attack is multiplied
+**   by every sample.
+**
+**   With SSE2 four samples are made at a time: the lanes hold the phasor,
+**   gain and attack one, two and three samples on, and every step turns
+**   the phasor by four samples and takes four samples of decay off the
+**   gain and the attack.
+**   The four outputs are added into the block with one vector add.
+**
+*****************************************************************************/
+void wavRenderSpan(wavVoicesType * voices, unsigned int v, float * mix, unsigned int from, unsigned int to, float attackDecay)
+{
+  float re = voices->re[v];
+  float im = voices->im[v];
+  float stepRe = voices->stepRe[v];
+  float stepIm = voices->stepIm[v];
+  float gain = voices->gain[v];
+  float decay = voices->decay[v];
+  float attack = voices->attack[v];
+  unsigned int i = from;
+
+#ifdef HAVE_SSE2
+  if( to - from >= 8 )
+  {
+    float laneRe[4], laneIm[4], laneGain[4], laneAttack[4];
+
+    for( int k = 0; k < 4; k++ )
+    {
+      laneRe[k] = re;
+      laneIm[k] = im;
+      laneGain[k] = gain;
+      laneAttack[k] = attack;
+
+      float r = re * stepRe - im * stepIm;
+      im = re * stepIm + im * stepRe;
+      re = r;
+      gain *= decay;
+      attack *= attackDecay;
+    }
+
+    /* After the four lanes, re and im have been turned by four steps from
+       the start, which is the stride. */
+    float strideRe = stepRe, strideIm = stepIm;
+    for( int k = 1; k < 4; k++ )
+    {
+      float r = strideRe * stepRe - strideIm * stepIm;
+      strideIm = strideRe * stepIm + strideIm * stepRe;
+      strideRe = r;
+    }
+
+    const __m128 sRe = _mm_set1_ps(strideRe);
+    const __m128 sIm = _mm_set1_ps(strideIm);
+    const __m128 sDecay = _mm_set1_ps(decay * decay * decay * decay);
+    const __m128 sAttack = _mm_set1_ps(attackDecay * attackDecay * attackDecay * attackDecay);
+    __m128 vRe = _mm_loadu_ps(laneRe);
+    __m128 vIm = _mm_loadu_ps(laneIm);
+    __m128 vGain = _mm_loadu_ps(laneGain);
+    __m128 vAttack = _mm_loadu_ps(laneAttack);
+
+    for( ; i + 4 <= to; i += 4 )
+    {
+      _mm_storeu_ps(&mix[i], _mm_add_ps(_mm_loadu_ps(&mix[i]), _mm_mul_ps(_mm_sub_ps(vGain, vAttack), vIm)));
+
+      __m128 r = _mm_sub_ps(_mm_mul_ps(vRe, sRe), _mm_mul_ps(vIm, sIm));
+      vIm = _mm_add_ps(_mm_mul_ps(vRe, sIm), _mm_mul_ps(vIm, sRe));
+      vRe = r;
+      vGain = _mm_mul_ps(vGain, sDecay);
+      vAttack = _mm_mul_ps(vAttack, sAttack);
+    }
+
+    /* Lane 0 is where the next sample starts. */
+    _mm_storeu_ps(laneRe, vRe);
+    _mm_storeu_ps(laneIm, vIm);
+    _mm_storeu_ps(laneGain, vGain);
+    _mm_storeu_ps(laneAttack, vAttack);
+    re = laneRe[0];
+    im = laneIm[0];
+    gain = laneGain[0];
+    attack = laneAttack[0];
+  }
+#endif
+
+  for( ; i < to; i++ )
+  {
+    mix[i] += ( gain - attack ) * im;
+
+    float r = re * stepRe - im * stepIm;
+    im = re * stepIm + im * stepRe;
+    re = r;
+    gain *= decay;
+    attack *= attackDecay;
+  }
+
+  voices->re[v] = re;
+  voices->im[v] = im;
+  voices->gain[v] = gain;
+  voices->attack[v] = attack;
+}
+
+/*
+** FUNCTION wavRenderVoices
+**
+** DESCRIPTION
+**   Adds every voice into the count samples of mix that start at sample
+**   blockStart, and drops the voices that have died away. Returns the
+**   number of voice samples made.
+**
+*****************************************************************************/
+unsigned long wavRenderVoices(wavVoicesType * voices, float * mix, unsigned long long blockStart, unsigned int count)
+{
+  const float   releaseDecay = (float)pow( 0.5, 1.0 / ( 0.01 * WAV_SAMPLE_RATE ) );
+  /* Faster than any decay, so gain - attack never goes below zero. */
+  const float   attackDecay = (float)pow( 0.5, 1.0 / ( 0.0005 * WAV_SAMPLE_RATE ) );
+  unsigned long numSamples = 0;
+
+  for( unsigned int v = 0; v < voices->numVoices; v++ )
+  {
+    unsigned int from = 0;
+    unsigned int to = count;
+
+    if( voices->startSample[v] > blockStart )
+    {
+      from = (unsigned int)( voices->startSample[v] - blockStart );
+    }
+
+    /* The release starts part way through the block. */
+    if( voices->endSample[v] >= blockStart + from && voices->endSample[v] < blockStart + count )
+    {
+      to = (unsigned int)( voices->endSample[v] - blockStart );
+      wavRenderSpan( voices, v, mix, from, to, attackDecay );
+      voices->decay[v] = releaseDecay;
+      from = to;
+      to = count;
+    }
+
+    wavRenderSpan( voices, v, mix, from, to, attackDecay );
+    numSamples += count - ( ( voices->startSample[v] > blockStart ) ? (unsigned int)( voices->startSample[v] - blockStart ) : 0 );
+
+    /* Keep rounding from growing or shrinking the phasor. */
+    float magnitude = sqrtf( voices->re[v] * voices->re[v] + voices->im[v] * voices->im[v] );
+    voices->re[v] /= magnitude;
+    voices->im[v] /= magnitude;
+
+    if( voices->gain[v] <= 0.0001f )
+    {
+      unsigned int last = --voices->numVoices;
+
+      voices->re[v] = voices->re[last];
+      voices->im[v] = voices->im[last];
+      voices->stepRe[v] = voices->stepRe[last];
+      voices->stepIm[v] = voices->stepIm[last];
+      voices->gain[v] = voices->gain[last];
+      voices->decay[v] = voices->decay[last];
+      voices->attack[v] = voices->attack[last];
+      voices->startSample[v] = voices->startSample[last];
+      voices->endSample[v] = voices->endSample[last];
+      v--;
+    }
+  }
+
+  return numSamples;
+}
+
+/*
+** FUNCTION renderWAV
+**
+** DESCRIPTION
+**   Renders the filtered notes of one track, or of the whole file for
+**   track 0, into a WAV file. The notes are played as they will be in the
+**   ABC file, with the stretch, quantization and note lengths applied, and
+**   as fast as the machine goes rather than in real time. The samples only
+**   depend on the notes, so the same conversion always renders the same
+**   file.
+**
+**   Returns 0 on success or -1 on error.
+**
+*****************************************************************************/
+int renderWAV(conversionType * conv, const char * wavFileName, unsigned int track, bool plucked)
+{
+  FILE               * wavFilePtr = NULL;
+  wavVoicesType        voices;
+  unsigned long        numNotes = 0;
+  unsigned long long   numVoiceSamples = 0;
+  unsigned long long   blockStart = 0;
+  float                mix[WAV_BLOCK_SAMPLES];
+  unsigned char        samples[WAV_BLOCK_SAMPLES * 2];
+  unsigned long long   startTime = wavMicroseconds();
+
+  voices.numVoices = 0;
+
+  SortNoteListByStart(conv->noteFilteredList);
+
+  fopen_s( &wavFilePtr, wavFileName, "wb" );
+  if( wavFilePtr == NULL )
+  {
+    reportMessage( conv, "ERROR: Can not open %s for writing.\n", wavFileName );
+    return -1;
+  }
+
+  int retval = wavWriteHeader( wavFilePtr, 0 );
+
+  noteListItemType * noteItem = conv->noteFilteredList;
+
+  while( retval != -1 && ( noteItem != NULL || voices.numVoices > 0 ) )
+  {
+    unsigned long long blockEnd = blockStart + WAV_BLOCK_SAMPLES;
+
+    while( noteItem != NULL
+           && (unsigned long long)noteItem->startTick * WAV_SAMPLE_RATE / 1000 < blockEnd )
+    {
+      if( ( track == 0 || noteItem->track == track )
+          && noteItem->channel != 9 )
+      {
+        wavStartVoice( &voices, noteItem, plucked );
+        numNotes++;
+      }
+      noteItem = (noteListItemType *)noteItem->next;
+    }
+
+    memset( mix, 0, sizeof( mix ) );
+
+    numVoiceSamples += wavRenderVoices( &voices, mix, blockStart, WAV_BLOCK_SAMPLES );
+
+    for( unsigned int i = 0; i < WAV_BLOCK_SAMPLES; i++ )
+    {
+      float sample = mix[i];
+
+      if( sample > 1.0f )
+      {
+        sample = 1.0f;
+      }
+      else if( sample < -1.0f )
+      {
+        sample = -1.0f;
+      }
+
+      wavPutLE( &samples[i * 2], (unsigned long)(unsigned short)(short)( sample * 32767.0f ), 2 );
+    }
+
+    if( fwrite( samples, sizeof( samples ), 1, wavFilePtr ) != 1 )
+    {
+      retval = -1;
+    }
+
+    blockStart = blockEnd;
+  }
+
+  /* Now that the length is known, the header can say it. */
+  if( retval != -1 && ( fseek( wavFilePtr, 0, SEEK_SET ) != 0
+                        || wavWriteHeader( wavFilePtr, (unsigned long)blockStart ) == -1 ) )
+  {
+    retval = -1;
+  }
+
+  fclose( wavFilePtr );
+
+  if( retval == -1 )
+  {
+    reportMessage( conv, "ERROR: Can not write %s. (Is there enough space?)\n", wavFileName );
+    return -1;
+  }
+
+  double seconds = (double)blockStart / WAV_SAMPLE_RATE;
+  double elapsed = (double)( wavMicroseconds() - startTime ) / 1000000.0;
+
+  double voiceSeconds = (double)numVoiceSamples / WAV_SAMPLE_RATE;
+
+  if( elapsed <= 0.0 )
+  {
+    elapsed = 0.000001;
+  }
+
+  reportMessage( conv, "\nWAV file: %s, %lu notes, %0.1f s rendered in %0.2f s (%0.0fx real time, %0.0f voice-seconds per second)\n",
+    wavFileName, numNotes, seconds, elapsed, seconds / elapsed, voiceSeconds / elapsed );
+
+  return 0;
+}
+
+/*
+** FUNCTION renderMIDIToWAV
+**
+** DESCRIPTION
+**   Renders a MIDI file held in memory to a WAV file, with the notes read
+**   the way convertMIDIToABC reads them for the same settings. Every track
+**   is rendered; settings->parts makes no difference here.
+**
+**   Returns 0 on success or -1 if the settings or the file are bad or the
+**   WAV file can not be written.
+**
+*****************************************************************************/
+int renderMIDIToWAV(const unsigned char * data, unsigned long size, const abcSettingsType * settings, const char * wavFileName)
+{
+  conversionType conv;
+
+  const instrumentType * instrument = NULL;
+
+  if( -1 == prepareConversion( &conv, data, size, settings, &instrument ) )
+  {
+    return -1;
+  }
+
+  int retval = renderWAV( &conv, wavFileName, 0, instrument->fixedLength );
+
+  resetConversion( &conv );
+
+  return retval;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+/* Software rendering of the filtered notes to a WAV file, the way they
+   will sound in the ABC file. Like the rest of the pipeline it needs
+   nothing from the console or the MIDI devices, so it is part of the
+   midi2abc_core library and runs on headless machines, where renders of
+   the same file can be compared sample for sample. */
+
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include "MIDI2ABCCore.h"
+
+
+/****************************************************************************\
+
+                          D E C L A R A T I O N S
+
+\****************************************************************************/
+/* The software preview renders mono 16-bit WAV in blocks of samples. At
+   most WAV_MAX_VOICES notes sound at once; a new note takes over the
+   quietest one beyond that. */
+#define WAV_SAMPLE_RATE   44100
+#define WAV_BLOCK_SAMPLES 1024
+#define WAV_MAX_VOICES    64
+
+
+/****************************************************************************\
+                             TYPE DEFINITIONS
+\****************************************************************************/
+/* The sounding notes of the software preview, one array per field so the
+   mixer can walk a field for all voices. Each voice is a sine kept as a
+   rotating phasor with a gain that decays every sample. The sine is
+   played at gain - attack, and attack dies away within a few
+   milliseconds, so a note fades in instead of clicking. */
+typedef struct
+{
+  unsigned int       numVoices;
+  float              re[WAV_MAX_VOICES];     // phasor; the output is im
+  float              im[WAV_MAX_VOICES];
+  float              stepRe[WAV_MAX_VOICES]; // rotation per sample
+  float              stepIm[WAV_MAX_VOICES];
+  float              gain[WAV_MAX_VOICES];
+  float              decay[WAV_MAX_VOICES];  // gain multiplier per sample
+  float              attack[WAV_MAX_VOICES]; // gain not yet reached
+  unsigned long long startSample[WAV_MAX_VOICES];
+  unsigned long long endSample[WAV_MAX_VOICES]; // the release starts here
+} wavVoicesType;
+
+
+/****************************************************************************\
+                          FUNCTION PROTOTYPES
+\****************************************************************************/
+int wavWriteHeader(FILE * wavFilePtr, unsigned long numSamples);
+void wavStartVoice(wavVoicesType * voices, noteListItemType * noteItem, bool plucked);
+unsigned long wavRenderVoices(wavVoicesType * voices, float * mix, unsigned long long blockStart, unsigned int count);
+int renderWAV(conversionType * conv, const char * wavFileName, unsigned int track, bool plucked);
+
+/* In-process API. */
+int renderMIDIToWAV(const unsigned char * data, unsigned long size, const abcSettingsType * settings, const char * wavFileName);
@@ -0,0 +1,59 @@
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include "MIDI2ABCTest.h"
+
+
+/****************************************************************************\
+
+                F U N C T I O N   D E F I N I T I O N S
+
+\****************************************************************************/
+
+/*
+** FUNCTION main
+**
+** DESCRIPTION
+**   MIDI2ABCConvertTest [options] <instrument> <file.mid> <expected.abc>
+**
+**   Converts the MIDI file with convertMIDIToABC and compares the text
+**   with the expected ABC file. Returns 0 when they match.
+**
+*****************************************************************************/
+int main(int argc, char * argv[])
+{
+  abcSettingsType settings;
+  char            title[MAX_STRING_SIZE];
+  unsigned long   size = 0;
+  unsigned long   abcSize = 0;
+  int             argi = parseTestSettings( &settings, title, argc, argv );
+
+  if( argi == -1 || argi + 1 != argc )
+  {
+    fprintf( stderr, "Usage: %s [options] <instrument> <file.mid> <expected.abc>\n", argv[0] );
+    return 2;
+  }
+
+  unsigned char * data = readTestFile( argv[argi - 1], &size );
+
+  if( data == NULL )
+  {
+    return 2;
+  }
+
+  char * text = convertMIDIToABC( data, size, &settings, &abcSize );
+
+  delete [] data;
+
+  if( text == NULL )
+  {
+    fprintf( stderr, "FAILED: %s could not be converted.\n", argv[argi - 1] );
+    return 1;
+  }
+
+  int retval = compareTestOutput( argv[argi], text, abcSize );
+
+  freeABCText( text );
+
+  return ( retval == 0 ) ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include "MIDI2ABCTest.h"
+
+
+/****************************************************************************\
+
+                          D E C L A R A T I O N S
+
+\****************************************************************************/
+#define NUM_TEST_THREADS 8
+#define NUM_JOBS         8
+#define MAX_JOB_ARGS     12
+
+
+/****************************************************************************\
+                             TYPE DEFINITIONS
+\****************************************************************************/
+/* One way of converting the file, and the text a conversion on its own
+   gave for it. */
+typedef struct
+{
+  abcSettingsType settings;
+  char            title[MAX_STRING_SIZE];
+  char          * expected;
+  unsigned long   expectedSize;
+} parallelJobType;
+
+/* One test thread. It runs every job, starting from a different one than
+   the other threads, so that different settings convert at once. */
+typedef struct
+{
+  const unsigned char * data;
+  unsigned long         size;
+  parallelJobType     * jobs;
+  unsigned int          first;
+  unsigned int          numFailed;
+#ifdef _WIN32
+  HANDLE                handle;
+#else
+  pthread_t             thread;
+#endif
+} parallelThreadType;
+
+
+/****************************************************************************\
+                     VARIABLE AND MACRO DECLARATIONS
+\****************************************************************************/
+/* Options and instrument of every job, as on the command line. */
+const char * const jobArgs[NUM_JOBS][MAX_JOB_ARGS] =
+{
+  { "horn" },
+  { "-p", "horn" },
+  { "-p", "-r", "-d", "16", "lute" },
+  { "-a", "-c", "100", "-n", "3", "-s", "15", "harp" },
+  { "-r", "flute" },
+  { "-g", "30", "-p", "clarinet" },
+  { "-d", "32", "-n", "2", "theorbo" },
+  { "-s", "20", "-p", "-r", "bagpipes" },
+};
+
+
+/****************************************************************************\
+
+                F U N C T I O N   D E F I N I T I O N S
+
+\****************************************************************************/
+
+/*
+** FUNCTION setupJob
+**
+** DESCRIPTION
+**   Fills in the settings of job j for the MIDI file fileName. Returns -1
+**   if its options are bad.
+**
+*****************************************************************************/
+int setupJob(parallelJobType * job, unsigned int j, char * fileName)
+{
+  char * argv[MAX_JOB_ARGS + 2];
+  int    argc = 0;
+
+  argv[argc++] = (char *)"MIDI2ABCParallelTest";
+  while( argc - 1 < MAX_JOB_ARGS && jobArgs[j][argc - 1] != NULL )
+  {
+    argv[argc] = (char *)jobArgs[j][argc - 1];
+    argc++;
+  }
+  argv[argc++] = fileName;
+
+  return ( argc == parseTestSettings( &job->settings, job->title, argc, argv ) ) ? 0 : -1;
+}
+
+/*
+** FUNCTION runJobs
+**
+** DESCRIPTION
+**   Thread entry: converts the file with every job's settings, from job
+**   first on, and counts the results that differ from the job's own.
+**
+*****************************************************************************/
+#ifdef _WIN32
+DWORD WINAPI runJobs(LPVOID param)
+#else
+void * runJobs(void * param)
+#endif
+{
+  parallelThreadType * thread = (parallelThreadType *)param;
+
+  for( unsigned int k = 0; k < NUM_JOBS; k++ )
+  {
+    parallelJobType * job = &thread->jobs[( thread->first + k ) % NUM_JOBS];
+    unsigned long     abcSize = 0;
+    char            * text = convertMIDIToABC( thread->data, thread->size, &job->settings, &abcSize );
+
+    if( text == NULL
+        || abcSize != job->expectedSize
+        || 0 != memcmp( text, job->expected, abcSize ) )
+    {
+      thread->numFailed++;
+    }
+
+    if( text != NULL )
+    {
+      freeABCText( text );
+    }
+  }
+
+  return 0;
+}
+
+/*
+** FUNCTION main
+**
+** DESCRIPTION
+**   MIDI2ABCParallelTest <file.mid>
+**
+**   Converts the MIDI file once for each job, one at a time, then again
+**   on NUM_TEST_THREADS threads at once. Every result of the second round
+**   has to match the first. Returns 0 when they all do.
+**
+*****************************************************************************/
+int main(int argc, char * argv[])
+{
+  parallelJobType    jobs[NUM_JOBS];
+  parallelThreadType threads[NUM_TEST_THREADS];
+  unsigned long      size = 0;
+  unsigned int       numFailed = 0;
+  int                retval = 0;
+
+  if( argc != 2 )
+  {
+    fprintf( stderr, "Usage: %s <file.mid>\n", argv[0] );
+    return 2;
+  }
+
+  unsigned char * data = readTestFile( argv[1], &size );
+
+  if( data == NULL )
+  {
+    return 2;
+  }
+
+  /*                                                                        *\
+  ================================ One at a Time =============================
+  \*                                                                        */
+  ZeroMemory( jobs, sizeof( jobs ) );
+
+  for( unsigned int j = 0; j < NUM_JOBS && retval == 0; j++ )
+  {
+    if( -1 == setupJob( &jobs[j], j, argv[1] ) )
+    {
+      retval = 2;
+      break;
+    }
+
+    jobs[j].expected = convertMIDIToABC( data, size, &jobs[j].settings, &jobs[j].expectedSize );
+
+    if( jobs[j].expected == NULL )
+    {
+      fprintf( stderr, "FAILED: Job %u could not convert %s.\n", j, argv[1] );
+      retval = 1;
+    }
+  }
+
+  /*                                                                        *\
+  ================================== All at Once =============================
+  \*                                                                        */
+  if( retval == 0 )
+  {
+    ZeroMemory( threads, sizeof( threads ) );
+
+    for( unsigned int t = 0; t < NUM_TEST_THREADS; t++ )
+    {
+      threads[t].data = data;
+      threads[t].size = size;
+      threads[t].jobs = jobs;
+      threads[t].first = t % NUM_JOBS;
+#ifdef _WIN32
+      threads[t].handle = CreateThread( NULL, 0, runJobs, &threads[t], 0, NULL );
+#else
+      (void)pthread_create( &threads[t].thread, NULL, runJobs, &threads[t] );
+#endif
+    }
+
+    for( unsigned int t = 0; t < NUM_TEST_THREADS; t++ )
+    {
+#ifdef _WIN32
+      WaitForSingleObject( threads[t].handle, INFINITE );
+      CloseHandle( threads[t].handle );
+#else
+      (void)pthread_join( threads[t].thread, NULL );
+#endif
+      numFailed += threads[t].numFailed;
+    }
+
+    if( numFailed > 0 )
+    {
+      fprintf( stderr, "FAILED: %u of %u conversions on %u threads differ from converting one at a time.\n",
+        numFailed, NUM_TEST_THREADS * NUM_JOBS, NUM_TEST_THREADS );
+      retval = 1;
+    }
+  }
+
+  for( unsigned int j = 0; j < NUM_JOBS; j++ )
+  {
+    if( jobs[j].expected != NULL )
+    {
+      freeABCText( jobs[j].expected );
+    }
+  }
+
+  delete [] data;
+
+  return retval;
+}
@@ -0,0 +1,77 @@
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include "MIDI2ABCTest.h"
+#include "MIDI2ABCWav.h"
+
+
+/****************************************************************************\
+
+                F U N C T I O N   D E F I N I T I O N S
+
+\****************************************************************************/
+
+/*
+** FUNCTION main
+**
+** DESCRIPTION
+**   MIDI2ABCRenderTest [options] <instrument> <file.mid> <expected.wav>
+**
+**   Renders the MIDI file with renderMIDIToWAV into the working directory
+**   and compares the WAV file with the expected one. The render is only
+**   kept, as <expected file name>.actual, when they differ. Returns 0 when
+**   they match.
+**
+*****************************************************************************/
+int main(int argc, char * argv[])
+{
+  abcSettingsType settings;
+  char            title[MAX_STRING_SIZE];
+  char            wavFileName[MAX_STRING_SIZE];
+  unsigned long   size = 0;
+  unsigned long   wavSize = 0;
+  int             argi = parseTestSettings( &settings, title, argc, argv );
+
+  if( argi == -1 || argi + 1 != argc )
+  {
+    fprintf( stderr, "Usage: %s [options] <instrument> <file.mid> <expected.wav>\n", argv[0] );
+    return 2;
+  }
+
+  unsigned char * data = readTestFile( argv[argi - 1], &size );
+
+  if( data == NULL )
+  {
+    return 2;
+  }
+
+  sprintf_s( wavFileName, MAX_STRING_SIZE, "%s.actual", testBaseName( argv[argi] ) );
+
+  int retval = renderMIDIToWAV( data, size, &settings, wavFileName );
+
+  delete [] data;
+
+  if( retval == -1 )
+  {
+    fprintf( stderr, "FAILED: %s could not be rendered.\n", argv[argi - 1] );
+    return 1;
+  }
+
+  unsigned char * wav = readTestFile( wavFileName, &wavSize );
+
+  if( wav == NULL )
+  {
+    return 1;
+  }
+
+  retval = compareTestOutput( argv[argi], (const char *)wav, wavSize );
+
+  delete [] wav;
+
+  if( retval == 0 )
+  {
+    (void)remove( wavFileName );
+  }
+
+  return ( retval == 0 ) ? 0 : 1;
+}
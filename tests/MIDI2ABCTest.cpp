@@ -0,0 +1,222 @@
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include "MIDI2ABCTest.h"
+
+
+/****************************************************************************\
+
+                F U N C T I O N   D E F I N I T I O N S
+
+\****************************************************************************/
+
+/*
+** FUNCTION readTestFile
+**
+** DESCRIPTION
+**   Reads a whole file into a buffer released with delete []. Returns NULL
+**   if it can't be read.
+**
+*****************************************************************************/
+unsigned char * readTestFile(const char * fileName, unsigned long * o_Size)
+{
+  FILE          * filePtr = NULL;
+  unsigned char * data = NULL;
+  long            size = 0;
+
+  if( 0 != fopen_s( &filePtr, fileName, "rb" ) )
+  {
+    fprintf( stderr, "ERROR: Can not open %s.\n", fileName );
+    return NULL;
+  }
+
+  if( 0 == fseek( filePtr, 0, SEEK_END ) )
+  {
+    size = ftell( filePtr );
+  }
+
+  /* One more byte so an empty file still gets a buffer. */
+  if( size >= 0 && 0 == fseek( filePtr, 0, SEEK_SET ) )
+  {
+    data = new unsigned char[size + 1];
+
+    if( fread( data, 1, (size_t)size, filePtr ) != (size_t)size )
+    {
+      delete [] data;
+      data = NULL;
+    }
+  }
+
+  fclose( filePtr );
+
+  if( data == NULL )
+  {
+    fprintf( stderr, "ERROR: Can not read %s.\n", fileName );
+    return NULL;
+  }
+
+  *o_Size = (unsigned long)size;
+  return data;
+}
+
+/*
+** FUNCTION testBaseName
+**
+** DESCRIPTION
+**   The file name part of a path.
+**
+*****************************************************************************/
+const char * testBaseName(const char * path)
+{
+  const char * baseName = path + strlen( path );
+
+  while( baseName != path && baseName[-1] != '/' && baseName[-1] != '\\' )
+  {
+    baseName--;
+  }
+
+  return baseName;
+}
+
+/*
+** FUNCTION parseTestSettings
+**
+** DESCRIPTION
+**   Fills in settings from a command line laid out like the tool's:
+**   options, named as the tool names them plus -s for the stretch in
+**   tenths, then the instrument and the MIDI file. The title is the MIDI
+**   file's name without its directory or extension, so results do not
+**   depend on where the tests run; title must hold MAX_STRING_SIZE
+**   characters.
+**
+**   Returns the index of the first argument after the MIDI file, or -1 if
+**   the command line is bad.
+**
+*****************************************************************************/
+int parseTestSettings(abcSettingsType * settings, char * title, int argc, char * argv[])
+{
+  int argi = 1;
+
+  initABCSettings( settings );
+
+  while( argi < argc && argv[argi][0] == '-' )
+  {
+    if( 0 == strcmp( argv[argi], "-p" ) )
+    {
+      settings->parts = true;
+    }
+    else if( 0 == strcmp( argv[argi], "-r" ) )
+    {
+      settings->repeats = true;
+    }
+    else if( 0 == strcmp( argv[argi], "-a" ) )
+    {
+      settings->explicitAccidentals = true;
+    }
+    else if( argi + 1 < argc && 0 == strcmp( argv[argi], "-g" ) )
+    {
+      settings->gridMs = strtoul( argv[++argi], NULL, 10 );
+    }
+    else if( argi + 1 < argc && 0 == strcmp( argv[argi], "-d" ) )
+    {
+      settings->division = (unsigned int)strtoul( argv[++argi], NULL, 10 );
+    }
+    else if( argi + 1 < argc && 0 == strcmp( argv[argi], "-c" ) )
+    {
+      settings->chordToleranceMs = strtoul( argv[++argi], NULL, 10 );
+    }
+    else if( argi + 1 < argc && 0 == strcmp( argv[argi], "-n" ) )
+    {
+      settings->maxChordNotes = (unsigned int)strtoul( argv[++argi], NULL, 10 );
+    }
+    else if( argi + 1 < argc && 0 == strcmp( argv[argi], "-s" ) )
+    {
+      settings->stretchNum = strtoul( argv[++argi], NULL, 10 );
+    }
+    else
+    {
+      fprintf( stderr, "ERROR: Unknown option %s.\n", argv[argi] );
+      return -1;
+    }
+    argi++;
+  }
+
+  if( argi + 2 > argc )
+  {
+    fprintf( stderr, "ERROR: Expected an instrument and a MIDI file.\n" );
+    return -1;
+  }
+
+  settings->instrument = argv[argi];
+  settings->fileName = testBaseName( argv[argi + 1] );
+
+  strcpy_s( title, MAX_STRING_SIZE, settings->fileName );
+
+  char * extension = strrchr( title, '.' );
+
+  if( extension != NULL )
+  {
+    *extension = '\0';
+  }
+
+  settings->title = title;
+
+  return argi + 2;
+}
+
+/*
+** FUNCTION compareTestOutput
+**
+** DESCRIPTION
+**   Compares output with the contents of expectedFileName. On a mismatch
+**   the first difference is reported and the output is written to the
+**   working directory as <expected file name>.actual. Returns 0 when they
+**   match.
+**
+*****************************************************************************/
+int compareTestOutput(const char * expectedFileName, const char * actual, unsigned long actualSize)
+{
+  unsigned long   expectedSize = 0;
+  unsigned char * expected = readTestFile( expectedFileName, &expectedSize );
+  unsigned long   offset = 0;
+  unsigned long   line = 1;
+
+  if( expected == NULL )
+  {
+    return -1;
+  }
+
+  while( offset < expectedSize && offset < actualSize
+         && expected[offset] == (unsigned char)actual[offset] )
+  {
+    if( actual[offset] == '\n' )
+    {
+      line++;
+    }
+    offset++;
+  }
+
+  delete [] expected;
+
+  if( offset == expectedSize && offset == actualSize )
+  {
+    return 0;
+  }
+
+  fprintf( stderr, "FAILED: The output (%lu bytes) differs from %s (%lu bytes) at byte %lu, line %lu.\n",
+    actualSize, expectedFileName, expectedSize, offset, line );
+
+  char   actualFileName[MAX_STRING_SIZE];
+  FILE * filePtr = NULL;
+
+  sprintf_s( actualFileName, MAX_STRING_SIZE, "%s.actual", testBaseName( expectedFileName ) );
+
+  if( 0 == fopen_s( &filePtr, actualFileName, "wb" ) )
+  {
+    (void)fwrite( actual, 1, actualSize, filePtr );
+    fclose( filePtr );
+    fprintf( stderr, "The output is in %s.\n", actualFileName );
+  }
+
+  return -1;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+/* Helpers shared by the test programs. They run the portable pipeline on
+   the files in tests/data and compare what comes out against the checked
+   in results byte for byte. */
+
+/****************************************************************************\
+                              HEADER INCLUDES
+\****************************************************************************/
+#include "MIDI2ABCCore.h"
+
+
+/****************************************************************************\
+                          FUNCTION PROTOTYPES
+\****************************************************************************/
+unsigned char * readTestFile(const char * fileName, unsigned long * o_Size);
+const char * testBaseName(const char * path);
+int parseTestSettings(abcSettingsType * settings, char * title, int argc, char * argv[]);
+int compareTestOutput(const char * expectedFileName, const char * actual, unsigned long actualSize);